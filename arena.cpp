@@ -0,0 +1,190 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "arena.hpp"
+
+#include <cerrno>
+#include <cstdint>
+
+#include "mcmalloc_api.hpp"
+
+namespace mc {
+// NOTE: # of cached blocks per thread (16MB)
+const size_t arenaBlockCacheMaxN = 256;
+
+thread_local ArenaBlockCache arenaBlockCache;
+
+ArenaBlock *ArenaBlockCache::Pop() {
+  if (_head == nullptr) return nullptr;
+  ArenaBlock *block = _head;
+  _head = block->Next();
+  if (_head == nullptr) _tail = nullptr;
+  _n--;
+  return block;
+}
+
+void ArenaBlockCache::PushList(ArenaBlock *head, ArenaBlock *tail, size_t n) {
+  if (head == nullptr) return;
+  // NOTE: O(1) splice
+  tail->Next() = _head;
+  if (_head == nullptr) _tail = tail;
+  _head = head;
+  _n += n;
+
+  while (_n > arenaBlockCacheMaxN) {
+    ArenaBlock *block = Pop();
+    int ret = munmapWrapper((void *)block, block->Size());
+    eassert(ret != -1, "munmap result is -1: errno=%d", errno);
+  }
+}
+
+void ArenaBlockCache::Term() {
+  ArenaBlock *block;
+  while ((block = Pop()) != nullptr) {
+    int ret = munmapWrapper((void *)block, block->Size());
+    eassert(ret != -1, "munmap result is -1: errno=%d", errno);
+  }
+}
+
+void arenaTerm() { arenaBlockCache.Term(); }
+
+ArenaBlock *Arena::NewBlock(size_t blockSize) {
+  ArenaBlock *block = nullptr;
+  if (blockSize == DefaultBlockSize) block = arenaBlockCache.Pop();
+  if (block == nullptr) {
+    block = (ArenaBlock *)batchMmapWrapper(blockSize);
+    if (block == nullptr) return nullptr;
+    block->Size() = blockSize;
+  }
+  block->Next() = nullptr;
+  return block;
+}
+
+void Arena::DeleteBlocks(ArenaBlock *head, ArenaBlock *tail, size_t n) {
+  if (head == nullptr) return;
+  if (_blockSize == DefaultBlockSize) {
+    arenaBlockCache.PushList(head, tail, n);
+    return;
+  }
+  while (head != nullptr) {
+    ArenaBlock *next = head == tail ? nullptr : head->Next();
+    int ret = munmapWrapper((void *)head, head->Size());
+    eassert(ret != -1, "munmap result is -1: errno=%d", errno);
+    head = next;
+  }
+}
+
+void Arena::DeleteLargeBlocks() {
+  while (_largeBlocks != nullptr) {
+    ArenaBlock *next = _largeBlocks->Next();
+    int ret = munmapWrapper((void *)_largeBlocks, _largeBlocks->Size());
+    eassert(ret != -1, "munmap result is -1: errno=%d", errno);
+    _largeBlocks = next;
+  }
+}
+
+Arena *Arena::New(size_t blockSize) {
+  if (blockSize == 0) blockSize = DefaultBlockSize;
+  blockSize = ALIGN(blockSize, PAGE_SIZE);
+
+  ArenaBlock *block = NewBlock(blockSize);
+  if (block == nullptr) return nullptr;
+
+  Arena *arena = (Arena *)block->Begin();
+  arena->_blockSize = blockSize;
+  arena->_blocks = arena->_firstBlock = block;
+  arena->_secondBlock = nullptr;
+  arena->_nBlocks = 1;
+  arena->_largeBlocks = nullptr;
+  arena->_ptr = (uintptr_t)arena + sizeof(Arena);
+  arena->_end = block->End();
+  return arena;
+}
+
+void Arena::Reset() {
+  DeleteLargeBlocks();
+  // NOTE: keep the first block which holds this object
+  if (_secondBlock != nullptr)
+    DeleteBlocks(_blocks, _secondBlock, _nBlocks - 1);
+  _blocks = _firstBlock;
+  _secondBlock = nullptr;
+  _nBlocks = 1;
+  _ptr = (uintptr_t)this + sizeof(Arena);
+  _end = _firstBlock->End();
+}
+
+void Arena::Delete() {
+  DeleteLargeBlocks();
+  DeleteBlocks(_blocks, _firstBlock, _nBlocks);
+}
+
+void *Arena::AllocSlow(size_t size, size_t alignment) {
+  // NOTE: size + alignment (and the mapping of it) can overflow
+  size_t need;
+  if (UNLIKELY(__builtin_add_overflow(size, alignment, &need) ||
+               need > SIZE_MAX - sizeof(ArenaBlock) - PAGE_SIZE)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  // NOTE: larger than a block: dedicated mapping
+  if (need > _blockSize - sizeof(ArenaBlock)) {
+    size_t mmapSize = ALIGN(sizeof(ArenaBlock) + need, PAGE_SIZE);
+    ArenaBlock *block = (ArenaBlock *)batchMmapWrapper(mmapSize);
+    if (block == nullptr) return nullptr;
+    block->Size() = mmapSize;
+    block->Next() = _largeBlocks;
+    _largeBlocks = block;
+    return (void *)ALIGN(block->Begin(), alignment);
+  }
+
+  ArenaBlock *block = NewBlock(_blockSize);
+  if (block == nullptr) return nullptr;
+  block->Next() = _blocks;
+  if (_blocks == _firstBlock) _secondBlock = block;
+  _blocks = block;
+  _nBlocks++;
+  // NOTE: the request fits in the new block (need <= its body)
+  uintptr_t p = ALIGN(block->Begin(), alignment);
+  _ptr = p + size;
+  _end = block->End();
+  return (void *)p;
+}
+}  // namespace mc
+
+mc_arena_t *mc_arena_create(size_t blockSize) {
+  return (mc_arena_t *)mc::Arena::New(blockSize);
+}
+
+void *mc_arena_alloc(mc_arena_t *arena, size_t size) {
+  return ((mc::Arena *)arena)->Alloc(size, 16);
+}
+
+void *mc_arena_memalign(mc_arena_t *arena, size_t alignment, size_t size) {
+  if (alignment < 16) alignment = 16;
+  if (UNLIKELY(!isPower2(alignment))) return nullptr;
+  return ((mc::Arena *)arena)->Alloc(size, alignment);
+}
+
+void mc_arena_reset(mc_arena_t *arena) {
+  if (arena == nullptr) return;
+  ((mc::Arena *)arena)->Reset();
+}
+
+void mc_arena_destroy(mc_arena_t *arena) {
+  if (arena == nullptr) return;
+  ((mc::Arena *)arena)->Delete();
+}
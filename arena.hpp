@@ -0,0 +1,94 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "batch_mmap.hpp"
+#include "debug.hpp"
+#include "memory_chunk_size.hpp"
+#include "misc.hpp"
+
+namespace mc {
+class ArenaBlock {
+ public:
+  inline ArenaBlock *&Next() { return _next; }
+  inline size_t &Size() { return _size; }
+  inline uintptr_t Begin() { return (uintptr_t)this + sizeof(ArenaBlock); }
+  inline uintptr_t End() { return (uintptr_t)this + _size; }
+
+ private:
+  ArenaBlock *_next;
+  size_t _size;
+};
+
+// NOTE: per-thread cache of default-size blocks (recycled in bulk)
+class ArenaBlockCache {
+ public:
+  ArenaBlock *Pop();
+  void PushList(ArenaBlock *head, ArenaBlock *tail, size_t n);
+  void Term();
+
+ private:
+  ArenaBlock *_head;
+  ArenaBlock *_tail;
+  size_t _n;
+};
+
+// NOTE: bump-pointer region allocator without chunk headers
+// NOTE: the Arena object itself is placed in the first block
+class Arena {
+ public:
+  static const size_t DefaultBlockSize = 64 * 1024;
+
+  static Arena *New(size_t blockSize);
+  void Delete();
+  void Reset();
+
+  inline void *Alloc(size_t size, size_t alignment) {
+    // NOTE: requires: alignment is a power of 2
+    uintptr_t p = (_ptr + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (LIKELY(p + size <= _end && p + size >= p)) {
+      _ptr = p + size;
+      return (void *)p;
+    }
+    return AllocSlow(size, alignment);
+  }
+
+ private:
+  void *AllocSlow(size_t size, size_t alignment);
+  static ArenaBlock *NewBlock(size_t blockSize);
+  void DeleteBlocks(ArenaBlock *head, ArenaBlock *tail, size_t n);
+  void DeleteLargeBlocks();
+
+  uintptr_t _ptr;
+  uintptr_t _end;
+  size_t _blockSize;
+  // NOTE: (newest) _blocks -> ... -> _secondBlock -> _firstBlock (oldest)
+  ArenaBlock *_blocks;
+  ArenaBlock *_secondBlock;
+  ArenaBlock *_firstBlock;
+  size_t _nBlocks;
+  // NOTE: blocks for allocation larger than the block size
+  ArenaBlock *_largeBlocks;
+};
+
+// NOTE: unmap cached blocks of the current thread
+void arenaTerm();
+}  // namespace mc
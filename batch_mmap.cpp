@@ -17,18 +17,134 @@
 
 #include "batch_mmap.hpp"
 
+#include "latency_stat.hpp"
+#include "ownership_map.hpp"
+#include "prefault.hpp"
+
 // #define NoBatchMallocPattern true
 
+MmapStat mmapStat;
+
+namespace {
+// NOTE: >= # of thread indices
+const int BatchTailSlotN = 256;
+// NOTE: the batch pool (head, size) of each thread (for statistics)
+struct BatchTail {
+  std::atomic<void*> head;
+  std::atomic<size_t> size;
+};
+BatchTail batchTails[BatchTailSlotN];
+thread_local BatchTail* batchTail = nullptr;
+
+inline void publishTail(void* head, size_t size) {
+  if (batchTail == nullptr) return;
+  batchTail->size.store(size, std::memory_order_relaxed);
+  batchTail->head.store(head, std::memory_order_release);
+}
+
+void* batchMmapImple(void* addr, size_t length, int prot, int flags, int fd,
+                     off_t offset, int threadIndex);
+inline void* timedMmap(void* addr, size_t length, int prot, int flags, int fd,
+                       off_t offset) {
+  mc::LatencyScope scope(mc::LatencyMmapSyscall);
+  void* p = mmap(addr, length, prot, flags, fd, offset);
+  if (p == (void*)-1) return p;
+  // NOTE: unmarked pages would be freed by the next free(3)
+  if (UNLIKELY(!mc::ownershipMap.Set(p, length))) {
+    munmap(p, length);
+    return (void*)-1;
+  }
+  mmapStat.nMmap.fetch_add(1, std::memory_order_relaxed);
+  mmapStat.mappedBytes.fetch_add(length, std::memory_order_relaxed);
+  return p;
+}
+}  // namespace
+
 void batchMmapTerm() { batchMmapWrapper((size_t)~0); }
 
-void* batchMmapWrapper(size_t length) {
+void batchMmapBind(int threadIndex) {
+  if (threadIndex >= 0 && threadIndex < BatchTailSlotN)
+    batchTail = &batchTails[threadIndex];
+}
+
+bool batchMmapTail(int threadIndex, void** head, size_t* size) {
+  if (threadIndex < 0 || threadIndex >= BatchTailSlotN) return false;
+  BatchTail& tail = batchTails[threadIndex];
+  *head = tail.head.load(std::memory_order_acquire);
+  *size = tail.size.load(std::memory_order_relaxed);
+  return *head != nullptr && *size >= PAGE_SIZE;
+}
+
+void* batchMmapWrapper(size_t length, int threadIndex) {
   const int devZero = -1;
-  return batchMmap(nullptr, length, PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, devZero, 0);
+  return batchMmapImple(nullptr, length, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, devZero,
+                        0, threadIndex);
+}
+
+void* directMmapWrapper(size_t length, bool populateFlag) {
+  const int devZero = -1;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#ifdef MAP_POPULATE
+  if (populateFlag) flags |= MAP_POPULATE;
+#else
+  UNUSED_PARAM(populateFlag);
+#endif
+  void* p = mmap(nullptr, ALIGN(length, PAGE_SIZE), PROT_READ | PROT_WRITE,
+                 flags, devZero, 0);
+  if (p == (void*)-1) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  if (UNLIKELY(!mc::ownershipMap.Set(p, ALIGN(length, PAGE_SIZE)))) {
+    munmap(p, ALIGN(length, PAGE_SIZE));
+    errno = ENOMEM;
+    return nullptr;
+  }
+  mmapStat.nMmap.fetch_add(1, std::memory_order_relaxed);
+  mmapStat.mappedBytes.fetch_add(ALIGN(length, PAGE_SIZE),
+                                 std::memory_order_relaxed);
+  return p;
+}
+
+void* fileMmapWrapper(size_t length, int fd, off_t offset, bool ownFlag) {
+  length = ALIGN(length, PAGE_SIZE);
+  void* p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                 offset);
+  if (p == (void*)-1) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  if (ownFlag && UNLIKELY(!mc::ownershipMap.Set(p, length))) {
+    munmap(p, length);
+    errno = ENOMEM;
+    return nullptr;
+  }
+  mmapStat.nMmap.fetch_add(1, std::memory_order_relaxed);
+  mmapStat.mappedBytes.fetch_add(length, std::memory_order_relaxed);
+  return p;
+}
+
+int munmapWrapper(void* addr, size_t length) {
+  // NOTE: cleared first (the pages can be mapped by others right after)
+  mc::ownershipMap.Clear(addr, length);
+  int ret = munmap(addr, length);
+  if (ret == 0)
+    mmapStat.unmappedBytes.fetch_add(ALIGN(length, PAGE_SIZE),
+                                     std::memory_order_relaxed);
+  else
+    mc::ownershipMap.Set(addr, length);
+  return ret;
 }
 
 void* batchMmap(void* addr, size_t length, int prot, int flags, int fd,
                 off_t offset) {
+  return batchMmapImple(addr, length, prot, flags, fd, offset, -1);
+}
+
+namespace {
+void* batchMmapImple(void* addr, size_t length, int prot, int flags, int fd,
+                     off_t offset, int threadIndex) {
   thread_local void* head = nullptr;
   thread_local size_t size = 0;
 
@@ -36,10 +152,11 @@ void* batchMmap(void* addr, size_t length, int prot, int flags, int fd,
     if (head != nullptr && size >= PAGE_SIZE) {
       // NOTE: basically, size is a multiple of PAGE_SIZE
       size_t munmapSize = ALIGN(size, PAGE_SIZE);
-      int ret = munmap(head, munmapSize);
+      int ret = munmapWrapper(head, munmapSize);
       eassert(ret != -1, "munmap result is -1: errno=%d", errno);
       head = nullptr;
       size = 0;
+      publishTail(head, size);
     }
     return nullptr;
   }
@@ -55,6 +172,7 @@ void* batchMmap(void* addr, size_t length, int prot, int flags, int fd,
     p = head;
     head = (void*)((uintptr_t)head + length);
     size -= length;
+    publishTail(head, size);
     return p;
   }
 
@@ -75,15 +193,32 @@ void* batchMmap(void* addr, size_t length, int prot, int flags, int fd,
   batchLength = std::min(batchLength, batchMaxLength);
   batchLength = std::max(batchLength, length);
 
-  p = mmap(addr, batchLength, prot, flags, fd, offset);
-  eassert((p != (void*)-1), "mmap result is -1: errno=%d", errno);
+  // NOTE: 1.a batch pre-faulted by the helper thread (MCMALLOC_PREFAULT)
+  // NOTE: 2.mmap (on failure, retry with a smaller batch down to length)
+  // NOTE: if the next batch is not ready, map only length so that the pool
+  // NOTE: runs out soon and takes the batch
+  p = nullptr;
+  if (threadIndex >= 0 && mc::prefaulter.IsEnabled()) {
+    p = mc::prefaulter.Take(threadIndex, length, &batchLength);
+    if (p == nullptr) batchLength = length;
+  }
+  while (p == nullptr &&
+         (p = timedMmap(addr, batchLength, prot, flags, fd, offset)) ==
+             (void*)-1) {
+    p = nullptr;
+    if (batchLength == length) {
+      errno = ENOMEM;
+      return nullptr;
+    }
+    batchLength = std::max(batchLength / 2, length);
+  }
   eassert(ALIGN_CHECK(p, PAGE_SIZE),
           "mmap ptr must be a multiple of the page size: addr=%p", p);
 
   if (head != nullptr && size >= PAGE_SIZE) {
     // NOTE: basically, size is a multiple of PAGE_SIZE
     size_t munmapSize = ALIGN(size, PAGE_SIZE);
-    int ret = munmap(head, munmapSize);
+    int ret = munmapWrapper(head, munmapSize);
     eassert(ret != -1, "munmap result is -1: errno=%d", errno);
   }
 
@@ -92,5 +227,7 @@ void* batchMmap(void* addr, size_t length, int prot, int flags, int fd,
 
   head = (void*)((uintptr_t)head + length);
   size -= length;
+  publishTail(head, size);
   return p;
 }
+}  // namespace
@@ -18,6 +18,7 @@
 #pragma once
 
 #include <sys/mman.h>
+#include <atomic>
 #include <cerrno>
 #include <cstdint>
 
@@ -30,4 +31,28 @@ void batchMmapTerm();
 void* batchMmap(void* addr, size_t length, int prot, int flags, int fd,
                 off_t offset);
 
-void* batchMmapWrapper(size_t length);
+// NOTE: return nullptr and set errno = ENOMEM on failure
+// NOTE: threadIndex selects the slot of pre-faulted batches (-1: none)
+void* batchMmapWrapper(size_t length, int threadIndex = -1);
+// NOTE: bypass the batch pool (e.g. for pre-warming with MAP_POPULATE)
+void* directMmapWrapper(size_t length, bool populateFlag);
+// NOTE: MAP_SHARED mapping of length bytes of fd from offset (bypass the
+// NOTE: batch pool, whose pages are anonymous)
+// NOTE: ownFlag: free(3) owns the pages (marked in ownershipMap)
+void* fileMmapWrapper(size_t length, int fd, off_t offset, bool ownFlag);
+// NOTE: munmap(2) of memory mapped by the wrappers
+int munmapWrapper(void* addr, size_t length);
+
+// NOTE: publish the pool of the calling thread in the slot of threadIndex
+void batchMmapBind(int threadIndex);
+// NOTE: the unused tail of the pool of the slot (for statistics, racy)
+// NOTE: return false if there is none
+bool batchMmapTail(int threadIndex, void** head, size_t* size);
+
+// NOTE: totals of mmap(2)/munmap(2) of the wrappers (statistics)
+struct MmapStat {
+  std::atomic<int64_t> nMmap;
+  std::atomic<int64_t> mappedBytes;
+  std::atomic<int64_t> unmappedBytes;
+};
+extern MmapStat mmapStat;
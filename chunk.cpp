@@ -25,17 +25,9 @@ Chunk::Chunk(size_t size, int sizeIndex)
 #ifdef SIGNATURE_FLAG
   _signature = SIGNATURE;
 #endif
-}
-
-// NOTE: restoration from pointer of body part
-Chunk *Chunk::NewFromBodyPtr(void *ptr) {
-  size_t offset = *(size_t *)((uintptr_t)ptr - sizeof(size_t));
-  void *chunkp = (void *)((uintptr_t)ptr - sizeof(Chunk) - offset);
-  // NOTE: placement new
-  Chunk *chunk = new (chunkp) Chunk();
-  chunk->SetAlignment(0);
-  chunk->SignatureAssert();
-  return chunk;
+#if FRAG_STATISTIC_FLAG
+  _requestedSize = 0;
+#endif
 }
 
 // NOTE: requied buffer >= aligenment + size
@@ -47,7 +39,8 @@ void Chunk::SetAlignment(size_t aligenment) {
     return;
   }
   // NOTE: in the case _offset < 8, _offset of field and body may be duplicated
-  _offset = (uintptr_t)PtrWithoutOffset() % aligenment;
+  _offset = (aligenment - (uintptr_t)PtrWithoutOffset() % aligenment) %
+            aligenment;
   _extraAreaForOffset = _offset;
   if (_offset == 0) return;
   size_t *ptr = (size_t *)((uintptr_t)Ptr() - sizeof(size_t));
@@ -86,18 +79,4 @@ void Chunk::Free() {
 #endif
 }
 
-void *Chunk::PtrWithoutOffset() {
-  return (void *)((uintptr_t)(this) + sizeof(Chunk));
-}
-void *Chunk::Ptr() {
-  return (void *)((uintptr_t)(this) + sizeof(Chunk) + _offset);
-}
-size_t Chunk::Size() { return _size; }
-size_t Chunk::SizeIndex() { return _sizeIndex; }
-
-size_t Chunk::UnitSize(size_t size) {
-  // NOTE: 16 or 64
-  return ALIGN(sizeof(Chunk) + size, 16);
-}
-
 };  // namespace mc
@@ -18,6 +18,7 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 
 #include "debug.hpp"
 #include "misc.hpp"
@@ -33,6 +34,8 @@ class Chunk {
 
   // NOTE: restoration from pointer of body part
   static Chunk *NewFromBodyPtr(void *ptr);
+  // NOTE: restoration of a live chunk (the offset is kept)
+  static Chunk *FromLiveBodyPtr(void *ptr);
   // NOTE: requied buffer >= aligenment + size
   void SetAlignment(size_t aligenment);
   bool Assert(size_t requiredSize = 0);
@@ -42,7 +45,13 @@ class Chunk {
   void *Ptr();
   size_t Size();
   size_t SizeIndex();
+  // NOTE: requested bytes of the allocation (FRAG_STATISTIC_FLAG only,
+  // NOTE: otherwise Size())
+  size_t RequestedSize();
+  void SetRequestedSize(size_t requestedSize);
   static size_t UnitSize(size_t size);
+  // NOTE: bytes of the header which exist only for the statistics
+  static const size_t StatisticHeaderSize = FRAG_STATISTIC_FLAG ? 16 : 0;
 
  private:
   size_t _size;
@@ -52,7 +61,57 @@ class Chunk {
   size_t _signature;
 #endif
 
+#if FRAG_STATISTIC_FLAG
+  // NOTE: 2 words to keep the body 16B aligned
+  size_t _requestedSize;
+  size_t _paddingForRequestedSize;
+#endif
+
   size_t _offset;
   size_t _extraAreaForOffset;
 };
+
+// NOTE: accessors used by the fast paths are defined here to be inlined
+// NOTE: restoration from pointer of body part
+// NOTE: the offset of an aligned chunk is reset here (free chunks have no
+// NOTE: offset)
+inline Chunk *Chunk::NewFromBodyPtr(void *ptr) {
+  size_t offset = *(size_t *)((uintptr_t)ptr - sizeof(size_t));
+  Chunk *chunk = (Chunk *)((uintptr_t)ptr - sizeof(Chunk) - offset);
+  if (UNLIKELY(offset != 0)) chunk->SetAlignment(0);
+#ifdef SIGNATURE_FLAG
+  chunk->SignatureAssert();
+#endif
+  return chunk;
+}
+inline Chunk *Chunk::FromLiveBodyPtr(void *ptr) {
+  size_t offset = *(size_t *)((uintptr_t)ptr - sizeof(size_t));
+  return (Chunk *)((uintptr_t)ptr - sizeof(Chunk) - offset);
+}
+inline void *Chunk::PtrWithoutOffset() {
+  return (void *)((uintptr_t)(this) + sizeof(Chunk));
+}
+inline void *Chunk::Ptr() {
+  return (void *)((uintptr_t)(this) + sizeof(Chunk) + _offset);
+}
+inline size_t Chunk::Size() { return _size; }
+inline size_t Chunk::SizeIndex() { return _sizeIndex; }
+inline size_t Chunk::RequestedSize() {
+#if FRAG_STATISTIC_FLAG
+  return _requestedSize;
+#else
+  return _size;
+#endif
+}
+inline void Chunk::SetRequestedSize(size_t requestedSize) {
+#if FRAG_STATISTIC_FLAG
+  _requestedSize = requestedSize;
+#else
+  UNUSED_PARAM(requestedSize);
+#endif
+}
+inline size_t Chunk::UnitSize(size_t size) {
+  // NOTE: 16 or 64
+  return ALIGN(sizeof(Chunk) + size, 16);
+}
 }  // namespace mc
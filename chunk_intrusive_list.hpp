@@ -0,0 +1,180 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include "chunk.hpp"
+#include "chunk_linked_array_list.hpp"
+#include "misc.hpp"
+
+// NOTE: intrusive free list of chunks (a ContainerT of Stack<Chunk *, ...>)
+// NOTE: the links are in the bodies of free chunks, so no side arrays are
+// NOTE: allocated (ChunkLinkedArrayListStack: 8B per chunk in containers)
+// NOTE: a body has at least 16B (Chunk::UnitSize is aligned to 16B):
+// NOTE: [0]: the next chunk, [1]: the tail of the batch (batch heads only)
+// NOTE: chunks are grouped into batches of BatchN (the same granularity as
+// NOTE: a ChunkArrayContainer), so that a batch moves to/from the global
+// NOTE: stack in O(1) by its head and tail
+// NOTE: (top) open batch (< BatchN) -> full batch -> ... (bottom)
+// NOTE: all of them are linked by [0], so PopTop never looks up a batch
+
+namespace mc {
+struct ChunkBatch {
+  Chunk *head;
+  Chunk *tail;
+};
+
+class ChunkIntrusiveList {
+ public:
+  static const size_t BatchN = ChunkArrayContainerN;
+
+  static Chunk *&Next(Chunk *chunk) {
+    return ((Chunk **)((uintptr_t)chunk + sizeof(Chunk)))[0];
+  }
+  static Chunk *&BatchTail(Chunk *chunk) {
+    return ((Chunk **)((uintptr_t)chunk + sizeof(Chunk)))[1];
+  }
+};
+
+// NOTE: the owner thread only (no locks)
+class ChunkIntrusiveListStack {
+ public:
+  void _Init() {
+    _top = nullptr;
+    _topTail = nullptr;
+    _topN = 0;
+    _fullHead = nullptr;
+    _fullN = 0;
+  }
+  bool IsEmpty() { return Size() == 0; }
+  bool IsFull() { return false; }
+  size_t Size() { return _topN + _fullN * ChunkIntrusiveList::BatchN; }
+  size_t MaxSize() { return std::numeric_limits<size_t>::max(); }
+  // NOTE: # of full batches
+  size_t Length() { return _fullN; }
+
+  // NOTE: never fails (no memory is allocated)
+  bool PushTop(Chunk *chunk) {
+    if (UNLIKELY(_topN == ChunkIntrusiveList::BatchN)) CloseTop();
+    ChunkIntrusiveList::Next(chunk) = _topN == 0 ? _fullHead : _top;
+    if (_topN == 0) _topTail = chunk;
+    _top = chunk;
+    _topN++;
+    return true;
+  }
+  Chunk *PopTop() {
+    if (UNLIKELY(_topN == 0)) {
+      if (UNLIKELY(_fullN == 0)) return nullptr;
+      OpenFull();
+    }
+    Chunk *chunk = _top;
+    _top = ChunkIntrusiveList::Next(chunk);
+    // NOTE: the next chunk is popped next (LIFO bursts)
+    __builtin_prefetch(_top, 1, 0);
+    _topN--;
+    return chunk;
+  }
+  size_t PushTopN(Chunk **chunks, size_t n) {
+    for (size_t i = 0; i < n; i++) PushTop(chunks[i]);
+    return n;
+  }
+  size_t PopTopN(Chunk **chunks, size_t n) {
+    size_t k = 0;
+    while (k < n && (chunks[k] = PopTop()) != nullptr) k++;
+    return k;
+  }
+
+  // NOTE: O(1) exchange of a full batch (below the open one)
+  bool PopBatch(ChunkBatch *batch) {
+    if (_fullN == 0) return false;
+    batch->head = _fullHead;
+    batch->tail = ChunkIntrusiveList::BatchTail(_fullHead);
+    _fullHead = ChunkIntrusiveList::Next(batch->tail);
+    ChunkIntrusiveList::Next(batch->tail) = nullptr;
+    if (_topN > 0) ChunkIntrusiveList::Next(_topTail) = _fullHead;
+    _fullN--;
+    return true;
+  }
+  // NOTE: requires: the batch has BatchN chunks linked by Next()
+  void PushBatch(const ChunkBatch &batch) {
+    ChunkIntrusiveList::BatchTail(batch.head) = batch.tail;
+    ChunkIntrusiveList::Next(batch.tail) = _fullHead;
+    _fullHead = batch.head;
+    if (_topN > 0) ChunkIntrusiveList::Next(_topTail) = _fullHead;
+    _fullN++;
+  }
+
+ private:
+  // NOTE: the open batch is full: it becomes the first full batch
+  void CloseTop() {
+    ChunkIntrusiveList::BatchTail(_top) = _topTail;
+    _fullHead = _top;
+    _fullN++;
+    _top = _topTail = nullptr;
+    _topN = 0;
+  }
+  // NOTE: the open batch is empty: the first full batch is opened
+  void OpenFull() {
+    _top = _fullHead;
+    _topTail = ChunkIntrusiveList::BatchTail(_fullHead);
+    _topN = ChunkIntrusiveList::BatchN;
+    _fullHead = ChunkIntrusiveList::Next(_topTail);
+    _fullN--;
+  }
+
+  Chunk *_top;
+  Chunk *_topTail;
+  size_t _topN;
+  // NOTE: the head of the first full batch
+  Chunk *_fullHead;
+  size_t _fullN;
+};
+
+// NOTE: global stack of full batches (callers lock it like _cts)
+// NOTE: batches are linked from the tail of one to the head of the next
+class ChunkIntrusiveBatchStack {
+ public:
+  void _Init() {
+    _head = nullptr;
+    _n = 0;
+  }
+  size_t Length() { return _n; }
+  void Push(const ChunkBatch &batch) {
+    ChunkIntrusiveList::BatchTail(batch.head) = batch.tail;
+    ChunkIntrusiveList::Next(batch.tail) = _head;
+    _head = batch.head;
+    _n++;
+  }
+  bool Pop(ChunkBatch *batch) {
+    if (_head == nullptr) return false;
+    batch->head = _head;
+    batch->tail = ChunkIntrusiveList::BatchTail(_head);
+    _head = ChunkIntrusiveList::Next(batch->tail);
+    ChunkIntrusiveList::Next(batch->tail) = nullptr;
+    _n--;
+    return true;
+  }
+
+ private:
+  Chunk *_head;
+  size_t _n;
+};
+}  // namespace mc
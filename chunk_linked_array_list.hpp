@@ -17,8 +17,13 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstring>
+#include <limits>
+
 #include "batch_mmap.hpp"
 #include "chunk.hpp"
+#include "metadata_pool.hpp"
 #include "misc.hpp"
 
 namespace mc {
@@ -50,23 +55,32 @@ class ChunkArrayContainer {
     return (Chunk **)((uintptr_t)(this) + sizeof(ChunkArrayContainer *));
   }
 
+  // NOTE: containers are recycled through metadataPool (never unmapped)
+  // NOTE: return nullptr on failure
   static ChunkArrayContainer *New() {
-    size_t mmapSize = ALIGN(
-        sizeof(ChunkArrayContainer) * ChunkArrayContainerPageN, PAGE_SIZE);
-    void *ptr = batchMmapWrapper(mmapSize);
-    eassert((ptr != (void *)-1), "mmap result is -1: errno=%d", errno);
+    void *ptr = metadataPool.Alloc();
+    if (UNLIKELY(ptr == nullptr)) return nullptr;
     eassert(ALIGN_CHECK(ptr, PAGE_SIZE),
-            "mmap ptr must be a multiple of the page size: addr=%p", ptr);
-    // TODO: unmmap when term app
+            "metadata ptr must be a multiple of the page size: addr=%p", ptr);
     ChunkArrayContainer *cptr = (ChunkArrayContainer *)ptr;
     cptr->_prePtr = nullptr;
     cptr->_nextPtr = nullptr;
     return cptr;
   }
+  // NOTE: release the container and the following ones (Next)
+  static void DeleteList(ChunkArrayContainer *ptr) {
+    while (ptr != nullptr) {
+      ChunkArrayContainer *next = ptr->Next();
+      metadataPool.Free(ptr);
+      ptr = next;
+    }
+  }
   // NOTE: if no next one, extend
+  // NOTE: return nullptr on failure
   inline ChunkArrayContainer *ForceNext() {
     if (Next() == nullptr) {
       auto tmp = ChunkArrayContainer::New();
+      if (UNLIKELY(tmp == nullptr)) return nullptr;
       tmp->Pre() = this;
       Next() = tmp;
     }
@@ -90,74 +104,165 @@ static_assert(sizeof(ChunkArrayContainer) ==
                   PAGE_SIZE * ChunkArrayContainerPageN,
               "ChunkArrayContainer size is not correct");
 #endif
+static_assert(sizeof(ChunkArrayContainer) <= MetadataPool::BlockSize,
+              "ChunkArrayContainer is larger than a metadata block");
 
+// NOTE: the owner thread pushes/pops the top container without a lock
+// NOTE: other threads can steal a full container below the top one
+// NOTE: (StealMidBuffer), so the owner takes _lock only when the top container
+// NOTE: changes (or mid buffers move), and stolen elements are recorded in
+// NOTE: _stolenSize and folded into _size by the owner under _lock
+// NOTE: (ScopedLock), other threads take _lock without touching _size
+// NOTE: (ScopedPeerLock), which the owner updates without the lock
+// NOTE: a container holds ArrayMaxSize() (<= ChunkArrayContainerN) chunks,
+// NOTE: and containers are exchanged as they are (SetCapacity), so the stacks
+// NOTE: of a size class must have the same capacity
+// NOTE: the top container is allocated on the first push (_topCapacity == 0
+// NOTE: until then, so the fast paths fail), and a zero-filled stack is a
+// NOTE: valid empty one for other threads (Size, StealMidBuffer, TrimSpare,
+// NOTE: ForEach)
 class ChunkLinkedArrayListStack {
  public:
   // NOTE: There is a possibility that malloc(3) is used before main(). So, we must call this explicitly.
   void _Init() {
     _size = 0;
-    _length = 1;
-    _topArrayPtr = ChunkArrayContainer::New();
+    _length = 0;
+    _topArrayPtr = nullptr;
     _topArrayIndex = -1;
+    _lock.store(0, std::memory_order_relaxed);
+    _stolenSize.store(0, std::memory_order_relaxed);
+    _stealHint.store(0, std::memory_order_relaxed);
+    _reservedLength = 0;
+    _capacity = ChunkArrayContainer::MaxSize();
+    _topCapacity = 0;
   }
-  bool IsEmpty() { return _size == 0; };
+  // NOTE: requires: no chunks have been pushed (containers of the old
+  // NOTE: capacity must not be exchanged)
+  void SetCapacity(size_t capacity) {
+    eassert(_size == 0 && _length <= 1 && _topArrayIndex == -1,
+            "capacity of a used stack is changed: size=%d", (int)_size);
+    _capacity = std::max(
+        std::min(capacity, (size_t)ChunkArrayContainer::MaxSize()), (size_t)1);
+    if (_topArrayPtr != nullptr) _topCapacity = _capacity;
+  }
+  bool IsEmpty() { return Size() == 0; };
   bool IsFull() { return false; }
-  size_t Size() { return _size; }
+  size_t Size() {
+    return _size - _stolenSize.load(std::memory_order_relaxed);
+  }
   // NOTE: maximum value for convenience (It seems not necessary to set)
   size_t MaxSize() { return std::numeric_limits<size_t>::max(); }
   size_t Length() { return _length; }
-  size_t ArrayMaxSize() { return ChunkArrayContainer::MaxSize(); }
+  size_t ArrayMaxSize() { return _capacity; }
 
   ChunkArrayContainer *PopMidBuffer() {
-    if (_length <= 1) return nullptr;
-    _size -= ArrayMaxSize();
-    _length--;
-    // NOTE: from:(bottom) ptr__ <-> ptr_ <-> ptr (top)
-    // NOTE: to:(bottom) ptr__ <-> ptr (top)
-    ChunkArrayContainer *ptr = _topArrayPtr;
-    ChunkArrayContainer *ptr_ = ptr->Pre();
-    ChunkArrayContainer *ptr__ = ptr_->Pre();
-    ptr->Pre() = ptr__;
-    if (ptr__ != nullptr) ptr__->Next() = ptr;
-    ptr_->Pre() = ptr->Next() = nullptr;
+    ScopedLock lock(this);
+    ChunkArrayContainer *ptr_ = UnlinkMidBuffer();
+    if (ptr_ != nullptr) _size -= ArrayMaxSize();
     return ptr_;
   }
   void PushMidBuffer(ChunkArrayContainer *ptr_) {
     if (ptr_ == nullptr) return;
-    _size += ArrayMaxSize();
-    _length++;
-    // NOTE: from:(bottom) ptr__ <-> ptr (top)
-    // NOTE: to:(bottom) ptr__ <-> ptr_ <-> ptr (top)
+    ScopedLock lock(this);
+    LinkMidBuffer(ptr_);
+  }
+  // NOTE: pop at most n full containers under one lock and prepend them to
+  // NOTE: bufs (a list linked by Pre)
+  // NOTE: return # of popped containers
+  size_t PopMidBuffers(size_t n, ChunkArrayContainer *&bufs) {
+    ScopedLock lock(this);
+    size_t k = 0;
+    ChunkArrayContainer *ptr_;
+    while (k < n && (ptr_ = UnlinkMidBuffer()) != nullptr) {
+      ptr_->Pre() = bufs;
+      bufs = ptr_;
+      k++;
+    }
+    _size -= k * ArrayMaxSize();
+    return k;
+  }
+  // NOTE: push full containers of a list linked by Pre under one lock
+  void PushMidBuffers(ChunkArrayContainer *bufs) {
+    if (bufs == nullptr) return;
+    ScopedLock lock(this);
+    while (bufs != nullptr) {
+      ChunkArrayContainer *ptr_ = bufs;
+      bufs = ptr_->Pre();
+      LinkMidBuffer(ptr_);
+    }
+  }
+
+  // NOTE: called by other threads
+  // NOTE: never wait for the owner (return nullptr if it is busy)
+  ChunkArrayContainer *StealMidBuffer() {
+    if (StealHint() == 0) return nullptr;
+    if (_lock.exchange(1, std::memory_order_acquire) != 0) return nullptr;
+    ChunkArrayContainer *ptr_ = nullptr;
+    if (_length >= 2 + _reservedLength) {
+      ptr_ = UnlinkMidBuffer();
+      _stolenSize.fetch_add(ArrayMaxSize(), std::memory_order_relaxed);
+    }
+    _lock.store(0, std::memory_order_release);
+    return ptr_;
+  }
+  // NOTE: # of full containers which other threads can steal
+  uint32_t StealHint() { return _stealHint.load(std::memory_order_relaxed); }
+  // NOTE: release empty containers above the top one
+  // NOTE: (other threads can call this for idle stacks)
+  // NOTE: return # of released containers
+  size_t TrimSpare() {
+    ChunkArrayContainer *spare;
+    {
+      ScopedPeerLock lock(this);
+      if (_topArrayPtr == nullptr) return 0;
+      spare = _topArrayPtr->Next();
+      _topArrayPtr->Next() = nullptr;
+    }
+    size_t n = 0;
+    for (auto ptr = spare; ptr != nullptr; ptr = ptr->Next()) n++;
+    ChunkArrayContainer::DeleteList(spare);
+    return n;
+  }
+  // NOTE: visit the elements with f(chunks, n) (called by other threads)
+  // NOTE: _lock keeps the containers in place, but the owner pushes/pops the
+  // NOTE: top container without it, so the top elements are a snapshot
+  template <typename F>
+  void ForEach(F f) {
+    ScopedPeerLock lock(this);
     ChunkArrayContainer *ptr = _topArrayPtr;
-    ChunkArrayContainer *ptr__ = ptr->Pre();
-    ptr->Pre() = ptr_;
-    ptr_->Next() = ptr;
-    ptr_->Pre() = ptr__;
-    if (ptr__ != nullptr) ptr__->Next() = ptr_;
+    int index = *(volatile int *)&_topArrayIndex;
+    if (ptr != nullptr && index >= 0) f(ptr->Buffer(), (size_t)index + 1);
+    if (ptr != nullptr) ptr = ptr->Pre();
+    for (size_t i = 1; i < _length && ptr != nullptr; i++, ptr = ptr->Pre())
+      f(ptr->Buffer(), ArrayMaxSize());
+  }
+  // NOTE: # of full containers which other threads must not steal
+  void SetReservedLength(size_t length) {
+    ScopedLock lock(this);
+    _reservedLength = length;
+    PublishStealHint();
   }
 
   // NOTE:requires: chunk is not nullptr
+  // NOTE: return false if a new container cannot be allocated
   bool PushTop(Chunk *chunk) {
     if (UNLIKELY(IsFull())) return false;
 
     _topArrayIndex++;
-    if (UNLIKELY(_topArrayIndex == (int)ArrayMaxSize())) {
-      _topArrayPtr = _topArrayPtr->ForceNext();
+    if (UNLIKELY(_topArrayIndex == (int)_topCapacity)) {
+      if (UNLIKELY(!MoveTopNext())) {
+        _topArrayIndex--;
+        return false;
+      }
       _topArrayIndex = 0;
-      _length++;
     }
     _topArrayPtr->At(_topArrayIndex) = chunk;
     _size++;
     return true;
   }
   Chunk *PopTop() {
-    if (UNLIKELY(IsEmpty())) return nullptr;
-
     if (UNLIKELY(_topArrayIndex == -1)) {
-      // NOTE:no need to check nullptr(always non-nullptr)
-      _topArrayPtr = _topArrayPtr->Pre();
-      _topArrayIndex = ArrayMaxSize() - 1;
-      _length--;
+      if (UNLIKELY(!MoveTopPre())) return nullptr;
     }
     const int stride = 4;
     // NOTE: to avoid if statement
@@ -173,19 +278,196 @@ class ChunkLinkedArrayListStack {
     return chunk;
   }
 
+  // NOTE: fast paths within the top container
+  // NOTE: return false when the top container has to be changed
+  bool PopTopFast(Chunk **chunk) {
+    int index = _topArrayIndex;
+    if (UNLIKELY(index == -1)) return false;
+    *chunk = _topArrayPtr->At(index);
+    _topArrayIndex = index - 1;
+    _size--;
+    return true;
+  }
+  bool PushTopFast(Chunk *chunk) {
+    int index = _topArrayIndex + 1;
+    if (UNLIKELY(index == (int)_topCapacity)) return false;
+    _topArrayPtr->At(index) = chunk;
+    _topArrayIndex = index;
+    _size++;
+    return true;
+  }
+
+  // NOTE: bulk version of PushTop (requires: no nullptr in chunks)
+  // NOTE: return # of pushed chunks (less than n if a new container cannot be
+  // NOTE: allocated)
+  size_t PushTopN(Chunk **chunks, size_t n) {
+    size_t nPushed = 0;
+    while (n > 0) {
+      if (UNLIKELY(_topArrayIndex + 1 == (int)_topCapacity)) {
+        if (UNLIKELY(!MoveTopNext())) break;
+        _topArrayIndex = -1;
+      }
+      size_t k = std::min(n, (size_t)_topCapacity - (_topArrayIndex + 1));
+      memcpy(&_topArrayPtr->At(_topArrayIndex + 1), chunks,
+             sizeof(Chunk *) * k);
+      _topArrayIndex += k;
+      _size += k;
+      chunks += k;
+      n -= k;
+      nPushed += k;
+    }
+    return nPushed;
+  }
+  // NOTE: bulk version of PopTop
+  // NOTE: return # of popped chunks
+  size_t PopTopN(Chunk **chunks, size_t n) {
+    size_t nPopped = 0;
+    while (n > 0) {
+      if (UNLIKELY(_topArrayIndex == -1)) {
+        if (!MoveTopPre()) break;
+      }
+      size_t k = std::min(n, (size_t)(_topArrayIndex + 1));
+      memcpy(chunks, &_topArrayPtr->At(_topArrayIndex + 1 - k),
+             sizeof(Chunk *) * k);
+      _topArrayIndex -= k;
+      _size -= k;
+      chunks += k;
+      n -= k;
+      nPopped += k;
+    }
+    return nPopped;
+  }
+
  private:
+  // NOTE: for the owner thread (or the holder of _chunkStackMtx of a global
+  // NOTE: stack)
+  class ScopedLock {
+   public:
+    explicit ScopedLock(ChunkLinkedArrayListStack *stack) : _stack(stack) {
+      while (_stack->_lock.exchange(1, std::memory_order_acquire) != 0)
+        __builtin_ia32_pause();
+      // NOTE: fold stolen elements
+      size_t stolenSize =
+          _stack->_stolenSize.exchange(0, std::memory_order_relaxed);
+      _stack->_size -= stolenSize;
+    }
+    ~ScopedLock() { _stack->_lock.store(0, std::memory_order_release); }
+
+   private:
+    ChunkLinkedArrayListStack *_stack;
+  };
+  // NOTE: for other threads (_size is left to the owner)
+  class ScopedPeerLock {
+   public:
+    explicit ScopedPeerLock(ChunkLinkedArrayListStack *stack)
+        : _stack(stack) {
+      while (_stack->_lock.exchange(1, std::memory_order_acquire) != 0)
+        __builtin_ia32_pause();
+    }
+    ~ScopedPeerLock() { _stack->_lock.store(0, std::memory_order_release); }
+
+   private:
+    ChunkLinkedArrayListStack *_stack;
+  };
+
+  // NOTE: requires: _lock is held
+  void LinkMidBuffer(ChunkArrayContainer *ptr_) {
+    _size += ArrayMaxSize();
+    _length++;
+    // NOTE: no top container yet: the full container becomes the top one
+    if (UNLIKELY(_topArrayPtr == nullptr)) {
+      ptr_->Pre() = ptr_->Next() = nullptr;
+      _topArrayPtr = ptr_;
+      _topArrayIndex = ArrayMaxSize() - 1;
+      _topCapacity = ArrayMaxSize();
+      return;
+    }
+    // NOTE: from:(bottom) ptr__ <-> ptr (top)
+    // NOTE: to:(bottom) ptr__ <-> ptr_ <-> ptr (top)
+    ChunkArrayContainer *ptr = _topArrayPtr;
+    ChunkArrayContainer *ptr__ = ptr->Pre();
+    ptr->Pre() = ptr_;
+    ptr_->Next() = ptr;
+    ptr_->Pre() = ptr__;
+    if (ptr__ != nullptr) ptr__->Next() = ptr_;
+    PublishStealHint();
+  }
+  // NOTE: requires: _lock is held
+  ChunkArrayContainer *UnlinkMidBuffer() {
+    if (_length <= 1) return nullptr;
+    _length--;
+    // NOTE: from:(bottom) ptr__ <-> ptr_ <-> ptr (top)
+    // NOTE: to:(bottom) ptr__ <-> ptr (top)
+    ChunkArrayContainer *ptr = _topArrayPtr;
+    ChunkArrayContainer *ptr_ = ptr->Pre();
+    ChunkArrayContainer *ptr__ = ptr_->Pre();
+    ptr->Pre() = ptr__;
+    if (ptr__ != nullptr) ptr__->Next() = ptr;
+    ptr_->Pre() = ptr_->Next() = nullptr;
+    PublishStealHint();
+    return ptr_;
+  }
+  // NOTE: requires: _lock is held
+  void PublishStealHint() {
+    uint32_t hint =
+        _length >= 2 + _reservedLength ? _length - 1 - _reservedLength : 0;
+    _stealHint.store(hint, std::memory_order_relaxed);
+  }
+  // NOTE: the top container is full (or not allocated yet)
+  __attribute__((noinline)) bool MoveTopNext() {
+    ScopedLock lock(this);
+    if (UNLIKELY(_topArrayPtr == nullptr)) {
+      _topArrayPtr = ChunkArrayContainer::New();
+      if (UNLIKELY(_topArrayPtr == nullptr)) return false;
+      _topCapacity = ArrayMaxSize();
+      _length = 1;
+      return true;
+    }
+    ChunkArrayContainer *next = _topArrayPtr->ForceNext();
+    if (UNLIKELY(next == nullptr)) return false;
+    _topArrayPtr = next;
+    _length++;
+    PublishStealHint();
+    return true;
+  }
+  // NOTE: the top container is empty
+  __attribute__((noinline)) bool MoveTopPre() {
+    ScopedLock lock(this);
+    if (_size == 0) return false;
+    // NOTE:no need to check nullptr(always non-nullptr)
+    _topArrayPtr = _topArrayPtr->Pre();
+    _topArrayIndex = ArrayMaxSize() - 1;
+    _length--;
+    PublishStealHint();
+    // NOTE: keep only one empty container above the top one
+    ChunkArrayContainer *spare = _topArrayPtr->Next();
+    ChunkArrayContainer *surplus = spare->Next();
+    spare->Next() = nullptr;
+    ChunkArrayContainer::DeleteList(surplus);
+    return true;
+  }
+
   // NOTE:to avoid cache false sharing, this class size have to be multiples of 64B
   size_t _size;    // # of element
-  size_t _length;  // # of array(Buffered ones are not included.)
+  size_t _length;  // # of array(Buffered ones are not included. 0: no top)
   ChunkArrayContainer *_topArrayPtr;
   int _topArrayIndex;
+  std::atomic<int> _lock;
+  std::atomic<size_t> _stolenSize;
+  std::atomic<uint32_t> _stealHint;
+  uint32_t _reservedLength;
+  uint32_t _capacity;  // # of elements of a container
+  // NOTE: _capacity if the top container is allocated, otherwise 0
+  uint32_t _topCapacity;
 #ifdef __APPLE__
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-private-field"
 #endif
-  uint8_t _dummy[64 - (8 + 8 + 8 + 4)];
+  uint8_t _dummy[64 - (8 + 8 + 8 + 4 + 4 + 8 + 4 + 4 + 4 + 4)];
 #ifdef __APPLE__
 #pragma GCC diagnostic pop
 #endif
 };
+static_assert(sizeof(ChunkLinkedArrayListStack) == 64,
+              "ChunkLinkedArrayListStack size is not correct");
 }  // namespace mc
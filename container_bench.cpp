@@ -0,0 +1,233 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// NOTE: benchmark of the containers of the local stacks
+// NOTE: ChunkLinkedArrayListStack (side arrays) vs ChunkIntrusiveListStack
+// NOTE: (links in free chunks), linked with the containers directly (do not
+// NOTE: preload libmcmalloc.so)
+// e.g.
+// $ ./mcmalloc-container-bench [size] [n] [nRepeat] [shuffle(0/1)]
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include "chunk.hpp"
+#include "chunk_intrusive_list.hpp"
+#include "chunk_linked_array_list.hpp"
+#include "stack.hpp"
+
+namespace {
+using mc::Chunk;
+typedef mc::Stack<Chunk *, mc::ChunkLinkedArrayListStack> ArrayListStack;
+typedef mc::Stack<Chunk *, mc::ChunkIntrusiveListStack> IntrusiveListStack;
+
+// NOTE: a hardware counter of user space (perf_event_open)
+// NOTE: Read() returns -1 if the counter is not available (e.g. in a VM or
+// NOTE: with perf_event_paranoid >= 3)
+struct PerfCounter {
+  explicit PerfCounter(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    _fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (_fd == -1) return;
+    ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  ~PerfCounter() {
+    if (_fd != -1) close(_fd);
+  }
+  long long Read() {
+    long long n;
+    if (_fd == -1 || read(_fd, &n, sizeof(n)) != sizeof(n)) return -1;
+    return n;
+  }
+  int _fd;
+};
+
+struct Measure {
+  Measure()
+      : _start(std::chrono::steady_clock::now()),
+        _misses(PERF_COUNT_HW_CACHE_MISSES),
+        _missStart(_misses.Read()) {}
+  void Print(const char *container, const char *name, size_t nOp) {
+    auto end = std::chrono::steady_clock::now();
+    double ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - _start)
+            .count();
+    long long misses = _missStart == -1 ? -1 : _misses.Read() - _missStart;
+    printf("%-10s %-12s: %8.2f[ns/op]", container, name, ns / nOp);
+    if (misses == -1)
+      printf(", cache-misses/op=n/a\n");
+    else
+      printf(", cache-misses/op=%6.3f\n", (double)misses / nOp);
+  }
+  std::chrono::steady_clock::time_point _start;
+  PerfCounter _misses;
+  long long _missStart;
+};
+
+// NOTE: carve n chunks from a new mapping
+// NOTE: shuffleFlag: neighbors in a stack are not neighbors in memory (a
+// NOTE: long-running heap), otherwise in address order (freshly carved)
+std::vector<Chunk *> Carve(size_t size, size_t n, bool shuffleFlag) {
+  size_t unitSize = Chunk::UnitSize(size);
+  char *p = (char *)mmap(nullptr, unitSize * n, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  std::vector<Chunk *> chunks(n);
+  for (size_t i = 0; i < n; i++)
+    chunks[i] = new (p + unitSize * i) Chunk(size, 0);
+  if (!shuffleFlag) return chunks;
+  srand(1);
+  for (size_t i = n - 1; i > 0; i--) std::swap(chunks[i], chunks[rand() % i]);
+  return chunks;
+}
+
+// NOTE: evict chunks and side arrays from the caches
+void Evict() {
+  static std::vector<char> buf(64 << 20);
+  for (size_t i = 0; i < buf.size(); i += 64) buf[i]++;
+}
+
+void Touch(Chunk *chunk) {
+  *(volatile size_t *)chunk->PtrWithoutOffset() = 1;
+}
+
+template <typename StackT>
+void Run(const char *container, std::vector<Chunk *> &chunks, int nRepeat) {
+  size_t n = chunks.size();
+  size_t metadataBlockN = mc::metadataPool.NMappedBlock();
+  StackT stack;
+  stack._Init();
+  {
+    // NOTE: free n chunks, then malloc n chunks (the bodies are used)
+    Measure m;
+    for (int r = 0; r < nRepeat; r++) {
+      for (size_t i = 0; i < n; i++) stack.Push(chunks[i]);
+      for (size_t i = 0; i < n; i++) Touch(chunks[i] = stack.Pop());
+    }
+    m.Print(container, "lifo", 2 * n * nRepeat);
+  }
+  {
+    // NOTE: random free + malloc pairs over n live chunks
+    for (size_t i = 0; i < n / 2; i++) stack.Push(chunks[i]);
+    Measure m;
+    uint64_t x = 88172645463325252ULL;
+    for (size_t k = 0; k < n * nRepeat; k++) {
+      x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+      size_t i = n / 2 + x % (n - n / 2);
+      stack.Push(chunks[i]);
+      Touch(chunks[i] = stack.Pop());
+    }
+    m.Print(container, "churn", 2 * n * nRepeat);
+    for (size_t i = 0; i < n / 2; i++) chunks[i] = stack.Pop();
+  }
+  {
+    // NOTE: pop chunks which are not in the caches (e.g. a stack which
+    // NOTE: was filled long ago), without touching the bodies
+    for (size_t i = 0; i < n; i++) stack.Push(chunks[i]);
+    Evict();
+    Measure m;
+    for (size_t i = 0; i < n; i++) chunks[i] = stack.Pop();
+    m.Print(container, "cold drain", n);
+  }
+  size_t metadataBytes = (mc::metadataPool.NMappedBlock() - metadataBlockN) *
+                         mc::MetadataPool::BlockSize;
+  printf("%-10s %-12s: %8zu[B] (%.2f[B/chunk])\n", container, "metadata",
+         metadataBytes, (double)metadataBytes / n);
+}
+
+// NOTE: move full batches local -> global -> local
+void RunSplice(std::vector<Chunk *> &chunks, int nRepeat) {
+  size_t n = chunks.size();
+  {
+    ArrayListStack local;
+    mc::ChunkLinkedArrayListStack global;
+    local._Init();
+    global._Init();
+    for (size_t i = 0; i < n; i++) local.Push(chunks[i]);
+    size_t batchN = local.Container().Length() - 1;
+    Measure m;
+    for (int r = 0; r < nRepeat; r++) {
+      for (size_t i = 0; i < batchN; i++)
+        global.PushMidBuffer(local.Container().PopMidBuffer());
+      for (size_t i = 0; i < batchN; i++)
+        local.Container().PushMidBuffer(global.PopMidBuffer());
+    }
+    m.Print("array", "splice", 2 * batchN * nRepeat);
+  }
+  {
+    IntrusiveListStack local;
+    mc::ChunkIntrusiveBatchStack global;
+    local._Init();
+    global._Init();
+    for (size_t i = 0; i < n; i++) local.Push(chunks[i]);
+    size_t batchN = local.Container().Length();
+    mc::ChunkBatch batch = {nullptr, nullptr};
+    Measure m;
+    for (int r = 0; r < nRepeat; r++) {
+      for (size_t i = 0; i < batchN; i++) {
+        local.Container().PopBatch(&batch);
+        global.Push(batch);
+      }
+      for (size_t i = 0; i < batchN; i++) {
+        global.Pop(&batch);
+        local.Container().PushBatch(batch);
+      }
+    }
+    m.Print("intrusive", "splice", 2 * batchN * nRepeat);
+  }
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  size_t size = argc > 1 ? atoll(argv[1]) : 64;
+  size_t n = argc > 2 ? atoll(argv[2]) : 1 << 20;
+  int nRepeat = argc > 3 ? atoi(argv[3]) : 8;
+  bool shuffleFlag = argc > 4 ? atoi(argv[4]) != 0 : true;
+  if (size == 0 || n < 2 || nRepeat <= 0) {
+    fprintf(stderr, "usage: %s [size] [n] [nRepeat] [shuffle(0/1)]\n",
+            argv[0]);
+    return 1;
+  }
+  printf("# size=%zu unit=%zu n=%zu repeat=%d batch=%zu shuffle=%d\n", size,
+         Chunk::UnitSize(size), n, nRepeat,
+         (size_t)mc::ChunkIntrusiveList::BatchN, (int)shuffleFlag);
+  std::vector<Chunk *> chunks = Carve(size, n, shuffleFlag);
+  Run<ArrayListStack>("array", chunks, nRepeat);
+  Run<IntrusiveListStack>("intrusive", chunks, nRepeat);
+  RunSplice(chunks, nRepeat * 64);
+  return 0;
+}
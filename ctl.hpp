@@ -0,0 +1,100 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+// NOTE: helpers of mc_ctl (mallctl(3) style control namespace)
+// NOTE: oldp/oldlenp: the current value is read if oldp is not nullptr
+// NOTE: newp/newlen: a new value is written if newp is not nullptr
+// NOTE: functions return 0 on success, otherwise an errno value
+
+namespace mc {
+struct CtlArgs {
+  void *oldp;
+  size_t *oldlenp;
+  void *newp;
+  size_t newlen;
+
+  bool WriteFlag() const { return newp != nullptr; }
+};
+
+template <typename T>
+int ctlRead(const CtlArgs &args, T value) {
+  if (args.oldp == nullptr) return 0;
+  if (args.oldlenp == nullptr || *args.oldlenp != sizeof(T)) return EINVAL;
+  memcpy(args.oldp, &value, sizeof(T));
+  return 0;
+}
+template <typename T>
+int ctlWrite(const CtlArgs &args, T *value) {
+  if (args.newp == nullptr) return 0;
+  if (args.newlen != sizeof(T)) return EINVAL;
+  memcpy(value, args.newp, sizeof(T));
+  return 0;
+}
+template <typename T>
+int ctlReadOnly(const CtlArgs &args, T value) {
+  if (args.WriteFlag()) return EPERM;
+  return ctlRead(args, value);
+}
+// NOTE: the largest value of T which VarT can hold
+template <typename T, typename VarT>
+constexpr T ctlMaxValue() {
+  return (uintmax_t)std::numeric_limits<VarT>::max() <
+                 (uintmax_t)std::numeric_limits<T>::max()
+             ? (T)std::numeric_limits<VarT>::max()
+             : std::numeric_limits<T>::max();
+}
+// NOTE: the old value is returned with the new one written
+// NOTE: a new value out of [minValue, maxValue] is rejected with EINVAL
+template <typename T, typename VarT>
+int ctlReadWrite(const CtlArgs &args, VarT &var,
+                 T minValue = std::numeric_limits<T>::lowest(),
+                 T maxValue = ctlMaxValue<T, VarT>()) {
+  int ret = ctlRead(args, (T)var);
+  if (ret != 0) return ret;
+  T value;
+  if (!args.WriteFlag()) return 0;
+  if ((ret = ctlWrite(args, &value)) != 0) return ret;
+  if (value < minValue || value > maxValue) return EINVAL;
+  var = (VarT)value;
+  return 0;
+}
+
+// NOTE: "<prefix><index>.<suffix>" (e.g. "class.5.size")
+// NOTE: return false if the name does not match
+inline bool ctlParseIndex(const char *name, const char *prefix, int *index,
+                          const char **suffix) {
+  size_t len = strlen(prefix);
+  if (strncmp(name, prefix, len) != 0) return false;
+  const char *p = name + len;
+  if (*p < '0' || *p > '9') return false;
+  char *end;
+  long v = strtol(p, &end, 10);
+  if (*end != '.' || v > (1L << 30)) return false;
+  *index = (int)v;
+  *suffix = end + 1;
+  return true;
+}
+}  // namespace mc
@@ -28,6 +28,14 @@
 
 #define STATISTIC_FLAG false
 #define CALL_STATISTIC_FLAG true
+// NOTE: latency histograms (see latency_stat.hpp)
+#ifndef LATENCY_STATISTIC_FLAG
+#define LATENCY_STATISTIC_FLAG false
+#endif
+// NOTE: internal fragmentation statistics (see frag_stat.hpp)
+#ifndef FRAG_STATISTIC_FLAG
+#define FRAG_STATISTIC_FLAG false
+#endif
 #define DEBUG_BUILD false
 
 #define sizeHashMaxSize (32)
@@ -0,0 +1,158 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "frag_stat.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "latency_stat.hpp"
+#include "memory_chunk_size.hpp"
+
+namespace mc {
+FragCounter fragCounters[FragStatSlotN][N_SIZE_INDEX_ELEMENT];
+
+namespace {
+// NOTE: a new class between the class and the next smaller one
+struct FragSuggestion {
+  int sizeIndex;
+  size_t size;
+  int64_t chunkN;
+  int64_t savedBytes;
+};
+
+// NOTE: the split which saves the most bytes of the live chunks
+// NOTE: a split at bucket b moves the chunks of buckets >= b to a new class
+// NOTE: of their largest requested size (rounded up to the granularity of
+// NOTE: learned hash classes)
+FragSuggestion suggest(int sizeIndex, const mc_frag_stat_t &stat) {
+  FragSuggestion best = {sizeIndex, 0, 0, 0};
+  int64_t chunkN = 0;
+  size_t maxRequested = 0;
+  for (int b = FragCounter::BucketN - 1; b >= 1; b--) {
+    chunkN += stat.live_buckets[b];
+    maxRequested =
+        std::max(maxRequested, (size_t)stat.bucket_max_requested[b]);
+    size_t size = (maxRequested + 7) / 8 * 8;
+    if (chunkN <= 0 || size <= 8 || size >= stat.size || isPower2(size))
+      continue;
+    int64_t savedBytes = chunkN * (int64_t)(stat.size - size);
+    if (savedBytes > best.savedBytes)
+      best = {sizeIndex, size, chunkN, savedBytes};
+  }
+  return best;
+}
+
+int64_t wastedBytes(const mc_frag_stat_t &stat) {
+  return stat.live_class_bytes - stat.live_requested_bytes +
+         stat.live_header_bytes;
+}
+
+// NOTE: x/y in percent with 1 decimal
+void printPercent(FdPrinter &printer, int64_t x, int64_t y) {
+  int64_t permille = y <= 0 ? 0 : x * 1000 / y;
+  printer.Printf(" %3lld.%lld%%", (long long)(permille / 10),
+                 (long long)(permille % 10));
+}
+}  // namespace
+
+bool fragStatGet(int sizeIndex, mc_frag_stat_t *stat) {
+  if (sizeIndex < 0 || sizeIndex >= (int)N_SIZE_INDEX_ELEMENT) return false;
+  memset(stat, 0, sizeof(*stat));
+  stat->size = indexToSizeWithHash(sizeIndex);
+  for (int j = 0; j < FragStatSlotN; j++)
+    fragCounters[j][sizeIndex].AddTo(stat);
+  stat->live_class_bytes = stat->live_n * (int64_t)stat->size;
+  stat->live_header_bytes =
+      stat->live_n * (int64_t)fragHeaderBytes(stat->size);
+  return true;
+}
+
+// NOTE: format
+//   # mcmalloc fragmentation (live chunks) requested=<B> class=<B> ...
+//   <rank> <class> <size> <live_n> <requested> <class> <header> <waste> ...
+//   # suggested classes: <class> <size> -> <new size> chunks=<n> saved=<B>
+void fragStatDump(int fd) {
+  FdPrinter printer(fd);
+  mc_frag_stat_t stats[N_SIZE_INDEX_ELEMENT];
+  int ranks[N_SIZE_INDEX_ELEMENT];
+  int rankN = 0;
+  mc_frag_stat_t total = {};
+  for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++) {
+    fragStatGet(i, &stats[i]);
+    if (stats[i].live_n <= 0) continue;
+    total.live_n += stats[i].live_n;
+    total.live_requested_bytes += stats[i].live_requested_bytes;
+    total.live_class_bytes += stats[i].live_class_bytes;
+    total.live_header_bytes += stats[i].live_header_bytes;
+    // NOTE: insertion sort by wasted bytes (descending)
+    int k = rankN++;
+    for (; k > 0 && wastedBytes(stats[ranks[k - 1]]) < wastedBytes(stats[i]);
+         k--)
+      ranks[k] = ranks[k - 1];
+    ranks[k] = i;
+  }
+
+  printer.Printf("# mcmalloc fragmentation (live chunks)%s\n",
+                 FRAG_STATISTIC_FLAG ? "" : " (disabled)");
+  printer.Printf("# chunks=%lld requested=%lld class=%lld header=%lld [B]",
+                 (long long)total.live_n,
+                 (long long)total.live_requested_bytes,
+                 (long long)total.live_class_bytes,
+                 (long long)total.live_header_bytes);
+  printer.Printf(" waste/requested=");
+  printPercent(printer, wastedBytes(total), total.live_requested_bytes);
+  printer.Printf("\n# learned hash classes=%d/%d\n", sizeHashClassN() - 1,
+                 sizeHashMaxSize - 1);
+  printer.Printf("%4s %5s %10s %10s %14s %14s %12s %14s %7s %12s\n", "rank",
+                 "class", "size", "live", "requested[B]", "class[B]",
+                 "header[B]", "waste[B]", "waste%", "malloc");
+  for (int k = 0; k < rankN; k++) {
+    const mc_frag_stat_t &stat = stats[ranks[k]];
+    printer.Printf("%4d %5d %10llu %10lld %14lld %14lld %12lld %14lld", k + 1,
+                   ranks[k], (unsigned long long)stat.size,
+                   (long long)stat.live_n,
+                   (long long)stat.live_requested_bytes,
+                   (long long)stat.live_class_bytes,
+                   (long long)stat.live_header_bytes,
+                   (long long)wastedBytes(stat));
+    printPercent(printer, wastedBytes(stat), stat.live_class_bytes +
+                                                 stat.live_header_bytes);
+    printer.Printf(" %12llu\n", (unsigned long long)stat.malloc_n);
+  }
+
+  // NOTE: the best split of each class, ranked by saved bytes
+  FragSuggestion suggestions[N_SIZE_INDEX_ELEMENT];
+  int suggestionN = 0;
+  for (int k = 0; k < rankN; k++) {
+    FragSuggestion s = suggest(ranks[k], stats[ranks[k]]);
+    if (s.savedBytes <= 0) continue;
+    int m = suggestionN++;
+    for (; m > 0 && suggestions[m - 1].savedBytes < s.savedBytes; m--)
+      suggestions[m] = suggestions[m - 1];
+    suggestions[m] = s;
+  }
+  printer.Printf("# suggested classes (the live chunks which fit in it)\n");
+  for (int m = 0; m < suggestionN; m++) {
+    const FragSuggestion &s = suggestions[m];
+    printer.Printf("class=%d size=%llu -> %llu chunks=%lld saved=%lld[B]\n",
+                   s.sizeIndex, (unsigned long long)stats[s.sizeIndex].size,
+                   (unsigned long long)s.size, (long long)s.chunkN,
+                   (long long)s.savedBytes);
+  }
+}
+}  // namespace mc
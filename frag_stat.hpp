@@ -0,0 +1,102 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "chunk.hpp"
+#include "debug.hpp"
+#include "mcmalloc_api.hpp"
+
+// NOTE: internal fragmentation statistics
+// NOTE: (-DFRAG_STATISTIC_FLAG=true, compiled out by default)
+// NOTE: the requested size is kept in the chunk header (16B more per chunk),
+// NOTE: so every allocation is counted exactly (no sampling)
+// NOTE: each thread index updates its own slot (no atomic instructions), and
+// NOTE: readers sum up all slots (a slot can be negative because of frees
+// NOTE: from other threads)
+// NOTE: malloc(3) must not be used in this file (dumped by a signal handler)
+
+namespace mc {
+// NOTE: no user-provided constructor (zero-initialized static storage)
+class FragCounter {
+ public:
+  static const int BucketN = MC_FRAG_BUCKET_N;
+
+  // NOTE: bucket i: waste in [i * size / BucketN, (i + 1) * size / BucketN)
+  static int BucketIndex(size_t requestedSize, size_t size) {
+    if (requestedSize >= size) return 0;
+    size_t i = (size - requestedSize) * BucketN / size;
+    return i < (size_t)BucketN ? (int)i : BucketN - 1;
+  }
+  // NOTE: n == 1: malloc(3), n == -1: free(3)
+  void Record(size_t requestedSize, size_t size, int64_t n) {
+    _liveN += n;
+    _liveRequestedBytes += n * (int64_t)requestedSize;
+    int b = BucketIndex(requestedSize, size);
+    _liveBuckets[b] += n;
+    if (n < 0) return;
+    _mallocN += n;
+    _requestedBytes += n * requestedSize;
+    if (requestedSize > _bucketMaxRequested[b])
+      _bucketMaxRequested[b] = requestedSize;
+  }
+  void AddTo(mc_frag_stat_t *stat) {
+    stat->live_n += _liveN;
+    stat->live_requested_bytes += _liveRequestedBytes;
+    stat->malloc_n += _mallocN;
+    stat->requested_bytes += _requestedBytes;
+    for (int i = 0; i < BucketN; i++) {
+      stat->live_buckets[i] += _liveBuckets[i];
+      if (_bucketMaxRequested[i] > stat->bucket_max_requested[i])
+        stat->bucket_max_requested[i] = _bucketMaxRequested[i];
+    }
+  }
+
+ private:
+  int64_t _liveN;
+  int64_t _liveRequestedBytes;
+  uint64_t _mallocN;
+  uint64_t _requestedBytes;
+  int64_t _liveBuckets[BucketN];
+  uint64_t _bucketMaxRequested[BucketN];
+};
+
+// NOTE: >= # of thread indices (1 slot if compiled out)
+const int FragStatSlotN = FRAG_STATISTIC_FLAG ? 256 : 1;
+extern FragCounter fragCounters[FragStatSlotN][N_SIZE_INDEX_ELEMENT]
+    __attribute__((visibility("hidden")));
+
+// NOTE: bytes of a chunk except the body (the header for the statistics is
+// NOTE: not counted)
+inline size_t fragHeaderBytes(size_t size) {
+  return Chunk::UnitSize(size) - size - Chunk::StatisticHeaderSize;
+}
+
+inline void fragRecord(Chunk *chunk, int threadIndex, int64_t n) {
+  if (!FRAG_STATISTIC_FLAG) return;
+  if (threadIndex < 0 || threadIndex >= FragStatSlotN) return;
+  fragCounters[threadIndex][chunk->SizeIndex()].Record(
+      chunk->RequestedSize(), chunk->Size(), n);
+}
+
+bool fragStatGet(int sizeIndex, mc_frag_stat_t *stat);
+// NOTE: text report (async-signal-safe)
+void fragStatDump(int fd);
+}  // namespace mc
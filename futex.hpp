@@ -0,0 +1,43 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+// NOTE: wake-ups of helper threads (no mutex/condition variable, so that
+// NOTE: they can be used in malloc(3))
+namespace mc {
+// NOTE: increment seq and wake a waiter
+inline void futexWake(std::atomic<uint32_t> &seq) {
+  seq.fetch_add(1, std::memory_order_release);
+  syscall(SYS_futex, &seq, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+// NOTE: wait until seq != val (or the timeout)
+inline void futexWait(std::atomic<uint32_t> &seq, uint32_t val,
+                      long timeoutMs) {
+  struct timespec ts = {(time_t)(timeoutMs / 1000),
+                        (long)(timeoutMs % 1000) * 1000000};
+  syscall(SYS_futex, &seq, FUTEX_WAIT_PRIVATE, val, &ts, nullptr, 0);
+}
+}  // namespace mc
@@ -0,0 +1,135 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "latency_stat.hpp"
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+
+namespace mc {
+LatencyHistogram latencyHistograms[LatencyStatSlotN][LatencyKindN];
+thread_local int latencyStatSlot
+    __attribute__((tls_model("initial-exec"))) = 0;
+
+namespace {
+const char *const kindNames[LatencyKindN] = {
+    "malloc.local", "malloc.others", "malloc.mmap",      "free",
+    "free.migrate", "mmap.syscall",  "lock.chunk_stack", "lock.size_hash",
+};
+
+// NOTE: reference point of the TSC rate
+uint64_t initTsc;
+uint64_t initNs;
+
+uint64_t monotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// NOTE: upper bound of the bucket of the q-quantile (q: per mille)
+uint64_t quantileCycles(const mc_latency_stat_t &stat, uint64_t q) {
+  uint64_t rank = (stat.count * q + 999) / 1000;
+  uint64_t n = 0;
+  for (int i = 0; i < MC_LATENCY_BUCKET_N; i++) {
+    n += stat.buckets[i];
+    if (n >= rank && n > 0) return i == 0 ? 0 : (uint64_t)1 << i;
+  }
+  return stat.max_cycles;
+}
+
+void printStat(FdPrinter &printer, const char *prefix,
+               const mc_latency_stat_t &stat) {
+  printer.Printf(
+      "%s count=%llu mean=%llu p50<=%llu p99<=%llu p999<=%llu max=%llu\n",
+      prefix, (unsigned long long)stat.count,
+      (unsigned long long)(stat.sum_cycles / stat.count),
+      (unsigned long long)quantileCycles(stat, 500),
+      (unsigned long long)quantileCycles(stat, 990),
+      (unsigned long long)quantileCycles(stat, 999),
+      (unsigned long long)stat.max_cycles);
+}
+}  // namespace
+
+void latencyStatInit() {
+  initTsc = readTsc();
+  initNs = monotonicNs();
+}
+
+void latencyStatBind(int threadIndex) {
+  if (threadIndex >= 0 && threadIndex < LatencyStatSlotN)
+    latencyStatSlot = threadIndex;
+}
+
+bool latencyStatGet(int threadIndex, int kind, mc_latency_stat_t *stat) {
+  if (kind < 0 || kind >= LatencyKindN || threadIndex < -1 ||
+      threadIndex >= LatencyStatSlotN)
+    return false;
+  memset(stat, 0, sizeof(*stat));
+  if (threadIndex >= 0) {
+    latencyHistograms[threadIndex][kind].AddTo(stat);
+    return true;
+  }
+  for (int j = 0; j < LatencyStatSlotN; j++)
+    latencyHistograms[j][kind].AddTo(stat);
+  return true;
+}
+
+// NOTE: counts recorded concurrently may be lost
+void latencyStatReset() {
+  for (int j = 0; j < LatencyStatSlotN; j++)
+    for (int i = 0; i < LatencyKindN; i++) latencyHistograms[j][i].Reset();
+}
+
+// NOTE: format
+//   # mcmalloc latency (cycles) tsc_per_us=<rate>
+//   <kind> count=<n> mean=<c> p50<=<c> p99<=<c> p999<=<c> max=<c>
+//     thread=<index> count=<n> ...
+//     buckets <upper bound>:<n> ...
+void latencyStatDump(int fd) {
+  FdPrinter printer(fd);
+  uint64_t elapsedNs = monotonicNs() - initNs;
+  uint64_t tscPerUs =
+      elapsedNs == 0 ? 0 : (readTsc() - initTsc) * 1000 / elapsedNs;
+  printer.Printf("# mcmalloc latency (cycles) tsc_per_us=%llu%s\n",
+                 (unsigned long long)tscPerUs,
+                 LATENCY_STATISTIC_FLAG ? "" : " (disabled)");
+  for (int i = 0; i < LatencyKindN; i++) {
+    mc_latency_stat_t stat;
+    latencyStatGet(-1, i, &stat);
+    if (stat.count == 0) continue;
+    printStat(printer, kindNames[i], stat);
+    for (int j = 0; j < LatencyStatSlotN; j++) {
+      mc_latency_stat_t threadStat;
+      latencyStatGet(j, i, &threadStat);
+      if (threadStat.count == 0) continue;
+      char prefix[32];
+      signalSafeSnprintf(prefix, sizeof(prefix), "  thread=%d", j);
+      printStat(printer, prefix, threadStat);
+    }
+    printer.Printf("  buckets");
+    for (int k = 0; k < MC_LATENCY_BUCKET_N; k++) {
+      if (stat.buckets[k] == 0) continue;
+      printer.Printf(" %llu:%llu",
+                     (unsigned long long)(k == 0 ? 0 : (uint64_t)1 << k),
+                     (unsigned long long)stat.buckets[k]);
+    }
+    printer.Printf("\n");
+  }
+}
+}  // namespace mc
@@ -0,0 +1,260 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "debug.hpp"
+#include "mcmalloc_api.hpp"
+#include "misc.hpp"
+
+// NOTE: latency histograms of allocation paths and locks
+// NOTE: (-DLATENCY_STATISTIC_FLAG=true, compiled out by default)
+// NOTE: each thread index records TSC cycles into log2 buckets of its own
+// NOTE: slot (no atomic instructions), and readers sum up all slots
+// NOTE: malloc(3) must not be used in this file (dumped by a signal handler)
+
+namespace mc {
+// NOTE: same numbers as MC_LATENCY_* of mcmalloc_api.hpp
+enum LatencyKind {
+  LatencyMallocLocal = MC_LATENCY_MALLOC_LOCAL,
+  LatencyMallocOthers = MC_LATENCY_MALLOC_OTHERS,
+  LatencyMallocMmap = MC_LATENCY_MALLOC_MMAP,
+  LatencyFree = MC_LATENCY_FREE,
+  LatencyFreeMigrate = MC_LATENCY_FREE_MIGRATE,
+  LatencyMmapSyscall = MC_LATENCY_MMAP_SYSCALL,
+  LatencyChunkStackLock = MC_LATENCY_CHUNK_STACK_LOCK,
+  LatencySizeHashLock = MC_LATENCY_SIZE_HASH_LOCK,
+  LatencyKindN = MC_LATENCY_KIND_N,
+};
+
+inline uint64_t readTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  // NOTE: nanoseconds instead of cycles
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+// NOTE: no user-provided constructor (zero-initialized static storage)
+class LatencyHistogram {
+ public:
+  static const int BucketN = MC_LATENCY_BUCKET_N;
+
+  // NOTE: bucket 0: 0 cycles, bucket i: [2^(i-1), 2^i) cycles
+  static int BucketIndex(uint64_t cycles) {
+    if (cycles == 0) return 0;
+    int i = 64 - __builtin_clzll(cycles);
+    return i < BucketN ? i : BucketN - 1;
+  }
+  void Record(uint64_t cycles) {
+    _n[BucketIndex(cycles)]++;
+    _count++;
+    _sumCycles += cycles;
+    if (cycles > _maxCycles) _maxCycles = cycles;
+  }
+  void AddTo(mc_latency_stat_t *stat) {
+    stat->count += _count;
+    stat->sum_cycles += _sumCycles;
+    if (_maxCycles > stat->max_cycles) stat->max_cycles = _maxCycles;
+    for (int i = 0; i < BucketN; i++) stat->buckets[i] += _n[i];
+  }
+  void Reset() {
+    for (int i = 0; i < BucketN; i++) _n[i] = 0;
+    _count = _sumCycles = _maxCycles = 0;
+  }
+
+ private:
+  uint64_t _count;
+  uint64_t _sumCycles;
+  uint64_t _maxCycles;
+  uint64_t _n[BucketN];
+};
+
+// NOTE: vsnprintf(3) of the subset which the reports use, formatted by hand
+// NOTE: (vsnprintf(3) is not async-signal-safe)
+// NOTE: %[-][width][l|ll|z](d|u|s) and %%
+// NOTE: return the length of the whole output (-1: unsupported conversion)
+inline int signalSafeVsnprintf(char *buf, size_t size, const char *fmt,
+                               va_list ap) {
+  size_t n = 0;
+  auto put = [&](char c) {
+    if (n + 1 < size) buf[n] = c;
+    n++;
+  };
+  for (const char *p = fmt; *p != '\0'; p++) {
+    if (*p != '%') {
+      put(*p);
+      continue;
+    }
+    p++;
+    if (*p == '%') {
+      put('%');
+      continue;
+    }
+    bool leftFlag = *p == '-';
+    if (leftFlag) p++;
+    int width = 0;
+    while (*p >= '0' && *p <= '9') width = width * 10 + (*p++ - '0');
+    int longN = 0;
+    while (*p == 'l') longN++, p++;
+    if (*p == 'z') longN = 1, p++;
+    char digits[24];
+    const char *s;
+    int len;
+    if (*p == 's') {
+      s = va_arg(ap, const char *);
+      if (s == nullptr) s = "(null)";
+      len = strlen(s);
+    } else if (*p == 'd' || *p == 'u') {
+      unsigned long long v;
+      bool negativeFlag = false;
+      if (*p == 'd') {
+        long long x = longN >= 2   ? va_arg(ap, long long)
+                      : longN == 1 ? va_arg(ap, long)
+                                   : va_arg(ap, int);
+        negativeFlag = x < 0;
+        v = negativeFlag ? 0ULL - (unsigned long long)x : x;
+      } else {
+        v = longN >= 2   ? va_arg(ap, unsigned long long)
+            : longN == 1 ? va_arg(ap, unsigned long)
+                         : va_arg(ap, unsigned int);
+      }
+      char *q = digits + sizeof(digits);
+      do {
+        *--q = '0' + v % 10;
+        v /= 10;
+      } while (v != 0);
+      if (negativeFlag) *--q = '-';
+      s = q;
+      len = digits + sizeof(digits) - q;
+    } else {
+      return -1;
+    }
+    for (int k = len; !leftFlag && k < width; k++) put(' ');
+    for (int k = 0; k < len; k++) put(s[k]);
+    for (int k = len; leftFlag && k < width; k++) put(' ');
+  }
+  if (size > 0) buf[std::min(n, size - 1)] = '\0';
+  return (int)n;
+}
+inline int signalSafeSnprintf(char *buf, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+inline int signalSafeSnprintf(char *buf, size_t size, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = signalSafeVsnprintf(buf, size, fmt, ap);
+  va_end(ap);
+  return n;
+}
+
+// NOTE: formatted write(2) without malloc(3) (reports of signal handlers)
+// NOTE: a line is truncated to 255 bytes
+class FdPrinter {
+ public:
+  explicit FdPrinter(int fd) : _fd(fd) {}
+  void Printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = signalSafeVsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n <= 0) return;
+    n = std::min(n, (int)sizeof(buf) - 1);
+    for (int k = 0; k < n;) {
+      ssize_t r = write(_fd, buf + k, n - k);
+      if (r <= 0) return;
+      k += r;
+    }
+  }
+
+ private:
+  int _fd;
+};
+
+// NOTE: >= # of thread indices
+const int LatencyStatSlotN = 256;
+extern LatencyHistogram latencyHistograms[LatencyStatSlotN][LatencyKindN]
+    __attribute__((visibility("hidden")));
+// NOTE: slot of the calling thread (thread index, 0 until it is bound)
+extern thread_local int latencyStatSlot
+    __attribute__((tls_model("initial-exec"), visibility("hidden")));
+
+void latencyStatInit();
+void latencyStatBind(int threadIndex);
+// NOTE: threadIndex == -1: sum of all threads
+bool latencyStatGet(int threadIndex, int kind, mc_latency_stat_t *stat);
+void latencyStatReset();
+// NOTE: text report (async-signal-safe)
+void latencyStatDump(int fd);
+
+inline void latencyRecord(int kind, uint64_t cycles) {
+  if (!LATENCY_STATISTIC_FLAG) return;
+  latencyHistograms[latencyStatSlot][kind].Record(cycles);
+}
+
+// NOTE: record the lifetime of the scope
+class LatencyScope {
+ public:
+  explicit LatencyScope(int kind) : _kind(kind) {
+    if (LATENCY_STATISTIC_FLAG) _begin = readTsc();
+  }
+  ~LatencyScope() {
+    if (LATENCY_STATISTIC_FLAG) latencyRecord(_kind, readTsc() - _begin);
+  }
+
+ private:
+  int _kind;
+  uint64_t _begin;
+};
+
+// NOTE: an uncontended acquisition (trylock) is recorded as 0 cycles, so
+// NOTE: count - buckets[0] is # of contended acquisitions
+inline int latencyMutexLock(pthread_mutex_t *mtx, int kind) {
+  if (!LATENCY_STATISTIC_FLAG) return _pthread_mutex_lock(mtx);
+  if (pthread_mutex_trylock(mtx) == 0) {
+    latencyRecord(kind, 0);
+    return 0;
+  }
+  uint64_t begin = readTsc();
+  int r = _pthread_mutex_lock(mtx);
+  // NOTE: at least 1 cycle to be counted as contended
+  latencyRecord(kind, readTsc() - begin + 1);
+  return r;
+}
+}  // namespace mc
+
+#define SCOPED_LATENCY_LOCK(m, kind)                        \
+  mc::latencyMutexLock(&m, kind);                           \
+  __attribute__((__cleanup__(__pthread_mutex_unlock)))      \
+      pthread_mutex_t* CONCAT(scoped_lock_, __LINE__) = &m; \
+  UNUSED_PARAM(CONCAT(scoped_lock_, __LINE__))
@@ -17,15 +17,19 @@
 
 #include "mcmalloc.hpp"
 
+#include <cerrno>
+#include <csignal>
+
 const bool mcmallocDebugFlag = false;
 
 // NOTE: 1:main thread + 1:HElib thread pool control thread + 8:HElib thread pool threds + 72:parallel processing threads
 const int nThread = 1 + 1 + 8 + 72;
-mc::MCMalloc<nThread> mcmalloc;
+// NOTE: hidden to be accessed without GOT
+__attribute__((visibility("hidden"))) mc::MCMalloc<nThread> mcmalloc;
 
 bool initFlag = false;
 
-thread_local struct ThreadLocalData {
+struct ThreadLocalData {
   inline int &Index() { return index_; }
   inline bool &MainFlag() { return mainFlag_; }
   inline bool &InitFlag() { return initFlag_; }
@@ -33,7 +37,12 @@ thread_local struct ThreadLocalData {
   int index_;
   bool mainFlag_;
   bool initFlag_;
-} threadLocalData = {0, false, false};
+};
+// NOTE: initial-exec model (an offset from %fs instead of __tls_get_addr)
+// NOTE: libmcmalloc.so is loaded at startup (LD_PRELOAD or linked), so the
+// NOTE: static TLS block is always available
+thread_local ThreadLocalData threadLocalData
+    __attribute__((tls_model("initial-exec"))) = {0, false, false};
 
 #define _threadInit()                            \
   if (UNLIKELY(!threadLocalData.InitFlag())) {   \
@@ -43,11 +52,150 @@ thread_local struct ThreadLocalData {
       initFlag = true, mcmalloc.Init();          \
   }
 
+// NOTE: MCMALLOC_PROFILE is consumed here so that child processes do not
+// pre-warm with the profile of the parent
+char profilePath[1024] = {};
+
+void onSizeHashRegister(int sizeIndex) { mcmalloc.SetTransferN(sizeIndex); }
+
 void mainInit() {
   threadLocalData.MainFlag() = true;
+  mc::latencyStatInit();
   mcmalloc._Init();
+  sizeHashRegisterHook = onSizeHashRegister;
+  mc::pressureWatcher.Init();
+  mc::prefaulter.Init();
+  mc::spillTier.Init();
+
+  const char *path = envar::Get<const char *>("MCMALLOC_PROFILE", "");
+  if (path[0] != '\0' && strlen(path) < sizeof(profilePath)) {
+    strcpy(profilePath, path);
+    unsetenv("MCMALLOC_PROFILE");
+    bool populateFlag = envar::GetBool("MCMALLOC_PROFILE_POPULATE", false);
+    size_t maxBytes = envar::GetLongLong("MCMALLOC_PROFILE_MAX_BYTES",
+                                         (long long)16 << 30);
+    // NOTE: the stacks of the main thread are filled before threadInit()
+    mcmalloc.InitThread(threadLocalData.Index());
+    mcmalloc.ProfileLoad(profilePath, populateFlag, maxBytes,
+                         threadLocalData.Index());
+  }
+}
+void mainTerm() {
+  if (profilePath[0] != '\0') mcmalloc.ProfileSave(profilePath);
+  mc::statShm.Term();
+}
+
+namespace {
+// NOTE: the watcher thread is created by a constructor of a static object
+// NOTE: (not in malloc(3) called before libc is initialized)
+struct PressureWatchStarter {
+  PressureWatchStarter() {
+    if (!envar::GetBool("MCMALLOC_PRESSURE_WATCH", false)) return;
+    _threadInit();
+    bool ret = mc::pressureWatcher.Start();
+    eassert(ret, "[mcmalloc pressure watcher start failed]: errno=%d", errno);
+  }
+} pressureWatchStarter;
+
+struct PrefaulterStarter {
+  PrefaulterStarter() {
+    // NOTE: mc::prefaulter.Init() is called by the first malloc(3)
+    _threadInit();
+    if (!mc::prefaulter.IsEnabled()) return;
+    bool ret = mc::prefaulter.Start();
+    eassert(ret, "[mcmalloc prefaulter start failed]: errno=%d", errno);
+  }
+} prefaulterStarter;
+
+void *asyncRefillThreadFunc(void *arg) {
+  _threadInit();
+  mcmalloc.AsyncRefillLoop(threadLocalData.Index());
+  return nullptr;
+}
+struct AsyncRefillStarter {
+  AsyncRefillStarter() {
+    _threadInit();
+    if (!mcmalloc.IsAsyncRefillEnabled()) return;
+    pthread_t th;
+    int ret = pthread_create(&th, nullptr, asyncRefillThreadFunc, nullptr);
+    eassert(ret == 0, "[mcmalloc async refill start failed]: errno=%d", ret);
+    pthread_detach(th);
+  }
+} asyncRefillStarter;
+
+// NOTE: the publisher does not call malloc(3), so it takes no thread index
+void *statShmThreadFunc(void *arg) {
+  int64_t intervalMs = mc::statShm.IntervalMs();
+  struct timespec ts = {(time_t)(intervalMs / 1000),
+                        (long)(intervalMs % 1000) * 1000000};
+  while (true) {
+    mcmalloc.PublishStats(mc::statShm);
+    nanosleep(&ts, nullptr);
+  }
+  return nullptr;
+}
+struct StatShmStarter {
+  StatShmStarter() {
+    if (!envar::GetBool("MCMALLOC_STAT_SHM", false)) return;
+    _threadInit();
+    // NOTE: statistics are optional (e.g. /dev/shm is not mounted)
+    if (!mc::statShm.Init(nThread, N_SIZE_INDEX_ELEMENT)) return;
+    pthread_t th;
+    int ret = pthread_create(&th, nullptr, statShmThreadFunc, nullptr);
+    eassert(ret == 0, "[mcmalloc stat publisher start failed]: errno=%d",
+            ret);
+    pthread_detach(th);
+  }
+} statShmStarter;
+
+// NOTE: write(2) must not change errno of the interrupted code
+void latencyDumpHandler(int signo) {
+  UNUSED_PARAM(signo);
+  int savedErrno = errno;
+  mc::latencyStatDump(STDERR_FILENO);
+  errno = savedErrno;
+}
+// NOTE: MCMALLOC_LATENCY_DUMP_SIGNAL=signo (e.g. 12:SIGUSR2)
+struct LatencyDumpStarter {
+  LatencyDumpStarter() {
+    if (!LATENCY_STATISTIC_FLAG) return;
+    int signo = envar::GetLongLong("MCMALLOC_LATENCY_DUMP_SIGNAL", 0);
+    if (signo <= 0) return;
+    struct sigaction sa = {};
+    sa.sa_handler = latencyDumpHandler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    int ret = sigaction(signo, &sa, nullptr);
+    eassert(ret == 0, "[mcmalloc latency dump signal failed]: errno=%d", errno);
+  }
+} latencyDumpStarter;
+
+void fragDumpHandler(int signo) {
+  UNUSED_PARAM(signo);
+  int savedErrno = errno;
+  mc::fragStatDump(STDERR_FILENO);
+  errno = savedErrno;
+}
+// NOTE: MCMALLOC_FRAG_DUMP_SIGNAL=signo (e.g. 12:SIGUSR2)
+struct FragDumpStarter {
+  FragDumpStarter() {
+    if (!FRAG_STATISTIC_FLAG) return;
+    int signo = envar::GetLongLong("MCMALLOC_FRAG_DUMP_SIGNAL", 0);
+    if (signo <= 0) return;
+    struct sigaction sa = {};
+    sa.sa_handler = fragDumpHandler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    int ret = sigaction(signo, &sa, nullptr);
+    eassert(ret == 0, "[mcmalloc frag dump signal failed]: errno=%d", errno);
+  }
+} fragDumpStarter;
+}  // namespace
+
+size_t mc::trimMemory(int level) {
+  _threadInit();
+  return mcmalloc.Trim(level, threadLocalData.Index());
 }
-void mainTerm() {}
 
 void threadInit() {
   if (!threadLocalData.MainFlag())
@@ -55,14 +203,20 @@ void threadInit() {
   eassert(threadLocalData.Index() != -1 && threadLocalData.Index() < nThread,
           "required: threadIndex != -1 && threadIndex(%d) < nThread(%d)",
           threadLocalData.Index(), nThread);
+  mcmalloc.InitThread(threadLocalData.Index());
+  mc::latencyStatBind(threadLocalData.Index());
+  batchMmapBind(threadLocalData.Index());
 }
 void threadTerm() {
   if (!threadLocalData.MainFlag()) {
+    // NOTE: the stacks stay for the next thread of the same index
+    mcmalloc.TrimThreadContainers(threadLocalData.Index());
     bool ret = threadutil::DeleteCurrentThreadIndex();
     eassert(ret, "[mcmalloc threadutil::DeleteCurrentThreadIndex failed]");
     // TODO: error processing
     ret = true;
     // NOTE: unmap mmap buffer
+    mc::arenaTerm();
     batchMmapTerm();
   }
 }
@@ -71,28 +225,31 @@ void threadTerm() {
 extern "C" {
 #endif
 
+namespace {
+__attribute__((noinline, cold)) void *mallocInit(size_t size) {
+  threadLocalData.InitFlag() = true;
+  _init();
+  if (threadLocalData.MainFlag() && !initFlag)
+    initFlag = true, mcmalloc.Init();
+  return malloc(size);
+}
+}  // namespace
+
 void *malloc(size_t size) {
   if (UNLIKELY(size == 0)) return nullptr;
+  if (UNLIKELY(!threadLocalData.InitFlag())) return mallocInit(size);
 
-  const int threadIndex = threadLocalData.Index();
-  if (UNLIKELY(!threadLocalData.InitFlag())) {
-    threadLocalData.InitFlag() = true;
-    _init();
-    if (threadLocalData.MainFlag() && !initFlag)
-      initFlag = true, mcmalloc.Init();
-    return malloc(size);
-  }
-
-  void *ptr = mcmalloc.Malloc(size, threadIndex);
+  // NOTE: errno = ENOMEM is set by the slow path on failure
+  void *ptr = mcmalloc.Malloc(size, threadLocalData.Index());
   if (mcmallocDebugFlag)
     myprintf("#====malloc: size=%8d, ptr=%p\n", (int)size, ptr);
-  if (UNLIKELY(ptr == nullptr)) errno = ENOMEM;
   return ptr;
 }
 
 void free(void *ptr) {
   if (mcmallocDebugFlag) myprintf("#====free: ptr=%p\n", ptr);
   if (UNLIKELY(ptr == nullptr)) return;
+  if (UNLIKELY(!mc::ownershipMap.Contains(ptr))) return mc::foreignFree(ptr);
 
   _threadInit();
   bool ret = mcmalloc.Free(ptr, threadLocalData.Index());
@@ -104,7 +261,11 @@ void *calloc(size_t nmemb, size_t size) {
   if (UNLIKELY(nmemb == 0 || size == 0)) return nullptr;
   _threadInit();
 
-  const size_t total_size = nmemb * size;
+  size_t total_size;
+  if (UNLIKELY(__builtin_mul_overflow(nmemb, size, &total_size))) {
+    errno = ENOMEM;
+    return nullptr;
+  }
   void *ptr = malloc(total_size);
   if (ptr != nullptr) memset(ptr, 0, total_size);
   if (mcmallocDebugFlag)
@@ -119,6 +280,8 @@ void *realloc(void *ptr, size_t size) {
 void *realloc(void *ptr, size_t size) throw() {
 #endif
   if (UNLIKELY(ptr == nullptr)) return malloc(size);
+  if (UNLIKELY(!mc::ownershipMap.Contains(ptr)))
+    return mc::foreignRealloc(ptr, size);
   _threadInit();
 
   void *newPtr = mcmalloc.Realloc(ptr, size, threadLocalData.Index());
@@ -148,6 +311,201 @@ int posix_memalign(void **memptr, size_t alignment, size_t size) throw() {
   return ret;
 }
 
+int mc_reserve(size_t size, size_t count) {
+  if (UNLIKELY(size == 0 || count == 0)) return 0;
+  _threadInit();
+
+  bool ret = mcmalloc.Reserve(size, count, threadLocalData.Index());
+  return ret ? 0 : ENOMEM;
+}
+
+int mc_release_reserve(size_t size) {
+  if (UNLIKELY(size == 0)) return 0;
+  _threadInit();
+
+  mcmalloc.ReleaseReserve(size, threadLocalData.Index());
+  return 0;
+}
+
+size_t mc_malloc_batch(size_t size, size_t n, void **ptrs) {
+  if (UNLIKELY(size == 0 || n == 0)) return 0;
+  _threadInit();
+
+  size_t ret = mcmalloc.MallocBatch(size, n, ptrs, threadLocalData.Index());
+  if (UNLIKELY(ret < n)) errno = ENOMEM;
+  return ret;
+}
+
+void mc_free_batch(void **ptrs, size_t n) {
+  if (UNLIKELY(ptrs == nullptr || n == 0)) return;
+  _threadInit();
+
+  mcmalloc.FreeBatch(ptrs, n, threadLocalData.Index());
+}
+
+namespace {
+int ctlClass(const char *name, const mc::CtlArgs &args, int threadIndex) {
+  int sizeIndex;
+  const char *suffix;
+  if (mc::ctlParseIndex(name, "class.", &sizeIndex, &suffix)) {
+    if (sizeIndex >= (int)N_SIZE_INDEX_ELEMENT) return ENOENT;
+    if (strcmp(suffix, "size") == 0)
+      return mc::ctlReadOnly(args, (size_t)indexToSizeWithHash(sizeIndex));
+    if (strcmp(suffix, "global.chunks") == 0)
+      return mc::ctlReadOnly(args, mcmalloc.GlobalChunkN(sizeIndex));
+    if (strcmp(suffix, "global.containers") == 0)
+      return mc::ctlReadOnly(args, mcmalloc.GlobalContainerN(sizeIndex));
+    if (strcmp(suffix, "transfer_n") == 0)
+      return mc::ctlReadOnly(args, mcmalloc.TransferN(sizeIndex));
+    return ENOENT;
+  }
+  if (mc::ctlParseIndex(name, "thread.class.", &sizeIndex, &suffix)) {
+    if (sizeIndex >= (int)N_SIZE_INDEX_ELEMENT) return ENOENT;
+    if (strcmp(suffix, "chunks") == 0)
+      return mc::ctlReadOnly(args,
+                             mcmalloc.LocalChunkN(sizeIndex, threadIndex));
+    if (strcmp(suffix, "containers") == 0)
+      return mc::ctlReadOnly(args,
+                             mcmalloc.LocalContainerN(sizeIndex, threadIndex));
+    return ENOENT;
+  }
+  return ENOENT;
+}
+size_t nonNegative(int64_t v) { return v > 0 ? v : 0; }
+}  // namespace
+
+int mc_ctl(const char *name, void *oldp, size_t *oldlenp, void *newp,
+           size_t newlen) {
+  if (UNLIKELY(name == nullptr)) return EINVAL;
+  _threadInit();
+  int threadIndex = threadLocalData.Index();
+  const mc::CtlArgs args = {oldp, oldlenp, newp, newlen};
+
+  // NOTE: statistics
+  if (strcmp(name, "stats.allocated") == 0)
+    return mc::ctlReadOnly(args, nonNegative(mcmalloc.AllocatedBytes(-1)));
+  if (strcmp(name, "stats.cached") == 0)
+    return mc::ctlReadOnly(args, nonNegative(mcmalloc.CachedBytes(-1)));
+  if (strcmp(name, "stats.global") == 0)
+    return mc::ctlReadOnly(args, nonNegative(mcmalloc.GlobalBytes()));
+  if (strcmp(name, "stats.mapped") == 0)
+    return mc::ctlReadOnly(
+        args, nonNegative(mmapStat.mappedBytes.load() -
+                          mmapStat.unmappedBytes.load()));
+  if (strcmp(name, "stats.spilled") == 0)
+    return mc::ctlReadOnly(args, nonNegative(mc::spillTier.MappedBytes()));
+  if (strcmp(name, "stats.requested") == 0) {
+    if (!FRAG_STATISTIC_FLAG) return ENOENT;
+    return mc::ctlReadOnly(args, nonNegative(mcmalloc.RequestedBytes()));
+  }
+  if (strcmp(name, "thread.allocated") == 0)
+    return mc::ctlReadOnly(args,
+                           nonNegative(mcmalloc.AllocatedBytes(threadIndex)));
+  if (strcmp(name, "thread.cached") == 0)
+    return mc::ctlReadOnly(args,
+                           nonNegative(mcmalloc.CachedBytes(threadIndex)));
+
+  // NOTE: tunables
+  if (strcmp(name, "opt.thread_cache_bytes") == 0)
+    return mc::ctlReadWrite<size_t>(args, mcmalloc.ThreadCacheMaxBytes());
+  if (strcmp(name, "opt.migration_threshold") == 0)
+    return mc::ctlReadWrite<size_t>(args, mcmalloc.ClassCacheMinBytes());
+  if (strcmp(name, "opt.steal_victim_n") == 0)
+    // NOTE: more victims than thread slots are not tried
+    return mc::ctlReadWrite<size_t>(args, mcmalloc.StealVictimMaxN(),
+                                    (size_t)0, (size_t)nThread);
+  if (strcmp(name, "opt.async_refill_bytes") == 0)
+    return mc::ctlReadWrite<size_t>(args, mcmalloc.AsyncRefillBytes());
+  if (strcmp(name, "opt.refill_max_bytes") == 0)
+    return mc::ctlReadWrite<size_t>(args, mcmalloc.RefillMaxBytes());
+  if (strcmp(name, "opt.transfer_bytes") == 0)
+    return mc::ctlReadOnly(args, (size_t)mcmalloc.TransferBytes());
+  if (strcmp(name, "opt.heap_limit") == 0)
+    return mc::ctlReadOnly(args, (size_t)mcmalloc.HeapLimitBytes());
+  if (strcmp(name, "opt.spill_threshold") == 0)
+    return mc::ctlReadOnly(args, (size_t)mc::spillTier.ThresholdBytes());
+  if (strcmp(name, "opt.percpu") == 0)
+    return mc::ctlReadOnly(args, mcmalloc.IsPerCpuEnabled());
+  if (strcmp(name, "opt.async_refill") == 0)
+    return mc::ctlReadOnly(args, mcmalloc.IsAsyncRefillEnabled());
+
+  // NOTE: thread cache
+  if (strcmp(name, "thread.tcache.enabled") == 0) {
+    bool enabledFlag = !mcmalloc.CacheDisabledFlag(threadIndex);
+    int ret = mc::ctlReadWrite<bool>(args, enabledFlag);
+    if (ret != 0 || !args.WriteFlag()) return ret;
+    mcmalloc.CacheDisabledFlag(threadIndex) = !enabledFlag;
+    if (!enabledFlag) mcmalloc.FlushThreadCache(threadIndex);
+    return 0;
+  }
+
+  // NOTE: actions
+  if (strcmp(name, "thread.flush") == 0) {
+    if (args.WriteFlag()) return EINVAL;
+    return mc::ctlRead(args, mcmalloc.FlushThreadCache(threadIndex));
+  }
+  if (strcmp(name, "arena.purge") == 0) {
+    if (args.WriteFlag()) return EINVAL;
+    return mc::ctlRead(
+        args, mcmalloc.Trim(decltype(mcmalloc)::TrimLevelGlobal, threadIndex));
+  }
+
+  if (strcmp(name, "class.n") == 0)
+    return mc::ctlReadOnly(args, (size_t)N_SIZE_INDEX_ELEMENT);
+  return ctlClass(name, args, threadIndex);
+}
+
+int mc_latency_get(int thread_index, int kind, mc_latency_stat_t *stat) {
+  if (UNLIKELY(stat == nullptr)) return EINVAL;
+  return mc::latencyStatGet(thread_index, kind, stat) ? 0 : EINVAL;
+}
+
+void mc_latency_reset(void) { mc::latencyStatReset(); }
+
+void mc_latency_dump(int fd) { mc::latencyStatDump(fd); }
+
+int mc_frag_get(int class_index, mc_frag_stat_t *stat) {
+  if (UNLIKELY(stat == nullptr)) return EINVAL;
+  return mc::fragStatGet(class_index, stat) ? 0 : EINVAL;
+}
+
+void mc_frag_dump(int fd) { mc::fragStatDump(fd); }
+
+int mc_rss_report(int fd) {
+  _threadInit();
+  return mcmalloc.RssReport(fd);
+}
+
+void *mc_spill_malloc(size_t size) {
+  if (UNLIKELY(size == 0)) return nullptr;
+  _threadInit();
+  return mcmalloc.MallocSpill(size);
+}
+
+int mc_spill_advise(void *ptr, size_t offset, size_t length, int phase) {
+  if (UNLIKELY(ptr == nullptr || !mc::ownershipMap.Contains(ptr)))
+    return EINVAL;
+  mc::Chunk *chunk = mc::Chunk::FromLiveBodyPtr(ptr);
+  if ((int)chunk->SizeIndex() != mc::SpillTier::SpillSizeIndex) return EINVAL;
+  size_t size = (uintptr_t)chunk->PtrWithoutOffset() + chunk->Size() -
+                (uintptr_t)ptr;
+  // NOTE: checked before any addition (ptr + offset can wrap)
+  if (offset > size || length > size - offset) return EINVAL;
+  if (length == 0) length = size - offset;
+  if (length == 0) return 0;
+  return mc::spillTier.Advise((void *)((uintptr_t)ptr + offset), length,
+                              phase);
+}
+
+#ifndef __APPLE__
+int malloc_trim(size_t pad) throw() {
+  // NOTE: pad is ignored (the top of the heap is not kept)
+  UNUSED_PARAM(pad);
+  size_t size = mc::trimMemory(decltype(mcmalloc)::TrimLevelAll);
+  return size > 0 ? 1 : 0;
+}
+#endif
+
 // TODO: memalign
 // TODO: valloc
 
@@ -20,10 +20,19 @@
 #include <cstddef>
 #include <string>  // for memset
 
+#include "arena.hpp"
 #include "batch_mmap.hpp"
+#include "ctl.hpp"
 #include "debug.hpp"
+#include "frag_stat.hpp"
 #include "init_term.hpp"
+#include "latency_stat.hpp"
+#include "mcmalloc_api.hpp"
 #include "mcmalloc_impl.hpp"
+#include "prefault.hpp"
+#include "ownership_map.hpp"
+#include "pressure_watch.hpp"
+#include "stat_shm.hpp"
 #include "thread_util.hpp"
 
 #ifdef __APPLE__
@@ -40,4 +49,6 @@ void *realloc(void *ptr, size_t size) throw();
 void *calloc(size_t nmemb, size_t size);
 int posix_memalign(void **memptr, size_t alignment, size_t size) throw();
 void free(void *p);
+extern "C" int malloc_trim(size_t pad) throw();
 #endif
+
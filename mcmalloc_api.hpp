@@ -0,0 +1,207 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// NOTE: MCMalloc extension API
+// NOTE: this header can be included by applications (link with -lmcmalloc)
+
+extern "C" {
+// NOTE: fill the local stack of the calling thread with count chunks of size
+// NOTE: reserved chunks are not migrated to the global stack by free(3)
+// NOTE: the size is learned as a class at once (malloc(3) keeps using it)
+// NOTE: return 0 on success, otherwise ENOMEM
+int mc_reserve(size_t size, size_t count);
+int mc_release_reserve(size_t size);
+
+// NOTE: allocate n pointers of the same size at once
+// NOTE: return # of allocated pointers (n on success)
+size_t mc_malloc_batch(size_t size, size_t n, void **ptrs);
+// NOTE: free n pointers at once (nullptr is ignored)
+void mc_free_batch(void **ptrs, size_t n);
+
+// NOTE: region (arena) allocator
+// NOTE: memory is bump-allocated without a chunk header and is released all
+// together by mc_arena_reset() or mc_arena_destroy() (never call free(3))
+// NOTE: an arena is not thread-safe
+typedef struct mc_arena mc_arena_t;
+// NOTE: blockSize == 0 means default block size (64KB)
+mc_arena_t *mc_arena_create(size_t blockSize);
+// NOTE: 16B alignment
+void *mc_arena_alloc(mc_arena_t *arena, size_t size);
+void *mc_arena_memalign(mc_arena_t *arena, size_t alignment, size_t size);
+void mc_arena_reset(mc_arena_t *arena);
+void mc_arena_destroy(mc_arena_t *arena);
+
+// NOTE: heap shared by several processes (MAP_SHARED)
+// NOTE: name: shm_open(3) name (created with size bytes by the first
+// NOTE: opener, size is ignored by the others), NULL: a new memfd
+// NOTE: return NULL with errno on failure
+// NOTE: pointers differ between processes: exchange offsets
+// NOTE: (mc_shm_offset() == 0 means NULL)
+// NOTE: the free chunks cached by a process which died are recovered on
+// NOTE: open, when the heap runs out and by mc_shm_heap_recover() (return
+// NOTE: # of recovered bytes)
+typedef struct mc_shm_heap mc_shm_heap_t;
+mc_shm_heap_t *mc_shm_heap_open(const char *name, size_t size);
+// NOTE: attach to the heap of fd (fd is duplicated)
+mc_shm_heap_t *mc_shm_heap_open_fd(int fd);
+int mc_shm_heap_fd(mc_shm_heap_t *heap);
+void mc_shm_heap_close(mc_shm_heap_t *heap);
+// NOTE: 16B alignment
+void *mc_shm_malloc(mc_shm_heap_t *heap, size_t size);
+void mc_shm_free(mc_shm_heap_t *heap, void *ptr);
+uint64_t mc_shm_offset(mc_shm_heap_t *heap, const void *ptr);
+void *mc_shm_ptr(mc_shm_heap_t *heap, uint64_t offset);
+size_t mc_shm_heap_recover(mc_shm_heap_t *heap);
+
+// NOTE: file-backed spill tier
+// NOTE: the allocation is a MAP_SHARED mapping of an unlinked scratch file in
+// NOTE: MCMALLOC_SPILL_DIR, whose pages are evicted by the page cache
+// NOTE: (release it by free(3), realloc(3) keeps it in the tier)
+// NOTE: fork(2) keeps copy-on-write semantics: the child copies the live
+// NOTE: spilled allocations (also those of MCMALLOC_SPILL_THRESHOLD) into
+// NOTE: scratch files of its own before fork(2) returns
+// NOTE: return NULL with errno on failure
+void *mc_spill_malloc(size_t size);
+// NOTE: access phases of mc_spill_advise
+enum {
+  // NOTE: MADV_NORMAL
+  MC_SPILL_NORMAL = 0,
+  // NOTE: MADV_SEQUENTIAL (aggressive read-ahead, pages behind are reclaimed
+  // NOTE: first)
+  MC_SPILL_SEQUENTIAL,
+  // NOTE: MADV_RANDOM (no read-ahead)
+  MC_SPILL_RANDOM,
+  // NOTE: MADV_WILLNEED (read the range ahead of its phase)
+  MC_SPILL_WILLNEED,
+  // NOTE: MADV_COLD (reclaimed first under pressure, Linux 5.4)
+  MC_SPILL_COLD,
+  // NOTE: msync(MS_SYNC) + MADV_PAGEOUT (written back and evicted now, Linux
+  // NOTE: 5.4)
+  MC_SPILL_PAGEOUT,
+};
+// NOTE: advise [ptr + offset, ptr + offset + length) of a spilled allocation
+// NOTE: (length == 0: to the end, the range is widened to pages)
+// NOTE: return 0 on success, EINVAL (not spilled or out of the allocation)
+// NOTE: or errno of madvise(2)
+int mc_spill_advise(void *ptr, size_t offset, size_t length, int phase);
+
+// NOTE: control and introspection namespace (mallctl(3) style)
+// NOTE: oldp/oldlenp: read the current value if oldp is not NULL
+// NOTE: newp/newlen: write a new value if newp is not NULL
+// NOTE: *oldlenp and newlen must be the size of the type of the name
+// NOTE: return 0 on success, ENOENT (unknown name), EINVAL (wrong length or
+// NOTE: value) or EPERM (read-only)
+// NOTE: names (size_t unless noted, thread.*: the calling thread)
+// NOTE:   stats.allocated, stats.cached, stats.global, stats.mapped,
+// NOTE:   stats.spilled (ro)
+// NOTE:   opt.thread_cache_bytes, opt.migration_threshold,
+// NOTE:   opt.steal_victim_n, opt.async_refill_bytes, opt.refill_max_bytes
+// NOTE:   (rw)
+// NOTE:   opt.transfer_bytes, opt.heap_limit, opt.spill_threshold (ro)
+// NOTE:   (opt.spill_threshold: MCMALLOC_SPILL_THRESHOLD, see mc_spill_malloc
+// NOTE:   for fork(2))
+// NOTE:   opt.percpu, opt.async_refill (bool, ro)
+// NOTE:   stats.requested (ro, -DFRAG_STATISTIC_FLAG=true only)
+// NOTE:   thread.allocated, thread.cached (ro)
+// NOTE:   thread.tcache.enabled (bool, rw)
+// NOTE:   thread.flush, arena.purge (actions: oldp gets # of moved/released
+// NOTE:   bytes)
+// NOTE:   class.n, class.<i>.size, class.<i>.transfer_n,
+// NOTE:   class.<i>.global.chunks,
+// NOTE:   class.<i>.global.containers, thread.class.<i>.chunks,
+// NOTE:   thread.class.<i>.containers (ro)
+int mc_ctl(const char *name, void *oldp, size_t *oldlenp, void *newp,
+           size_t newlen);
+
+// NOTE: latency histograms (libmcmalloc.so built with
+// NOTE: -DLATENCY_STATISTIC_FLAG=true, otherwise all counts are 0)
+// NOTE: paths: whole malloc(3) of a thread cache hit, MallocChunkFromOthers,
+// NOTE: MallocChunkMmap, whole free(3), migration of free(3), mmap(2) of
+// NOTE: batchMmap
+// NOTE: locks: wait time of each acquisition (0 cycles: not contended)
+enum {
+  MC_LATENCY_MALLOC_LOCAL = 0,
+  MC_LATENCY_MALLOC_OTHERS,
+  MC_LATENCY_MALLOC_MMAP,
+  MC_LATENCY_FREE,
+  MC_LATENCY_FREE_MIGRATE,
+  MC_LATENCY_MMAP_SYSCALL,
+  MC_LATENCY_CHUNK_STACK_LOCK,
+  MC_LATENCY_SIZE_HASH_LOCK,
+  MC_LATENCY_KIND_N,
+};
+#define MC_LATENCY_BUCKET_N 64
+// NOTE: cycles of TSC (nanoseconds on other architectures)
+// NOTE: buckets[0]: 0 cycles, buckets[i]: [2^(i-1), 2^i) cycles
+typedef struct mc_latency_stat {
+  uint64_t count;
+  uint64_t sum_cycles;
+  uint64_t max_cycles;
+  uint64_t buckets[MC_LATENCY_BUCKET_N];
+} mc_latency_stat_t;
+// NOTE: thread_index == -1: sum of all threads
+// NOTE: return 0 on success, otherwise EINVAL
+int mc_latency_get(int thread_index, int kind, mc_latency_stat_t *stat);
+void mc_latency_reset(void);
+// NOTE: write a text report to fd
+void mc_latency_dump(int fd);
+
+// NOTE: internal fragmentation of live chunks per size class
+// NOTE: (libmcmalloc.so built with -DFRAG_STATISTIC_FLAG=true, otherwise
+// NOTE: all counts are 0)
+// NOTE: waste of a chunk: size - requested bytes (alignment padding of
+// NOTE: memalign(3) included)
+#define MC_FRAG_BUCKET_N 16
+typedef struct mc_frag_stat {
+  // NOTE: size of the class (learned hash classes included)
+  uint64_t size;
+  int64_t live_n;
+  int64_t live_requested_bytes;
+  int64_t live_class_bytes;
+  // NOTE: chunk headers and the 16B rounding of the chunk unit
+  int64_t live_header_bytes;
+  // NOTE: cumulative # and requested bytes of allocations
+  uint64_t malloc_n;
+  uint64_t requested_bytes;
+  // NOTE: live_buckets[i]: live chunks whose waste is in
+  // NOTE: [i * size / MC_FRAG_BUCKET_N, (i + 1) * size / MC_FRAG_BUCKET_N)
+  int64_t live_buckets[MC_FRAG_BUCKET_N];
+  // NOTE: the largest requested bytes ever recorded into each bucket
+  uint64_t bucket_max_requested[MC_FRAG_BUCKET_N];
+} mc_frag_stat_t;
+// NOTE: return 0 on success, otherwise EINVAL
+int mc_frag_get(int class_index, mc_frag_stat_t *stat);
+// NOTE: write a text report to fd (classes ranked by wasted bytes and
+// NOTE: suggested new classes)
+void mc_frag_dump(int fd);
+
+// NOTE: resident memory attribution
+// NOTE: scan the mappings of the allocator with mincore(2) and write a
+// NOTE: tab-separated report to fd (category, thread, class, size, chunks,
+// NOTE: mapped and resident bytes; categories: live, thread_cache, inbox,
+// NOTE: global, percpu, metadata, batch_tail, prefault, total, process,
+// NOTE: unattributed)
+// NOTE: the stacks are locked briefly one by one (not a consistent
+// NOTE: snapshot)
+// NOTE: return 0 on success, otherwise ENOMEM
+int mc_rss_report(int fd);
+}
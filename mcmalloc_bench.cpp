@@ -0,0 +1,235 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// NOTE: benchmark harness (not linked with libmcmalloc.so)
+// e.g.
+// $ LD_PRELOAD=./libmcmalloc.so ./mcmalloc-bench warmup
+// $ export MCMALLOC_PROFILE=prof.txt
+// $ LD_PRELOAD=./libmcmalloc.so ./mcmalloc-bench warmup
+// $ LD_PRELOAD=./libmcmalloc.so ./mcmalloc-bench fastpath
+// $ LD_PRELOAD=./libmcmalloc.so ./mcmalloc-bench profile prof.txt
+
+#include <dlfcn.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+struct Measure {
+  Measure() : _start(std::chrono::steady_clock::now()), _minflt(Minflt()) {}
+  void Print(const char *name, size_t nOp) {
+    auto end = std::chrono::steady_clock::now();
+    double ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - _start)
+            .count();
+    printf("%-24s: time=%12.3f[ms], op=%10zu, %8.2f[ns/op], minflt=%ld\n",
+           name, ns / 1e6, nOp, ns / (nOp ? nOp : 1), Minflt() - _minflt);
+  }
+  static long Minflt() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt;
+  }
+  std::chrono::steady_clock::time_point _start;
+  long _minflt;
+};
+// NOTE: retired instructions of user space (perf_event_open)
+// NOTE: Read() returns -1 if the counter is not available (e.g. in a VM or
+// NOTE: with perf_event_paranoid >= 3)
+struct InstructionCounter {
+  InstructionCounter() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    _fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (_fd == -1) return;
+    ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  ~InstructionCounter() {
+    if (_fd != -1) close(_fd);
+  }
+  long long Read() {
+    long long n;
+    if (_fd == -1 || read(_fd, &n, sizeof(n)) != sizeof(n)) return -1;
+    return n;
+  }
+  int _fd;
+};
+
+// NOTE: same-shaped phases (e.g. FHE ciphertexts) with a few odd sizes
+const size_t warmupSizes[] = {24,   40,    72,     136,     264,  520,
+                              1032, 16392, 131080, 1048584, 4096, 65536};
+
+void Phase(std::vector<void *> &ptrs, size_t nPerSize) {
+  for (size_t size : warmupSizes)
+    for (size_t i = 0; i < nPerSize; i++) {
+      char *p = (char *)malloc(size);
+      p[0] = p[size - 1] = 1;
+      ptrs.push_back(p);
+    }
+}
+
+int Warmup(int argc, char **argv) {
+  size_t nPerSize = argc > 2 ? atoll(argv[2]) : 256;
+  int nPhase = argc > 3 ? atoi(argv[3]) : 4;
+  std::vector<void *> ptrs;
+  ptrs.reserve(sizeof(warmupSizes) / sizeof(warmupSizes[0]) * nPerSize);
+  for (int i = 0; i < nPhase; i++) {
+    ptrs.clear();
+    Measure m;
+    Phase(ptrs, nPerSize);
+    std::string name = "warmup phase " + std::to_string(i);
+    m.Print(name.c_str(), ptrs.size());
+    for (void *p : ptrs) free(p);
+  }
+  return 0;
+}
+// NOTE: warmup twice in child processes with MCMALLOC_PROFILE: the first
+// NOTE: one saves the profile at exit and the second one loads it
+int Profile(int argc, char **argv) {
+  const char *path = argc > 2 ? argv[2] : "mcmalloc-bench-profile.txt";
+  unlink(path);
+  setenv("MCMALLOC_PROFILE", path, 1);
+  std::vector<char *> args = {argv[0], (char *)"warmup"};
+  for (int i = 3; i < argc; i++) args.push_back(argv[i]);
+  args.push_back(nullptr);
+  for (const char *name : {"profile save", "profile load"}) {
+    printf("# %s: %s\n", name, path);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      execv("/proc/self/exe", args.data());
+      _exit(127);
+    }
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1) return 1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr, "%s failed: status=%d\n", name, status);
+      return 1;
+    }
+    if (access(path, R_OK) != 0) {
+      fprintf(stderr, "%s is not saved (use LD_PRELOAD)\n", path);
+      return 1;
+    }
+  }
+  return 0;
+}
+// NOTE: malloc/free loop vs mc_malloc_batch/mc_free_batch
+int Batch(int argc, char **argv) {
+  size_t size = argc > 2 ? atoll(argv[2]) : 64;
+  size_t n = argc > 3 ? atoll(argv[3]) : 4096;
+  int nRepeat = argc > 4 ? atoi(argv[4]) : 256;
+  typedef size_t (*MallocBatchFunc)(size_t, size_t, void **);
+  typedef void (*FreeBatchFunc)(void **, size_t);
+  auto mallocBatch = (MallocBatchFunc)dlsym(RTLD_DEFAULT, "mc_malloc_batch");
+  auto freeBatch = (FreeBatchFunc)dlsym(RTLD_DEFAULT, "mc_free_batch");
+
+  std::vector<void *> ptrs(n);
+  {
+    Measure m;
+    for (int r = 0; r < nRepeat; r++) {
+      for (size_t i = 0; i < n; i++) ptrs[i] = malloc(size);
+      for (size_t i = 0; i < n; i++) free(ptrs[i]);
+    }
+    m.Print("malloc/free", n * nRepeat);
+  }
+  if (mallocBatch == nullptr || freeBatch == nullptr) {
+    fprintf(stderr, "mc_malloc_batch is not found (use LD_PRELOAD)\n");
+    return 1;
+  }
+  {
+    Measure m;
+    for (int r = 0; r < nRepeat; r++) {
+      mallocBatch(size, n, ptrs.data());
+      freeBatch(ptrs.data(), n);
+    }
+    m.Print("mc_malloc/free_batch", n * nRepeat);
+  }
+  return 0;
+}
+// NOTE: hits of the thread cache (malloc/free pairs and LIFO bursts)
+int Fastpath(int argc, char **argv) {
+  size_t size = argc > 2 ? atoll(argv[2]) : 64;
+  size_t n = argc > 3 ? atoll(argv[3]) : 10000000;
+  const size_t burstN = 64;
+  void *ptrs[burstN];
+  // NOTE: fill the cache
+  for (size_t i = 0; i < burstN; i++) ptrs[i] = malloc(size);
+  for (size_t i = 0; i < burstN; i++) free(ptrs[i]);
+
+  {
+    InstructionCounter counter;
+    long long start = counter.Read();
+    Measure m;
+    for (size_t i = 0; i < n; i++) {
+      void *p = malloc(size);
+      __asm__ __volatile__("" : : "r"(p) : "memory");
+      free(p);
+    }
+    m.Print("malloc+free pair", n);
+    if (start != -1)
+      printf("%-24s: %8.2f[instructions/pair]\n", "",
+             (double)(counter.Read() - start) / n);
+  }
+  {
+    InstructionCounter counter;
+    long long start = counter.Read();
+    Measure m;
+    for (size_t i = 0; i < n / burstN; i++) {
+      for (size_t j = 0; j < burstN; j++) ptrs[j] = malloc(size);
+      __asm__ __volatile__("" : : "r"(ptrs) : "memory");
+      for (size_t j = 0; j < burstN; j++) free(ptrs[burstN - 1 - j]);
+    }
+    m.Print("malloc+free burst", n / burstN * burstN);
+    if (start != -1)
+      printf("%-24s: %8.2f[instructions/pair]\n", "",
+             (double)(counter.Read() - start) / (n / burstN * burstN));
+  }
+  return 0;
+}
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *mode = argc > 1 ? argv[1] : "";
+  if (strcmp(mode, "warmup") == 0) return Warmup(argc, argv);
+  if (strcmp(mode, "batch") == 0) return Batch(argc, argv);
+  if (strcmp(mode, "fastpath") == 0) return Fastpath(argc, argv);
+  if (strcmp(mode, "profile") == 0) return Profile(argc, argv);
+  fprintf(stderr,
+          "usage: %s warmup [nPerSize] [nPhase]\n"
+          "       %s batch [size] [n] [nRepeat]\n"
+          "       %s fastpath [size] [n]\n"
+          "       %s profile [path] [nPerSize] [nPhase]\n",
+          argv[0], argv[0], argv[0], argv[0]);
+  return 1;
+}
@@ -17,6 +17,8 @@
 
 #pragma once
 
+#include <unistd.h>
+#include <algorithm>
 #include <cerrno>
 #include <chrono>
 #include <fstream>
@@ -31,10 +33,21 @@
 #include "chunk_linked_array_list.hpp"
 #include "debug.hpp"
 #include "envar.hpp"
+#include "frag_stat.hpp"
+#include "futex.hpp"
+#include "latency_stat.hpp"
 #include "memory_chunk_size.hpp"
 #include "misc.hpp"
+#include "ownership_map.hpp"
+#include "percpu_cache.hpp"
+#include "prefault.hpp"
+#include "profile.hpp"
+#include "rss_stat.hpp"
+#include "spill.hpp"
+#include "stat_shm.hpp"
 #include "stack.hpp"
 #include "status.hpp"
+#include "tagged_free_list.hpp"
 
 #define LOCK_PARTITIONS_NUM 1
 
@@ -46,30 +59,96 @@ class MCMalloc {
  public:
   MCMalloc() {}
   // NOTE: set _Init() before calling constracter
+  // NOTE: the local stacks are initialized by InitThread (thread slots are
+  // NOTE: zero-filled until a thread registers) and containers are allocated
+  // NOTE: on the first push, so the startup touches no metadata
   void _Init() {
-    for (int j = 0; j < (int)N; j++) {
-      int threadIndex = j;
-      for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++) {
-        int sizeIndex = i;
-        _stacks[threadIndex][sizeIndex]._Init();
-      }
-    }
-
+    _threadSlotMtx = PTHREAD_MUTEX_INITIALIZER;
     for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT * LOCK_PARTITIONS_NUM; i++) {
       _cts[i]._Init();
       _chunkStackMtx[i] = PTHREAD_MUTEX_INITIALIZER;
     }
+    _emergencyMtx = PTHREAD_MUTEX_INITIALIZER;
+    _transferBytes = envar::GetLongLong("MCMALLOC_TRANSFER_BYTES", 1LL << 20);
+    _refillMaxBytes =
+        envar::GetLongLong("MCMALLOC_REFILL_MAX_BYTES", 1LL << 20);
+    for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++) SetTransferN(i);
+
+    _threadCacheMaxBytes =
+        envar::GetLongLong("MCMALLOC_THREAD_CACHE_BYTES", 256LL << 20);
+    _classCacheMinBytes =
+        envar::GetLongLong("MCMALLOC_CLASS_CACHE_MIN_BYTES", 4LL << 20);
+    _stealVictimMaxN = envar::GetLongLong("MCMALLOC_STEAL_VICTIM_N", 2);
+    _heapLimitBytes = envar::GetLongLong("MCMALLOC_HEAP_LIMIT", 0);
+    // NOTE: credits cached by threads must not exhaust the limit
+    _heapCreditUnitBytes = std::min(
+        (int64_t)4 << 20,
+        std::max(_heapLimitBytes / (4 * (int64_t)N), (int64_t)PAGE_SIZE));
+    _perCpuClassBytes =
+        envar::GetLongLong("MCMALLOC_PERCPU_CLASS_BYTES", 64LL << 10);
+    // NOTE: the per-thread stacks are used if rseq is not available
+    if (envar::GetBool("MCMALLOC_PERCPU", false)) _perCpuCache.Init();
+    _asyncRefillFlag = envar::GetBool("MCMALLOC_ASYNC_REFILL", false);
+    _asyncRefillBytes =
+        envar::GetLongLong("MCMALLOC_ASYNC_REFILL_BYTES", 1LL << 20);
   }
 
+  // NOTE: # of chunks moved at once between the local stacks and the global
+  // NOTE: stack (PushBuffer, PullBuffer): _transferBytes / unitSize (>= 1)
+  // NOTE: rounded down to full containers
+  // NOTE: a container holds ContainerN() chunks (<= ChunkArrayContainerN),
+  // NOTE: so large classes move in small batches (a 1MB class: 1 chunk per
+  // NOTE: container) and small classes move a chain of TransferLength() full
+  // NOTE: containers (a 16B class: 21 containers)
+  size_t TransferN(int sizeIndex) {
+    return _containerNs[sizeIndex] * _transferLengths[sizeIndex];
+  }
+  size_t ContainerN(int sizeIndex) { return _containerNs[sizeIndex]; }
+  size_t TransferLength(int sizeIndex) { return _transferLengths[sizeIndex]; }
+  // NOTE: called for all classes at startup and for a learned hash class
+  // NOTE: before it is published (no stacks of the class have chunks yet)
+  void SetTransferN(int sizeIndex) {
+    size_t unitSize = Chunk::UnitSize(indexToSizeWithHash(sizeIndex));
+    size_t n = std::max((size_t)_transferBytes / unitSize, (size_t)1);
+    size_t containerN = std::min(n, (size_t)ChunkArrayContainerN);
+    SCOPED_LOCK(_threadSlotMtx);
+    _containerNs[sizeIndex] = containerN;
+    _transferLengths[sizeIndex] = n / containerN;
+    for (int j = 0; j < (int)N; j++)
+      if (_threadSlotInitFlags[j])
+        _stacks[j][sizeIndex].Container().SetCapacity(containerN);
+    for (int i = 0; i < LOCK_PARTITIONS_NUM; i++)
+      _cts[sizeIndex * LOCK_PARTITIONS_NUM + i].SetCapacity(containerN);
+  }
+  // NOTE: initialize the local stacks of a thread slot when a thread
+  // NOTE: registers (the slot is kept for the next thread of the index)
+  void InitThread(int threadIndex) {
+    SCOPED_LOCK(_threadSlotMtx);
+    if (_threadSlotInitFlags[threadIndex]) return;
+    for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++) {
+      int sizeIndex = i;
+      _stacks[threadIndex][sizeIndex]._Init();
+      _stacks[threadIndex][sizeIndex].Container().SetCapacity(
+          _containerNs[sizeIndex]);
+    }
+    _threadSlotInitFlags[threadIndex] = true;
+  }
+
+  // NOTE: spilled chunks are unmapped (the scratch file goes with them)
   bool FreeChunkMunmap(Chunk *chunk, int threadIndex) {
-    // TODO
+    UNUSED_PARAM(threadIndex);
+    spillTier.Unmap((void *)chunk, sizeof(Chunk) + chunk->Size());
     return true;
   }
   bool FreeChunk(Chunk *chunk, int threadIndex) {
     eassert(chunk != nullptr, "chunk nullptr error: index = %d", threadIndex);
+    if (UNLIKELY((int)chunk->SizeIndex() == SpillTier::SpillSizeIndex))
+      return FreeChunkMunmap(chunk, threadIndex);
+    LatencyScope latencyScope(LatencyFree);
 
     size_t size = chunk->Size();
     _callStat[threadIndex].CallFree(size);
+    FragRecordFree(chunk, threadIndex);
 
     int sizeIndex = chunk->SizeIndex();
 
@@ -95,76 +174,855 @@ class MCMalloc {
     }
 #endif
 
+    bool rotateFlag = _bufferStatuses[threadIndex][sizeIndex].OnFree();
+    if (UNLIKELY(_perCpuCache.IsEnabled()) &&
+        FreeChunkPerCpu(chunk, sizeIndex, size))
+      return true;
+    MigrateLocalBuffers(size, sizeIndex, threadIndex, rotateFlag);
+
+    // NOTE: fast path: the top container has room
+    if (LIKELY(
+            _stacks[threadIndex][sizeIndex].Container().PushTopFast(chunk))) {
+      AddBufferMemoryUsage(threadIndex, size);
+      return true;
+    }
+    return FreeChunkSlow(chunk, size, sizeIndex, threadIndex);
+  }
+  __attribute__((noinline, cold)) bool FreeChunkSlow(Chunk *chunk,
+                                                     size_t size,
+                                                     int sizeIndex,
+                                                     int threadIndex) {
+    bool ret = _stacks[threadIndex][sizeIndex].Push(chunk);
+    if (UNLIKELY(!ret)) ret = PushChunksSlow(&chunk, 1, sizeIndex, threadIndex);
+    if (LIKELY(ret)) AddBufferMemoryUsage(threadIndex, size);
+    return true;
+  }
+  // NOTE: called when no new container can be allocated for the local stack
+  // NOTE: the rest of chunks go to the overflow list of the class
+  // NOTE: return # of chunks pushed to the local stack
+  __attribute__((noinline)) size_t PushChunksSlow(Chunk **chunks, size_t n,
+                                                  int sizeIndex,
+                                                  int threadIndex) {
+    // NOTE: empty containers of all stacks can be reused
+    // NOTE: (trim at most once per 1024 failures, because it scans all stacks)
+    if (_pushFailN.fetch_add(1) % 1024 == 0) TrimContainers();
+    size_t k = _stacks[threadIndex][sizeIndex].Container().PushTopN(chunks, n);
+    for (size_t i = k; i < n; i++)
+      _overflowChunks[sizeIndex].Push(chunks[i]->PtrWithoutOffset());
+    return k;
+  }
+  // NOTE: the link is stored in the body (chunks are never unmapped while
+  // NOTE: they are in the list)
+  Chunk *PopOverflowChunk(int sizeIndex) {
+    if (LIKELY(_overflowChunks[sizeIndex].IsEmpty())) return nullptr;
+    void *ptr = _overflowChunks[sizeIndex].Pop();
+    if (ptr == nullptr) return nullptr;
+    return (Chunk *)((uintptr_t)ptr - sizeof(Chunk));
+  }
+  // NOTE: heap limit (MCMALLOC_HEAP_LIMIT) with per-thread credits
+  // NOTE: the global counter is touched only when the credit runs out
+  bool AcquireHeapBytes(int64_t bytes, int threadIndex) {
+    if (LIKELY(_heapLimitBytes == 0)) return true;
+    auto &credit = _statuses[threadIndex].HeapCreditBytes();
+    if (LIKELY(credit >= bytes)) {
+      credit -= bytes;
+      return true;
+    }
+    // NOTE: 1.with a credit unit 2.exactly
+    int64_t grant = std::max(bytes - credit, _heapCreditUnitBytes);
+    for (int i = 0; i < 2; i++) {
+      if (_heapGrantedBytes.fetch_add(grant) + grant <= _heapLimitBytes) {
+        credit += grant - bytes;
+        return true;
+      }
+      _heapGrantedBytes.fetch_sub(grant);
+      grant = bytes - credit;
+    }
+    return false;
+  }
+  void ReleaseHeapBytes(int64_t bytes, int threadIndex) {
+    if (LIKELY(_heapLimitBytes == 0)) return;
+    auto &credit = _statuses[threadIndex].HeapCreditBytes();
+    credit += bytes;
+    if (credit > _heapCreditUnitBytes * 2) {
+      _heapGrantedBytes.fetch_sub(credit - _heapCreditUnitBytes);
+      credit = _heapCreditUnitBytes;
+    }
+  }
+  // NOTE: migrate the local buffers to the global stack incrementally
+  // NOTE: (1 container per call) if the class exceeds its adaptive target or
+  // NOTE: the thread exceeds its byte budget
+  // NOTE: reserved chunks (mc_reserve) are not counted
+  void MigrateLocalBuffers(size_t size, int sizeIndex, int threadIndex,
+                           bool rotateFlag) {
+    auto &bs = _bufferStatuses[threadIndex][sizeIndex];
+    if (UNLIKELY(rotateFlag)) bs.TargetBytes() = bs.HighWaterMark() * size;
+    // NOTE: at most one chunk stays (this is called before it is pushed)
+    if (UNLIKELY(_statuses[threadIndex].CacheDisabledFlag())) {
+      FlushThreadClass(sizeIndex, threadIndex);
+      return;
+    }
+
     auto &ct = _stacks[threadIndex][sizeIndex].Container();
-    size_t length = ct.Length();
-    // NOTE: req: # of buffer size >=3 (to guarantee that there is a mid layer or are mid layers)
-    if (length >= 2 && length * ChunkArrayContainerN * size >= 64 * (1 << 20)) {
-      for (int i = 0; i < (int)(length / 2); i++) {
-        auto buf = ct.PopMidBuffer();
+    int64_t cachedBytes = ((int64_t)ct.Size() - bs.NReservedChunk()) * size;
+    int64_t targetBytes = std::max(bs.TargetBytes(), _classCacheMinBytes);
+    bool overBudgetFlag =
+        _statuses[threadIndex].CurrentBufferMemoryUsage() >
+        _threadCacheMaxBytes;
+    if (UNLIKELY(overBudgetFlag)) {
+      // NOTE: containers may have been stolen by other threads
+      _statuses[threadIndex].CurrentBufferMemoryUsage() -=
+          _statuses[threadIndex].StolenBufferMemoryUsage().exchange(0);
+      overBudgetFlag = _statuses[threadIndex].CurrentBufferMemoryUsage() >
+                       _threadCacheMaxBytes;
+    }
+    if (LIKELY(cachedBytes <= targetBytes && !overBudgetFlag)) return;
+    MigrateLocalBuffersSlow(sizeIndex, threadIndex, overBudgetFlag,
+                            rotateFlag);
+  }
+  __attribute__((noinline, cold)) void MigrateLocalBuffersSlow(
+      int sizeIndex, int threadIndex, bool overBudgetFlag, bool rotateFlag) {
+    LatencyScope latencyScope(LatencyFreeMigrate);
+    if (MigratableLength(sizeIndex, threadIndex) > 0) {
+      PushBuffer(sizeIndex, threadIndex);
+      return;
+    }
+    // NOTE: this class has nothing to migrate, so trim other classes
+    // NOTE: (at most once a window)
+    if (overBudgetFlag && rotateFlag) TrimThreadCache(threadIndex);
+  }
+  // NOTE: migrate 1 container of the class which exceeds its target the most
+  void TrimThreadCache(int threadIndex) {
+    int maxSizeIndex = -1;
+    int64_t maxExcessBytes = 0;
+    for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++) {
+      int sizeIndex = i;
+      if (MigratableLength(sizeIndex, threadIndex) == 0) continue;
+      auto &bs = _bufferStatuses[threadIndex][sizeIndex];
+      int64_t cachedBytes =
+          ((int64_t)_stacks[threadIndex][sizeIndex].Size() -
+           bs.NReservedChunk()) *
+          indexToSizeWithHash(sizeIndex);
+      int64_t excessBytes = cachedBytes - bs.TargetBytes();
+      if (excessBytes > maxExcessBytes)
+        maxSizeIndex = sizeIndex, maxExcessBytes = excessBytes;
+    }
+    if (maxSizeIndex != -1) PushBuffer(maxSizeIndex, threadIndex);
+  }
+  // NOTE: # of full containers which can be migrated to the global stack
+  // NOTE: req: # of buffer size >=2 (to guarantee that there is a mid layer)
+  size_t MigratableLength(int sizeIndex, int threadIndex) {
+    auto &ct = _stacks[threadIndex][sizeIndex].Container();
+    size_t nReserved =
+        _bufferStatuses[threadIndex][sizeIndex].NReservedChunk();
+    size_t reservedLength =
+        (nReserved + ContainerN(sizeIndex) - 1) / ContainerN(sizeIndex);
+    if (ct.Length() < reservedLength + 2) return 0;
+    return ct.Length() - reservedLength - 1;
+  }
+  // NOTE: move at most TransferLength() full containers from the global
+  // NOTE: stack to the local stack
+  // NOTE: return # of moved containers
+  size_t PullBuffer(int sizeIndex, int threadIndex) {
+    ChunkArrayContainer *bufs = nullptr;
+    size_t k = chunkPopList(TransferLength(sizeIndex), bufs, threadIndex,
+                            sizeIndex);
+    if (k == 0) return 0;
+    _stacks[threadIndex][sizeIndex].Container().PushMidBuffers(bufs);
+    AddBufferMemoryUsage(threadIndex, k * BufferBytes(sizeIndex));
+    return k;
+  }
+  // NOTE: move at most TransferLength() full containers from the local stack
+  // NOTE: to the global stack (1 container at least, reserved containers are
+  // NOTE: kept for the rest)
+  // NOTE: return # of moved containers
+  size_t PushBuffer(int sizeIndex, int threadIndex) {
+    size_t n = std::max(std::min(TransferLength(sizeIndex),
+                                 MigratableLength(sizeIndex, threadIndex)),
+                        (size_t)1);
+    ChunkArrayContainer *bufs = nullptr;
+    size_t k =
+        _stacks[threadIndex][sizeIndex].Container().PopMidBuffers(n, bufs);
+    if (k == 0) return 0;
+    chunkPushList(bufs, threadIndex, sizeIndex);
+    AddBufferMemoryUsage(threadIndex, -(int64_t)k * BufferBytes(sizeIndex));
+    return k;
+  }
+  // NOTE: move a full container from the local stack of another thread
+  // NOTE: victims are the threads which publish the most stealable containers
+  // NOTE: (at most _stealVictimMaxN threads are tried)
+  bool StealBuffer(int sizeIndex, int threadIndex) {
+    for (int64_t k = 0; k < _stealVictimMaxN; k++) {
+      int victimIndex = -1;
+      uint32_t maxHint = 0;
+      // NOTE: rotate the start position to spread victims
+      int offset = threadIndex + 1 + k;
+      for (int j = 0; j < (int)N; j++) {
+        int index = (offset + j) % N;
+        if (index == threadIndex) continue;
+        uint32_t hint = _stacks[index][sizeIndex].Container().StealHint();
+        if (hint > maxHint) victimIndex = index, maxHint = hint;
+      }
+      if (victimIndex == -1) return false;
+
+      auto buf = _stacks[victimIndex][sizeIndex].Container().StealMidBuffer();
+      if (buf == nullptr) continue;
+      _statuses[victimIndex].StolenBufferMemoryUsage() +=
+          BufferBytes(sizeIndex);
+      _stacks[threadIndex][sizeIndex].Container().PushMidBuffer(buf);
+      AddBufferMemoryUsage(threadIndex, BufferBytes(sizeIndex));
+      return true;
+    }
+    return false;
+  }
+  // NOTE: release empty containers above the top ones of the thread
+  // NOTE: return # of released bytes
+  size_t TrimThreadContainers(int threadIndex) {
+    size_t n = 0;
+    for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++)
+      n += _stacks[threadIndex][i].Container().TrimSpare();
+    return n * MetadataPool::BlockSize;
+  }
+  // NOTE: release empty containers of all stacks to metadataPool and
+  // NOTE: physical pages of free containers to the OS
+  // NOTE: return # of bytes released to the OS
+  size_t TrimContainers() {
+    for (int j = 0; j < (int)N; j++) TrimThreadContainers(j);
+    for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT * LOCK_PARTITIONS_NUM; i++) {
+      SCOPED_LATENCY_LOCK(_chunkStackMtx[i], LatencyChunkStackLock);
+      _cts[i].TrimSpare();
+    }
+    return metadataPool.Trim();
+  }
+  // NOTE: larger requests fail with ENOMEM
+  static const size_t MaxChunkSize = (size_t)1 << 46;
+
+  // NOTE: trim levels (cumulative)
+  // NOTE: 0: release empty containers (metadata)
+  // NOTE: 1: release free chunks in the global stacks to the OS
+  // NOTE: 2: flush the local stack of the caller and stealable containers of
+  // NOTE:    other threads to the global stacks before level 1
+  enum { TrimLevelMetadata = 0, TrimLevelGlobal = 1, TrimLevelAll = 2 };
+  // NOTE: return # of bytes released to the OS
+  size_t Trim(int level, int threadIndex) {
+    size_t size = 0;
+    if (level >= TrimLevelAll) FlushPerCpuCache(), FlushInboxes(threadIndex);
+    if (level >= TrimLevelGlobal) {
+      for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++) {
+        int sizeIndex = i;
+        if (level >= TrimLevelAll) FlushBuffers(sizeIndex, threadIndex);
+        size += ReleaseFreeChunks(sizeIndex, threadIndex,
+                                  level >= TrimLevelAll);
+      }
+    }
+    size += TrimContainers();
+    return size;
+  }
+  // NOTE: move free chunks of the local stacks of the thread to the global
+  // NOTE: stacks (reserved chunks are kept)
+  // NOTE: return # of moved bytes
+  size_t FlushThreadCache(int threadIndex) {
+    size_t bytes = 0;
+    for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++)
+      bytes += FlushThreadClass(i, threadIndex);
+    return bytes;
+  }
+  __attribute__((noinline)) size_t FlushThreadClass(int sizeIndex,
+                                                    int threadIndex) {
+    auto &ct = _stacks[threadIndex][sizeIndex].Container();
+    size_t nReserved =
+        _bufferStatuses[threadIndex][sizeIndex].NReservedChunk();
+    size_t size = indexToSizeWithHash(sizeIndex);
+    size_t n = 0;
+    size_t k;
+    while (MigratableLength(sizeIndex, threadIndex) > 0 &&
+           (k = PushBuffer(sizeIndex, threadIndex)) > 0)
+      n += k * ContainerN(sizeIndex);
+    // NOTE: loose chunks of the top containers
+    const size_t bufN = 256;
+    Chunk *chunks[bufN];
+    while (ct.Size() > nReserved) {
+      size_t k = ct.PopTopN(chunks, std::min(bufN, ct.Size() - nReserved));
+      if (k == 0) break;
+      PushGlobalChunks(sizeIndex, chunks, k);
+      AddBufferMemoryUsage(threadIndex, -(int64_t)(k * size));
+      n += k;
+    }
+    return n * size;
+  }
+  // NOTE: move stealable containers of all threads to the global stack
+  void FlushBuffers(int sizeIndex, int threadIndex) {
+    while (MigratableLength(sizeIndex, threadIndex) > 0)
+      PushBuffer(sizeIndex, threadIndex);
+    for (int j = 0; j < (int)N; j++) {
+      if (j == threadIndex) continue;
+      ChunkArrayContainer *buf;
+      while ((buf = _stacks[j][sizeIndex].Container().StealMidBuffer()) !=
+             nullptr) {
+        _statuses[j].StolenBufferMemoryUsage() += BufferBytes(sizeIndex);
         chunkPush(buf, threadIndex, sizeIndex);
       }
     }
+  }
+  // NOTE: unmap pages which are covered only by free chunks of the global
+  // NOTE: stack (including loose chunks of the per-CPU cache) and the
+  // NOTE: overflow list (and the local stack of the caller if
+  // NOTE: localFlag)
+  // NOTE: chunks overlapping unmapped pages are dropped (they are never used
+  // NOTE: again), the rest are put back
+  // NOTE: return # of unmapped bytes
+  size_t ReleaseFreeChunks(int sizeIndex, int threadIndex, bool localFlag) {
+    // NOTE: (bottom) ... <-> bufs (top) (linked by Pre)
+    ChunkArrayContainer *bufs = nullptr;
+    size_t nBuf = 0;
+    size_t nGlobal = 0;
+    for (int i = 0; i < LOCK_PARTITIONS_NUM; i++) {
+      int index = sizeIndex * LOCK_PARTITIONS_NUM + i;
+      SCOPED_LATENCY_LOCK(_chunkStackMtx[index], LatencyChunkStackLock);
+      ChunkArrayContainer *buf;
+      while ((buf = _cts[index].PopMidBuffer()) != nullptr) {
+        buf->Pre() = bufs;
+        bufs = buf;
+        nBuf++;
+      }
+      nGlobal += _cts[index].Size();
+    }
+    auto &ct = _stacks[threadIndex][sizeIndex].Container();
+    size_t nReserved =
+        _bufferStatuses[threadIndex][sizeIndex].NReservedChunk();
+    size_t nLocal =
+        localFlag && ct.Size() > nReserved ? ct.Size() - nReserved : 0;
+    // NOTE: the link of the overflow list is in the body
+    void *overflow = _overflowChunks[sizeIndex].PopAll();
+    size_t nOverflow = 0;
+    for (void *p = overflow; p != nullptr; p = TaggedFreeList::Next(p))
+      nOverflow++;
+    size_t containerN = ContainerN(sizeIndex);
+    size_t n = nBuf * containerN + nGlobal + nLocal + nOverflow;
+    if (n == 0) return 0;
 
-    bool ret = _stacks[threadIndex][sizeIndex].Push(chunk);
-    eassert(ret, "CANNOT free chunk to local stack:size=%d",
-            (int)_stacks[threadIndex][sizeIndex].Size());
-    return ret;
+    size_t size = indexToSizeWithHash(sizeIndex);
+    size_t unitSize = Chunk::UnitSize(size);
+    size_t workSize = ALIGN(sizeof(Chunk *) * n, PAGE_SIZE);
+    Chunk **chunks = (Chunk **)directMmapWrapper(workSize, false);
+    // NOTE: out of memory: release a part of chunks with the static buffer
+    bool emergencyFlag = chunks == nullptr;
+    if (emergencyFlag) {
+      _pthread_mutex_lock(&_emergencyMtx);
+      chunks = _emergencyChunks;
+      n = EmergencyChunkN;
+    }
+
+    size_t nChunk = 0;
+    while (bufs != nullptr && nChunk + containerN <= n) {
+      ChunkArrayContainer *buf = bufs;
+      bufs = buf->Pre();
+      memcpy(chunks + nChunk, buf->Buffer(), sizeof(Chunk *) * containerN);
+      nChunk += containerN;
+      ChunkArrayContainer::DeleteList(buf);
+    }
+    // NOTE: the rest (emergency) go back to the global stack
+    while (bufs != nullptr) {
+      ChunkArrayContainer *buf = bufs;
+      bufs = buf->Pre();
+      buf->Pre() = buf->Next() = nullptr;
+      chunkPush(buf, threadIndex, sizeIndex);
+    }
+    // NOTE: loose chunks may be taken by others in the meantime
+    for (int i = 0; i < LOCK_PARTITIONS_NUM && nChunk < n; i++) {
+      int index = sizeIndex * LOCK_PARTITIONS_NUM + i;
+      SCOPED_LATENCY_LOCK(_chunkStackMtx[index], LatencyChunkStackLock);
+      nChunk += _cts[index].PopTopN(chunks + nChunk,
+                                    std::min(nGlobal, n - nChunk));
+    }
+    nLocal = std::min(nLocal, n - nChunk);
+    if (nLocal > 0) {
+      nLocal = ct.PopTopN(chunks + nChunk, nLocal);
+      nChunk += nLocal;
+      AddBufferMemoryUsage(threadIndex, -(int64_t)(nLocal * size));
+    }
+    while (overflow != nullptr) {
+      void *p = overflow;
+      overflow = TaggedFreeList::Next(p);
+      if (nChunk == n) {
+        _overflowChunks[sizeIndex].Push(p);
+        continue;
+      }
+      chunks[nChunk++] = (Chunk *)((uintptr_t)p - sizeof(Chunk));
+    }
+    std::sort(chunks, chunks + nChunk);
+
+    // NOTE: find runs of adjacent chunks
+    size_t releasedSize = 0;
+    size_t nKept = 0;
+    for (size_t i = 0; i < nChunk;) {
+      size_t j = i + 1;
+      while (j < nChunk &&
+             (uintptr_t)chunks[j] == (uintptr_t)chunks[j - 1] + unitSize)
+        j++;
+      uintptr_t begin = ALIGN((uintptr_t)chunks[i], PAGE_SIZE);
+      uintptr_t end =
+          ((uintptr_t)chunks[j - 1] + unitSize) / PAGE_SIZE * PAGE_SIZE;
+      if (end <= begin || munmapWrapper((void *)begin, end - begin) == -1) {
+        begin = end = 0;
+      } else {
+        releasedSize += end - begin;
+        spanRegistry.Add((void *)begin, end - begin, SpanHole, threadIndex);
+      }
+      ReleaseHeapBytes(end - begin, threadIndex);
+      for (size_t k = i; k < j; k++) {
+        uintptr_t p = (uintptr_t)chunks[k];
+        if (p + unitSize <= begin || end <= p) chunks[nKept++] = chunks[k];
+      }
+      i = j;
+    }
+
+    // NOTE: full containers to the global stack, the rest to the local stack
+    // NOTE: (containers are reused through metadataPool)
+    size_t index = 0;
+    while (nKept - index >= containerN) {
+      ChunkArrayContainer *buf = ChunkArrayContainer::New();
+      if (buf == nullptr) break;
+      memcpy(buf->Buffer(), chunks + index, sizeof(Chunk *) * containerN);
+      index += containerN;
+      chunkPush(buf, threadIndex, sizeIndex);
+    }
+    size_t nRest = ct.PushTopN(chunks + index, nKept - index);
+    AddBufferMemoryUsage(threadIndex, nRest * size);
+    for (index += nRest; index < nKept; index++)
+      _overflowChunks[sizeIndex].Push(chunks[index]->PtrWithoutOffset());
+
+    if (emergencyFlag)
+      pthread_mutex_unlock(&_emergencyMtx);
+    else
+      munmapWrapper(chunks, workSize);
+    return releasedSize;
+  }
+  // NOTE: reserved containers (mc_reserve) are not stolen
+  void UpdateReservedLength(int sizeIndex, int threadIndex) {
+    size_t nReserved =
+        _bufferStatuses[threadIndex][sizeIndex].NReservedChunk();
+    _stacks[threadIndex][sizeIndex].Container().SetReservedLength(
+        (nReserved + ContainerN(sizeIndex) - 1) / ContainerN(sizeIndex));
+  }
+  // NOTE: bytes of chunks of a full container
+  int64_t BufferBytes(int sizeIndex) {
+    return (int64_t)ContainerN(sizeIndex) * indexToSizeWithHash(sizeIndex);
+  }
+  inline void AddBufferMemoryUsage(int threadIndex, int64_t bytes) {
+    _statuses[threadIndex].CurrentBufferMemoryUsage() += bytes;
+  }
+  // NOTE: internal fragmentation statistics (FRAG_STATISTIC_FLAG)
+  // NOTE: spilled chunks are not recorded
+  inline void FragRecordMalloc(Chunk *chunk, size_t size, int threadIndex) {
+    if (!FRAG_STATISTIC_FLAG ||
+        (int)chunk->SizeIndex() == SpillTier::SpillSizeIndex)
+      return;
+    chunk->SetRequestedSize(size);
+    fragRecord(chunk, threadIndex, 1);
+    _statuses[threadIndex].CurrentAppUsedMemoryUsage() += size;
+    _statuses[threadIndex].CurrentUsedMemoryUsage() += chunk->Size();
+  }
+  inline void FragRecordFree(Chunk *chunk, int threadIndex) {
+    if (!FRAG_STATISTIC_FLAG ||
+        (int)chunk->SizeIndex() == SpillTier::SpillSizeIndex)
+      return;
+    fragRecord(chunk, threadIndex, -1);
+    _statuses[threadIndex].CurrentAppUsedMemoryUsage() -=
+        chunk->RequestedSize();
+    _statuses[threadIndex].CurrentUsedMemoryUsage() -= chunk->Size();
+  }
+  // NOTE: per-CPU cache (MCMALLOC_PERCPU)
+  // NOTE: slabs exchange loose chunks with the top container of the global
+  // NOTE: stack by halves of the capacity
+  // NOTE: capacity of a slab (0: the class is not cached per CPU)
+  size_t PerCpuCapacity(size_t size) {
+    size_t n = _perCpuClassBytes / size;
+    return n < 2 ? 0 : std::min(n, (size_t)PerCpuCache::MaxCapacity);
+  }
+  Chunk *MallocChunkPerCpu(int sizeIndex) {
+    Chunk *chunk = (Chunk *)_perCpuCache.Pop(sizeIndex);
+    if (LIKELY(chunk != nullptr)) return chunk;
+    return RefillPerCpu(sizeIndex);
+  }
+  // NOTE: return false if the chunk should go to the local stack
+  bool FreeChunkPerCpu(Chunk *chunk, int sizeIndex, size_t size) {
+    size_t capacity = PerCpuCapacity(size);
+    if (capacity == 0) return false;
+    if (LIKELY(_perCpuCache.Push(sizeIndex, chunk, capacity))) return true;
+    DrainPerCpu(chunk, sizeIndex, capacity);
+    return true;
+  }
+  // NOTE: return nullptr if the global stack is empty (the per-thread path
+  // NOTE: is used for this call)
+  __attribute__((noinline)) Chunk *RefillPerCpu(int sizeIndex) {
+    size_t capacity = PerCpuCapacity(indexToSizeWithHash(sizeIndex));
+    if (capacity == 0) return nullptr;
+    Chunk *chunks[PerCpuCache::MaxCapacity];
+    size_t n = PopGlobalChunks(sizeIndex, chunks, capacity / 2 + 1);
+    if (n == 0) return nullptr;
+    size_t k = 1;
+    while (k < n && _perCpuCache.Push(sizeIndex, chunks[k], capacity)) k++;
+    // NOTE: the thread has migrated and the slab of the new CPU is full
+    if (k < n) PushGlobalChunks(sizeIndex, chunks + k, n - k);
+    return chunks[0];
+  }
+  __attribute__((noinline)) void DrainPerCpu(Chunk *chunk, int sizeIndex,
+                                             size_t capacity) {
+    Chunk *chunks[PerCpuCache::MaxCapacity];
+    size_t n = _perCpuCache.PopN(sizeIndex, (void **)chunks, capacity / 2);
+    chunks[n++] = chunk;
+    PushGlobalChunks(sizeIndex, chunks, n);
+  }
+  // NOTE: slabs of the other CPUs are not flushed (a slab can be accessed
+  // NOTE: only by threads running on the CPU)
+  void FlushPerCpuCache() {
+    if (!_perCpuCache.IsEnabled()) return;
+    Chunk *chunks[PerCpuCache::MaxCapacity];
+    for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++) {
+      int sizeIndex = i;
+      size_t n;
+      while ((n = _perCpuCache.PopN(sizeIndex, (void **)chunks,
+                                    PerCpuCache::MaxCapacity)) > 0)
+        PushGlobalChunks(sizeIndex, chunks, n);
+    }
+  }
+  size_t PopGlobalChunks(int sizeIndex, Chunk **chunks, size_t n) {
+    int index = sizeIndex * LOCK_PARTITIONS_NUM;
+    SCOPED_LATENCY_LOCK(_chunkStackMtx[index], LatencyChunkStackLock);
+    return _cts[index].PopTopN(chunks, n);
+  }
+  void PushGlobalChunks(int sizeIndex, Chunk **chunks, size_t n) {
+    int index = sizeIndex * LOCK_PARTITIONS_NUM;
+    size_t k;
+    {
+      SCOPED_LATENCY_LOCK(_chunkStackMtx[index], LatencyChunkStackLock);
+      k = _cts[index].PushTopN(chunks, n);
+    }
+    for (size_t i = k; i < n; i++)
+      _overflowChunks[sizeIndex].Push(chunks[i]->PtrWithoutOffset());
+  }
+  // NOTE: asynchronous refill (MCMALLOC_ASYNC_REFILL)
+  // NOTE: when a local stack falls below the low watermark in the slow path,
+  // NOTE: the owner requests a refill, and the refill thread publishes a
+  // NOTE: container of ready chunks (from the global stack or carved) to the
+  // NOTE: inbox of the (thread, class), which the owner takes with one atomic
+  // NOTE: exchange
+  // NOTE: an inbox is (# of chunks << 48 | container)
+  static const int InboxCountShift = 48;
+  bool IsAsyncRefillEnabled() { return _asyncRefillFlag; }
+  // NOTE: # of chunks of a refill (it is also the low watermark)
+  // NOTE: the slow path runs when the top container changes, so the request
+  // NOTE: is made when the last container becomes the top one (or the stack
+  // NOTE: runs out for large classes)
+  size_t AsyncRefillN(int sizeIndex) {
+    size_t unitSize = Chunk::UnitSize(indexToSizeWithHash(sizeIndex));
+    size_t n = _asyncRefillBytes / unitSize;
+    return std::max(std::min(n, ContainerN(sizeIndex)), (size_t)1);
+  }
+  void CheckLowWatermark(int sizeIndex, int threadIndex) {
+    if (_stacks[threadIndex][sizeIndex].Size() >= AsyncRefillN(sizeIndex))
+      return;
+    if (_inboxes[threadIndex][sizeIndex].load(std::memory_order_relaxed) != 0)
+      return;
+    auto &request = _refillRequests[threadIndex][sizeIndex];
+    if (request.load(std::memory_order_relaxed)) return;
+    request.store(true, std::memory_order_relaxed);
+    futexWake(_refillSeq);
+  }
+  Chunk *MallocChunkFromInbox(int sizeIndex, int threadIndex) {
+    auto &inbox = _inboxes[threadIndex][sizeIndex];
+    if (LIKELY(inbox.load(std::memory_order_relaxed) == 0)) return nullptr;
+    uintptr_t v = inbox.exchange(0, std::memory_order_acquire);
+    if (v == 0) return nullptr;
+    ChunkArrayContainer *buf =
+        (ChunkArrayContainer *)(v & (((uintptr_t)1 << InboxCountShift) - 1));
+    size_t n = v >> InboxCountShift;
+    auto &ct = _stacks[threadIndex][sizeIndex].Container();
+    if (n == ContainerN(sizeIndex)) {
+      ct.PushMidBuffer(buf);
+    } else {
+      size_t k = ct.PushTopN(buf->Buffer(), n);
+      if (UNLIKELY(k < n))
+        PushChunksSlow(buf->Buffer() + k, n - k, sizeIndex, threadIndex);
+      n = k;
+      ChunkArrayContainer::DeleteList(buf);
+    }
+    AddBufferMemoryUsage(threadIndex, n * indexToSizeWithHash(sizeIndex));
+    return MallocChunkFromLocal(sizeIndex, threadIndex);
+  }
+  // NOTE: the body of the refill thread (threadIndex is its own index)
+  void AsyncRefillLoop(int threadIndex) {
+    while (true) {
+      uint32_t seq = _refillSeq.load(std::memory_order_acquire);
+      for (int j = 0; j < (int)N; j++) {
+        for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++) {
+          auto &request = _refillRequests[j][i];
+          if (!request.load(std::memory_order_relaxed)) continue;
+          if (_inboxes[j][i].load(std::memory_order_relaxed) == 0) {
+            uintptr_t v = PrepareRefill(i, threadIndex);
+            // NOTE: out of memory: the owner carves (or fails) in line
+            if (v != 0) _inboxes[j][i].store(v, std::memory_order_release);
+          }
+          request.store(false, std::memory_order_relaxed);
+        }
+      }
+      // NOTE: the timeout is a safety net for lost wake-ups
+      futexWait(_refillSeq, seq, 1000);
+    }
+  }
+  // NOTE: 1.a full container of the global stack 2.carve new chunks
+  // NOTE: return an inbox value (0 on failure)
+  uintptr_t PrepareRefill(int sizeIndex, int threadIndex) {
+    ChunkArrayContainer *buf = chunkPop(threadIndex, sizeIndex);
+    if (buf != nullptr)
+      return (uintptr_t)ContainerN(sizeIndex) << InboxCountShift |
+             (uintptr_t)buf;
+    buf = ChunkArrayContainer::New();
+    if (buf == nullptr) return 0;
+    size_t n = AsyncRefillN(sizeIndex);
+    size_t size = indexToSizeWithHash(sizeIndex);
+    size_t unitSize = Chunk::UnitSize(size);
+    size_t mmapSize = ALIGN(unitSize * n, PAGE_SIZE);
+    void *ptr = nullptr;
+    if (AcquireHeapBytes(mmapSize, threadIndex)) {
+      ptr = batchMmapWrapper(mmapSize, threadIndex);
+      if (ptr == nullptr) ReleaseHeapBytes(mmapSize, threadIndex);
+    }
+    if (ptr == nullptr) {
+      ChunkArrayContainer::DeleteList(buf);
+      return 0;
+    }
+    spanRegistry.Add(ptr, unitSize * n, sizeIndex, threadIndex);
+    // NOTE: same order as CarveChunks (the lowest address on the top)
+    for (size_t i = 0; i < n; i++) {
+      void *chunkp = (void *)((uintptr_t)ptr + unitSize * (n - 1 - i));
+      buf->At(i) = new (chunkp) Chunk(size, sizeIndex);
+    }
+    _bufferStatuses[threadIndex][sizeIndex].NCarvedChunkTotal() += n;
+    return (uintptr_t)n << InboxCountShift | (uintptr_t)buf;
+  }
+  // NOTE: move chunks of all inboxes to the global stacks
+  void FlushInboxes(int threadIndex) {
+    if (!_asyncRefillFlag) return;
+    for (int j = 0; j < (int)N; j++) {
+      for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++) {
+        if (_inboxes[j][i].load(std::memory_order_relaxed) == 0) continue;
+        uintptr_t v = _inboxes[j][i].exchange(0, std::memory_order_acquire);
+        if (v == 0) continue;
+        ChunkArrayContainer *buf = (ChunkArrayContainer *)(
+            v & (((uintptr_t)1 << InboxCountShift) - 1));
+        size_t n = v >> InboxCountShift;
+        if (n == ContainerN(i)) {
+          chunkPush(buf, threadIndex, i);
+          continue;
+        }
+        PushGlobalChunks(i, buf->Buffer(), n);
+        ChunkArrayContainer::DeleteList(buf);
+      }
+    }
   }
   // void FreeChunkBuffer(int sizeIndex, int threadIndex) { return; }
   Chunk *MallocChunkFromLocal(int sizeIndex, int threadIndex) {
     Chunk *chunk = _stacks[threadIndex][sizeIndex].Pop();
     if (UNLIKELY(chunk == nullptr)) return nullptr;
+    AddBufferMemoryUsage(threadIndex, -(int64_t)chunk->Size());
     return chunk;
   }
   Chunk *MallocChunkFromOthers(int sizeIndex, int threadIndex) {
-    auto buf = chunkPop(threadIndex, sizeIndex);
-    if (buf != nullptr) {
-      auto &ct = _stacks[threadIndex][sizeIndex].Container();
-      ct.PushMidBuffer(buf);
+    LatencyScope latencyScope(LatencyMallocOthers);
+    if (PullBuffer(sizeIndex, threadIndex) ||
+        StealBuffer(sizeIndex, threadIndex))
       return MallocChunkFromLocal(sizeIndex, threadIndex);
+    return PopOverflowChunk(sizeIndex);
+  }
+  // NOTE: carve n chunks from ptr and push them to the local stack
+  // NOTE: [ptr, mapEnd) is mapped for this call (acquired by
+  // NOTE: AcquireHeapBytes), and the chunks are carved from ptr
+  // NOTE: return # of carved chunks
+  // NOTE: if no container can be allocated, the pages of the rest are
+  // NOTE: unmapped and released from the heap limit
+  size_t CarveChunks(void *ptr, size_t n, size_t size, int sizeIndex,
+                     int threadIndex, uintptr_t mapEnd) {
+    size_t unitSize = Chunk::UnitSize(size);
+    spanRegistry.Add(ptr, unitSize * n, sizeIndex, threadIndex);
+    size_t nCarved = n;
+    // NOTE: stack
+    for (size_t i = 0; i < n; i++) {
+      void *chunkp = (void *)((uintptr_t)ptr + unitSize * (n - 1 - i));
+      Chunk *chunk = new (chunkp) Chunk(size, sizeIndex);
+      chunk->SignatureAssert();
+      if (UNLIKELY(!_stacks[threadIndex][sizeIndex].Push(chunk))) {
+        nCarved = i;
+        break;
+      }
     }
-    return nullptr;
+    if (UNLIKELY(nCarved < n)) {
+      // NOTE: the carved chunks are the highest ones
+      uintptr_t begin = (uintptr_t)ptr;
+      uintptr_t usedBegin = begin + unitSize * (n - nCarved);
+      uintptr_t usedEnd = begin + unitSize * n;
+      if (nCarved == 0) {
+        ReleaseUncarved(begin, mapEnd, threadIndex);
+      } else {
+        ReleaseUncarved(begin, usedBegin, threadIndex);
+        ReleaseUncarved(usedEnd, mapEnd, threadIndex);
+      }
+    }
+    _bufferStatuses[threadIndex][sizeIndex].NCarvedChunkTotal() += nCarved;
+    AddBufferMemoryUsage(threadIndex, nCarved * size);
+    return nCarved;
   }
-  Chunk *MallocChunkMmap(int sizeIndex, int threadIndex, size_t _size) {
+  // NOTE: unmap the whole pages of [begin, end)
+  void ReleaseUncarved(uintptr_t begin, uintptr_t end, int threadIndex) {
+    begin = ALIGN(begin, PAGE_SIZE);
+    end = end / PAGE_SIZE * PAGE_SIZE;
+    if (end <= begin) return;
+    int ret = munmapWrapper((void *)begin, end - begin);
+    eassert(ret != -1, "munmap result is -1: errno=%d", errno);
+    spanRegistry.Add((void *)begin, end - begin, SpanHole, threadIndex);
+    ReleaseHeapBytes(end - begin, threadIndex);
+  }
+  // NOTE: # of chunks carved by a refill from mmap (a miss of all stacks)
+  // NOTE: the thread counts its refills (Status::RefillClock), and the
+  // NOTE: interval since the last refill of the class is its miss rate:
+  // NOTE: 1.<= RefillHotN: the class consumes refills quickly (x2)
+  // NOTE: 2.> RefillHalfLifeN: the class is quiet (halved per RefillHalfLifeN)
+  // NOTE: 3.otherwise: kept
+  // NOTE: bounded by [RefillMinBytes, _refillMaxBytes] / unitSize (>= 1), so
+  // NOTE: the first refill of a large class carves 1 chunk
+  static const int64_t RefillHotN = 4;
+  static const int64_t RefillHalfLifeN = 16;
+  static const size_t RefillMinBytes = 16 << 10;
+  size_t RefillN(int sizeIndex, size_t unitSize, int threadIndex) {
+    auto &bs = _bufferStatuses[threadIndex][sizeIndex];
+    int64_t clock = ++_statuses[threadIndex].RefillClock();
+    int64_t interval = clock - bs.LastRefillClock();
+    bs.LastRefillClock() = clock;
+    size_t minN = std::max(RefillMinBytes / unitSize, (size_t)1);
+    size_t maxN =
+        std::max((size_t)std::max(_refillMaxBytes, (int64_t)0) / unitSize,
+                 minN);
+    size_t n = bs.RefillN();
+    if (n == 0)
+      n = minN;
+    else if (interval <= RefillHotN)
+      n *= 2;
+    else if (interval > RefillHalfLifeN)
+      n >>= std::min(interval / RefillHalfLifeN, (int64_t)63);
+    n = std::min(std::max(n, minN), maxN);
+    bs.RefillN() = n;
+    return n;
+  }
+  // NOTE: carve new chunks to the local stack
+  // NOTE: return sizeIndex of new chunks (it may differ from the given one
+  // NOTE: because a hash class can be learned here)
+  // NOTE: on failure (mmap or heap limit)
+  // NOTE: 1.retry with a smaller batch 2.reclaim free memory (Trim)
+  // NOTE: 3.return -1 with errno = ENOMEM
+  int RefillFromMmap(size_t _size, int threadIndex) {
     // NOTE: _size means actual required size
     // NOTE: size means minimam powers of 2 number more than _size
     size_t size;
-    sizeIndex = sizeToIndexWithHash(_size, true);
+    int sizeIndex = sizeToIndexWithHash(_size, true);
     size = indexToSizeWithHash(sizeIndex);
 
     size_t unitSize = Chunk::UnitSize(size);
-    size_t n = sizeIndexToN(sizeToIndex(size));
+    size_t n = RefillN(sizeIndex, unitSize, threadIndex);
 
-    size_t mmapSize = ALIGN(unitSize * n, PAGE_SIZE);
-    void *ptr = batchMmapWrapper(mmapSize);
-    // NOTE: stack
-    for (size_t i = 0; i < n; i++) {
-      void *chunkp = (void *)((uintptr_t)ptr + unitSize * (n - 1 - i));
-      Chunk *chunk = new (chunkp) Chunk(size, sizeIndex);
-      chunk->SignatureAssert();
-      _stacks[threadIndex][sizeIndex].Push(chunk);
+    bool reclaimedFlag = false;
+    while (true) {
+      size_t mmapSize = ALIGN(unitSize * n, PAGE_SIZE);
+      void *ptr = nullptr;
+      if (AcquireHeapBytes(mmapSize, threadIndex)) {
+        ptr = batchMmapWrapper(mmapSize, threadIndex);
+        if (ptr == nullptr) ReleaseHeapBytes(mmapSize, threadIndex);
+      }
+      if (LIKELY(ptr != nullptr)) {
+        // NOTE: no container: the mapping has been released
+        if (CarveChunks(ptr, n, size, sizeIndex, threadIndex,
+                        (uintptr_t)ptr + mmapSize) == 0)
+          break;
+        return sizeIndex;
+      }
+      if (n > 1) {
+        n /= 2;
+        continue;
+      }
+      if (reclaimedFlag) break;
+      reclaimedFlag = true;
+      Trim(TrimLevelAll, threadIndex);
+      // NOTE: free chunks of this class may be collected by Trim
+      if (!_stacks[threadIndex][sizeIndex].IsEmpty() ||
+          PullBuffer(sizeIndex, threadIndex))
+        return sizeIndex;
     }
-
-    Chunk *chunk = MallocChunk(size, threadIndex);
-    if (UNLIKELY(chunk == nullptr)) return nullptr;
-    return chunk;
+    errno = ENOMEM;
+    return -1;
+  }
+  Chunk *MallocChunkMmap(int sizeIndex, int threadIndex, size_t _size) {
+    LatencyScope latencyScope(LatencyMallocMmap);
+    sizeIndex = RefillFromMmap(_size, threadIndex);
+    if (UNLIKELY(sizeIndex < 0)) return nullptr;
+    return MallocChunkFromLocal(sizeIndex, threadIndex);
+  }
+  // NOTE: whole classes are spilled, so that a cached anonymous chunk of
+  // NOTE: the class is never returned for a spilled size by the fast path
+  bool IsSpillSize(size_t size) {
+    int64_t thresholdBytes = spillTier.ThresholdBytes();
+    if (LIKELY(thresholdBytes <= 0)) return false;
+    if (size > MaxChunkSize) return true;
+    return indexToSizeWithHash(sizeToIndexWithHashFast(size)) >=
+           (size_t)thresholdBytes;
+  }
+  // NOTE: return nullptr with errno on failure
+  Chunk *MallocChunkSpill(size_t size) {
+    void *ptr = spillTier.Map(sizeof(Chunk) + size);
+    if (ptr == nullptr) return nullptr;
+    size_t length = ALIGN(sizeof(Chunk) + size, PAGE_SIZE);
+    return new (ptr) Chunk(length - sizeof(Chunk), SpillTier::SpillSizeIndex);
+  }
+  // NOTE: allocations tagged by mc_spill_malloc
+  void *MallocSpill(size_t size) {
+    Chunk *chunk = MallocChunkSpill(size);
+    if (chunk == nullptr) return nullptr;
+    return chunk->Ptr();
   }
   Chunk *MallocChunk(size_t size, int threadIndex) {
-    int sizeIndex = sizeToIndexWithHash(size);
+    // NOTE: the anonymous heap is used if the spill tier fails
+    if (UNLIKELY(IsSpillSize(size))) {
+      Chunk *chunk = MallocChunkSpill(size);
+      if (chunk != nullptr) return chunk;
+    }
+    // NOTE: to avoid overflow of the size of a batch
+    if (UNLIKELY(size > MaxChunkSize)) {
+      errno = ENOMEM;
+      return nullptr;
+    }
+    int sizeIndex = sizeToIndexWithHashFast(size);
     _callStat[threadIndex].CallMalloc(size);
 
+    // NOTE: 0.per-CPU cache (if enabled)
     // NOTE: 1.local stack access
-    // NOTE: 2.other queues use
+    // NOTE: 2.other queues use (global stack, then local stacks of others)
     // NOTE: 3.mmap
     Chunk *chunk = nullptr;
     if (LIKELY(
+            (_perCpuCache.IsEnabled() &&
+             (chunk = MallocChunkPerCpu(sizeIndex)) != nullptr) ||
             (chunk = MallocChunkFromLocal(sizeIndex, threadIndex)) != nullptr ||
+            (_asyncRefillFlag &&
+             (chunk = MallocChunkFromInbox(sizeIndex, threadIndex)) !=
+                 nullptr) ||
             (chunk = MallocChunkFromOthers(sizeIndex, threadIndex)) !=
                 nullptr ||
-            (chunk = MallocChunkMmap(sizeIndex, threadIndex, size)) != nullptr))
+            (chunk = MallocChunkMmap(sizeIndex, threadIndex, size)) !=
+                nullptr)) {
+      _bufferStatuses[threadIndex][chunk->SizeIndex()].NUsedChunk()++;
+      if (_asyncRefillFlag) CheckLowWatermark(chunk->SizeIndex(), threadIndex);
       return chunk;
-
-    eassert(false, "CANNOT MALLOC_CHUNK (ALLOCATE MEMORY)");
+    }
+    // NOTE: errno = ENOMEM
     return nullptr;
   }
   bool Free(void *ptr, int threadIndex) {
@@ -173,11 +1031,131 @@ class MCMalloc {
     return true;
   }
 
+  // NOTE: fast path: a hit of the top container of the local stack (or the
+  // NOTE: per-CPU slab)
+  // NOTE: free chunks have no offset (see Chunk::NewFromBodyPtr)
   void *Malloc(size_t size, int threadIndex) {
+    uint64_t latencyBegin = LATENCY_STATISTIC_FLAG ? readTsc() : 0;
+    int sizeIndex = sizeToIndexWithHashFast(size);
+    Chunk *chunk;
+    if (LIKELY(!_perCpuCache.IsEnabled())) {
+      auto &ct = _stacks[threadIndex][sizeIndex].Container();
+      if (UNLIKELY(!ct.PopTopFast(&chunk))) return MallocSlow(size, threadIndex);
+      AddBufferMemoryUsage(threadIndex, -(int64_t)chunk->Size());
+    } else {
+      chunk = (Chunk *)_perCpuCache.Pop(sizeIndex);
+      if (UNLIKELY(chunk == nullptr)) return MallocSlow(size, threadIndex);
+    }
+    _callStat[threadIndex].CallMalloc(size);
+    _bufferStatuses[threadIndex][sizeIndex].NUsedChunk()++;
+    FragRecordMalloc(chunk, size, threadIndex);
+    if (LATENCY_STATISTIC_FLAG)
+      latencyRecord(LatencyMallocLocal, readTsc() - latencyBegin);
+    return chunk->PtrWithoutOffset();
+  }
+  __attribute__((noinline, cold)) void *MallocSlow(size_t size,
+                                                   int threadIndex) {
     Chunk *chunk = MallocChunk(size, threadIndex);
+    if (UNLIKELY(chunk == nullptr)) {
+      errno = ENOMEM;
+      return nullptr;
+    }
+    FragRecordMalloc(chunk, size, threadIndex);
     return chunk->Ptr();
   }
 
+  // NOTE: the size class is resolved once per batch
+  // NOTE: return # of allocated pointers
+  size_t MallocBatch(size_t size, size_t n, void **ptrs, int threadIndex) {
+    // NOTE: the class of a larger size overflows (as in MallocChunk)
+    if (UNLIKELY(size > MaxChunkSize)) {
+      errno = ENOMEM;
+      return 0;
+    }
+    if (UNLIKELY(IsSpillSize(size))) {
+      size_t k = 0;
+      while (k < n && (ptrs[k] = Malloc(size, threadIndex)) != nullptr) k++;
+      return k;
+    }
+    int sizeIndex = sizeToIndexWithHash(size);
+    _callStat[threadIndex].CallMalloc(size, n);
+
+    Chunk **chunks = (Chunk **)ptrs;
+    size_t nAllocated = 0;
+    while (nAllocated < n) {
+      auto &ct = _stacks[threadIndex][sizeIndex].Container();
+      size_t nRest = n - nAllocated;
+      // NOTE: exchange whole containers with the global stack
+      while (nRest > ct.Size() && nRest - ct.Size() >= ct.ArrayMaxSize())
+        if (!PullBuffer(sizeIndex, threadIndex)) break;
+      size_t k = ct.PopTopN(chunks + nAllocated, nRest);
+      if (k > 0) {
+        nAllocated += k;
+        _bufferStatuses[threadIndex][sizeIndex].NUsedChunk() += k;
+        AddBufferMemoryUsage(threadIndex,
+                             -(int64_t)(k * indexToSizeWithHash(sizeIndex)));
+        continue;
+      }
+      if (PullBuffer(sizeIndex, threadIndex) ||
+          StealBuffer(sizeIndex, threadIndex))
+        continue;
+      Chunk *chunk = PopOverflowChunk(sizeIndex);
+      if (chunk != nullptr) {
+        chunks[nAllocated++] = chunk;
+        _bufferStatuses[threadIndex][sizeIndex].NUsedChunk()++;
+        continue;
+      }
+      int ret = RefillFromMmap(size, threadIndex);
+      if (ret < 0) break;
+      sizeIndex = ret;
+    }
+    for (size_t i = 0; i < nAllocated; i++) {
+      FragRecordMalloc(chunks[i], size, threadIndex);
+      ptrs[i] = chunks[i]->Ptr();
+    }
+    return nAllocated;
+  }
+  // NOTE: consecutive pointers of the same size class are pushed at once
+  void FreeBatch(void **ptrs, size_t n, int threadIndex) {
+    const int bufN = 256;
+    Chunk *buf[bufN];
+    int nBuf = 0;
+    int sizeIndex = -1;
+    size_t size = 0;
+
+    auto flush = [&]() {
+      if (nBuf == 0) return;
+      _callStat[threadIndex].CallFree(size, nBuf);
+      bool rotateFlag = _bufferStatuses[threadIndex][sizeIndex].OnFree(nBuf);
+      size_t k = _stacks[threadIndex][sizeIndex].Container().PushTopN(buf, nBuf);
+      if (UNLIKELY(k < (size_t)nBuf))
+        k += PushChunksSlow(buf + k, nBuf - k, sizeIndex, threadIndex);
+      AddBufferMemoryUsage(threadIndex, k * size);
+      MigrateLocalBuffers(size, sizeIndex, threadIndex, rotateFlag);
+      nBuf = 0;
+    };
+    for (size_t i = 0; i < n; i++) {
+      if (ptrs[i] == nullptr) continue;
+      if (UNLIKELY(!ownershipMap.Contains(ptrs[i]))) {
+        foreignFree(ptrs[i]);
+        continue;
+      }
+      Chunk *chunk = Chunk::NewFromBodyPtr(ptrs[i]);
+      if (UNLIKELY((int)chunk->SizeIndex() == SpillTier::SpillSizeIndex)) {
+        FreeChunkMunmap(chunk, threadIndex);
+        continue;
+      }
+      FragRecordFree(chunk, threadIndex);
+      if ((int)chunk->SizeIndex() != sizeIndex || nBuf == bufN) {
+        flush();
+        sizeIndex = chunk->SizeIndex();
+        size = chunk->Size();
+      }
+      buf[nBuf++] = chunk;
+    }
+    flush();
+  }
+
   void *Realloc(void *ptr, size_t size, int threadIndex) {
     if (UNLIKELY(ptr == nullptr)) return Malloc(size, threadIndex);
     if (UNLIKELY(size == 0)) {
@@ -187,11 +1165,18 @@ class MCMalloc {
 
     Chunk *chunk = Chunk::NewFromBodyPtr(ptr);
     size_t preSize = chunk->Size();
-    if (UNLIKELY(size == preSize)) return ptr;
-    // NOTE: shrink
-    if (UNLIKELY(size < preSize)) return ptr;
+    // NOTE: same size or shrink
+    if (UNLIKELY(size <= preSize)) {
+      FragRecordFree(chunk, threadIndex);
+      FragRecordMalloc(chunk, size, threadIndex);
+      return ptr;
+    }
 
-    void *newPtr = Malloc(size, threadIndex);
+    // NOTE: a spilled chunk stays in the spill tier
+    bool spillFlag = (int)chunk->SizeIndex() == SpillTier::SpillSizeIndex;
+    void *newPtr = spillFlag ? MallocSpill(size) : Malloc(size, threadIndex);
+    // NOTE: the old one is kept on failure
+    if (UNLIKELY(newPtr == nullptr)) return nullptr;
     // NOTE: memcpy uses system call or not?
     memcpy(newPtr, ptr, preSize);
     chunk->SignatureAssert();
@@ -204,10 +1189,14 @@ class MCMalloc {
 
   int PosixMemalign(void **memptr, size_t alignment, size_t size,
                     int threadIndex) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+      return EINVAL;
+    if (UNLIKELY(size + alignment < size)) return ENOMEM;
     Chunk *chunk = MallocChunk(size + alignment, threadIndex);
+    if (UNLIKELY(chunk == nullptr)) return ENOMEM;
     chunk->SetAlignment(alignment);
+    FragRecordMalloc(chunk, size, threadIndex);
     *memptr = chunk->Ptr();
-    // TODO: write the code for error case
     return 0;
   }
 
@@ -338,6 +1327,386 @@ class MCMalloc {
             "joinFunc setenv error: errno=%d", errno);
   }
 
+  // NOTE: tunables and counters (mc_ctl)
+  int64_t &ThreadCacheMaxBytes() { return _threadCacheMaxBytes; }
+  int64_t &ClassCacheMinBytes() { return _classCacheMinBytes; }
+  int64_t &StealVictimMaxN() { return _stealVictimMaxN; }
+  int64_t &AsyncRefillBytes() { return _asyncRefillBytes; }
+  int64_t TransferBytes() { return _transferBytes; }
+  int64_t &RefillMaxBytes() { return _refillMaxBytes; }
+  int64_t HeapLimitBytes() { return _heapLimitBytes; }
+  bool IsPerCpuEnabled() { return _perCpuCache.IsEnabled(); }
+  bool &CacheDisabledFlag(int threadIndex) {
+    return _statuses[threadIndex].CacheDisabledFlag();
+  }
+  size_t LocalChunkN(int sizeIndex, int threadIndex) {
+    return _stacks[threadIndex][sizeIndex].Size();
+  }
+  size_t LocalContainerN(int sizeIndex, int threadIndex) {
+    return _stacks[threadIndex][sizeIndex].Container().Length();
+  }
+  size_t GlobalChunkN(int sizeIndex) {
+    size_t n = 0;
+    for (int k = 0; k < LOCK_PARTITIONS_NUM; k++)
+      n += _cts[sizeIndex * LOCK_PARTITIONS_NUM + k].Size();
+    return n;
+  }
+  size_t GlobalContainerN(int sizeIndex) {
+    size_t n = 0;
+    for (int k = 0; k < LOCK_PARTITIONS_NUM; k++)
+      n += _cts[sizeIndex * LOCK_PARTITIONS_NUM + k].Length();
+    return n;
+  }
+  // NOTE: threadIndex == -1: all threads
+  // NOTE: chunks freed by other threads are subtracted from the other ones
+  int64_t AllocatedBytes(int threadIndex) {
+    int64_t bytes = 0;
+    for (int j = 0; j < (int)N; j++) {
+      if (threadIndex != -1 && j != threadIndex) continue;
+      for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++)
+        bytes += _bufferStatuses[j][i].NUsedChunk() * indexToSizeWithHash(i);
+    }
+    return bytes;
+  }
+  int64_t CachedBytes(int threadIndex) {
+    int64_t bytes = 0;
+    for (int j = 0; j < (int)N; j++) {
+      if (threadIndex != -1 && j != threadIndex) continue;
+      for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++)
+        bytes += (int64_t)LocalChunkN(i, j) * indexToSizeWithHash(i);
+    }
+    return bytes;
+  }
+  // NOTE: sum of requested bytes of live chunks (FRAG_STATISTIC_FLAG)
+  int64_t RequestedBytes() {
+    int64_t bytes = 0;
+    for (int j = 0; j < (int)N; j++)
+      bytes += _statuses[j].CurrentAppUsedMemoryUsage();
+    return bytes;
+  }
+  int64_t GlobalBytes() {
+    int64_t bytes = 0;
+    for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++)
+      bytes += (int64_t)GlobalChunkN(i) * indexToSizeWithHash(i);
+    return bytes;
+  }
+
+  // NOTE: resident memory attribution (mc_rss_report)
+  // NOTE: format (tab-separated, -1: not applicable)
+  //   # mcmalloc rss pid=<pid> page=<B> segments=<n> overflow=<0|1>
+  //   category thread class size chunks mapped[B] resident[B]
+  // NOTE: free chunks are attributed to the thread which holds them
+  // NOTE: (thread_cache, inbox) or to none (global, percpu), live chunks
+  // NOTE: (the rest of the carved ones, including the overflow list) to the
+  // NOTE: thread which carved them
+  // NOTE: total = live + free chunks + batch_tail + prefault + metadata
+  // NOTE: unattributed = process - total (arenas, libraries, stacks, ...)
+  int RssReport(int fd) {
+    ResidencyMap map;
+    if (!map.Build()) return ENOMEM;
+    FdPrinter printer(fd);
+    int64_t totalMapped = 0, totalResident = 0;
+    auto row = [&](const char *category, int threadIndex, int sizeIndex,
+                   int64_t chunkN, int64_t mapped, int64_t resident) {
+      size_t size = sizeIndex >= 0 ? indexToSizeWithHash(sizeIndex) : 0;
+      printer.Printf("%s\t%d\t%d\t%llu\t%lld\t%lld\t%lld\n", category,
+                     threadIndex, sizeIndex, (unsigned long long)size,
+                     (long long)chunkN, (long long)mapped,
+                     (long long)resident);
+      totalMapped += mapped;
+      totalResident += resident;
+    };
+    printer.Printf("# mcmalloc rss pid=%d page=%d segments=%llu overflow=%d\n",
+                   (int)getpid(), (int)PAGE_SIZE,
+                   (unsigned long long)map.SegmentN(),
+                   (int)spanRegistry.OverflowFlag());
+    printer.Printf("# category\tthread\tclass\tsize\tchunks\tmapped\t"
+                   "resident\n");
+
+    // NOTE: free chunks
+    int sizeIndex = 0;
+    size_t unitSize = 0;
+    int64_t chunkN = 0, resident = 0;
+    auto visit = [&](Chunk **chunks, size_t n) {
+      for (size_t k = 0; k < n; k++)
+        resident += map.AddFree((uintptr_t)chunks[k], unitSize);
+      chunkN += n;
+    };
+    auto flush = [&](const char *category, int threadIndex) {
+      if (chunkN > 0)
+        row(category, threadIndex, sizeIndex, chunkN, chunkN * unitSize,
+            resident);
+      chunkN = resident = 0;
+    };
+    for (int j = 0; j < (int)N; j++) {
+      for (sizeIndex = 0; sizeIndex < (int)N_SIZE_INDEX_ELEMENT; sizeIndex++) {
+        unitSize = Chunk::UnitSize(indexToSizeWithHash(sizeIndex));
+        if (LocalChunkN(sizeIndex, j) > 0)
+          _stacks[j][sizeIndex].Container().ForEach(visit);
+        flush("thread_cache", j);
+        // NOTE: the owner may take the inbox in the meantime (racy)
+        uintptr_t v = _inboxes[j][sizeIndex].load(std::memory_order_acquire);
+        if (v != 0) {
+          ChunkArrayContainer *buf = (ChunkArrayContainer *)(
+              v & (((uintptr_t)1 << InboxCountShift) - 1));
+          visit(buf->Buffer(), v >> InboxCountShift);
+        }
+        flush("inbox", j);
+      }
+    }
+    for (sizeIndex = 0; sizeIndex < (int)N_SIZE_INDEX_ELEMENT; sizeIndex++) {
+      unitSize = Chunk::UnitSize(indexToSizeWithHash(sizeIndex));
+      for (int k = 0; k < LOCK_PARTITIONS_NUM; k++) {
+        int index = sizeIndex * LOCK_PARTITIONS_NUM + k;
+        SCOPED_LATENCY_LOCK(_chunkStackMtx[index], LatencyChunkStackLock);
+        _cts[index].ForEach(visit);
+      }
+      flush("global", -1);
+      size_t nCpu = _perCpuCache.IsEnabled() ? _perCpuCache.NCpu() : 0;
+      for (size_t cpu = 0; cpu < nCpu; cpu++) {
+        size_t n = std::min(_perCpuCache.Count(cpu, sizeIndex),
+                            PerCpuCache::MaxCapacity);
+        for (size_t k = 0; k < n; k++) {
+          Chunk *chunk = (Chunk *)_perCpuCache.At(cpu, sizeIndex, k);
+          visit(&chunk, 1);
+        }
+      }
+      flush("percpu", -1);
+    }
+
+    // NOTE: live chunks and metadata (by the segments)
+    map.SortByOwner();
+    int64_t metadataMapped = 0, metadataResident = 0;
+    for (size_t k = 0; k < map.SegmentN();) {
+      const ResidencyMap::Segment &first = map.At(k);
+      int64_t mapped = 0;
+      resident = 0;
+      for (; k < map.SegmentN() && map.At(k).sizeIndex == first.sizeIndex &&
+             map.At(k).threadIndex == first.threadIndex;
+           k++) {
+        mapped += map.At(k).length - map.At(k).freeBytes;
+        resident += map.At(k).residentBytes - map.At(k).freeResidentBytes;
+      }
+      if (first.sizeIndex < 0) {
+        metadataMapped += mapped;
+        metadataResident += resident;
+        continue;
+      }
+      if (mapped <= 0) continue;
+      unitSize = Chunk::UnitSize(indexToSizeWithHash(first.sizeIndex));
+      row("live", first.threadIndex, first.sizeIndex, mapped / unitSize,
+          mapped, resident);
+    }
+    row("metadata", -1, -1, 0, metadataMapped, metadataResident);
+
+    // NOTE: unused memory of the batch pools and pre-faulted batches
+    for (int j = 0; j < (int)N; j++) {
+      void *head;
+      size_t size;
+      if (batchMmapTail(j, &head, &size))
+        row("batch_tail", j, -1, 0, size,
+            residentBytes((uintptr_t)head, size));
+    }
+    for (int j = 0; prefaulter.IsEnabled() && j < Prefaulter::MaxSlotN; j++) {
+      void *p = prefaulter.Peek(j);
+      if (p != nullptr)
+        row("prefault", j, -1, 0, prefaulter.BatchBytes(),
+            residentBytes((uintptr_t)p, prefaulter.BatchBytes()));
+    }
+
+    int64_t processResident = processResidentBytes();
+    int64_t unattributed = processResident - totalResident;
+    row("total", -1, -1, 0, totalMapped, totalResident);
+    row("process", -1, -1, 0, 0, processResident);
+    row("unattributed", -1, -1, 0, 0, unattributed);
+    return 0;
+  }
+
+  // NOTE: live statistics (MCMALLOC_STAT_SHM)
+  // NOTE: counters of other threads are read without locks, so a snapshot
+  // NOTE: is not exact, but the owners are never blocked
+  void PublishStats(StatShm &shm) {
+    shm.BeginWrite();
+    StatShmHeader *header = shm.Header();
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header->publishN++;
+    header->timeNs = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    header->mmapN = mmapStat.nMmap.load(std::memory_order_relaxed);
+    header->mmapBytes = mmapStat.mappedBytes.load(std::memory_order_relaxed);
+    header->munmapBytes =
+        mmapStat.unmappedBytes.load(std::memory_order_relaxed);
+    StatShmClass *classes = shm.Classes();
+    for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++) {
+      int sizeIndex = i;
+      int64_t size = indexToSizeWithHash(sizeIndex);
+      int64_t nGlobal = GlobalChunkN(sizeIndex);
+      int64_t nPerCpu = 0;
+      if (_perCpuCache.IsEnabled())
+        for (size_t cpu = 0; cpu < _perCpuCache.NCpu(); cpu++)
+          nPerCpu += _perCpuCache.Count(cpu, sizeIndex);
+      classes[i].size = size;
+      classes[i].globalBytes = nGlobal * size;
+      classes[i].perCpuBytes = nPerCpu * size;
+    }
+    for (int j = 0; j < (int)N; j++) {
+      StatShmThreadClass *threadClasses = shm.ThreadClasses(j);
+      for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++) {
+        int64_t size = classes[i].size;
+        threadClasses[i].inUseBytes =
+            _bufferStatuses[j][i].NUsedChunk() * size;
+        // NOTE: Size() can be inconsistent while the owner is stolen from
+        threadClasses[i].cachedBytes =
+            std::max((int64_t)_stacks[j][i].Size(), (int64_t)0) * size;
+      }
+    }
+    shm.EndWrite();
+  }
+
+  // NOTE: fill the local stack with count chunks ahead of time
+  // NOTE: 1.global stack 2.mmap(MAP_POPULATE)
+  bool Reserve(size_t _size, size_t count, int threadIndex) {
+    // NOTE: the class of a larger size overflows (as in MallocChunk)
+    if (_size > MaxChunkSize) return false;
+    // NOTE: malloc(3) would move to a class learned later, leaving the
+    // NOTE: reserved chunks behind
+    int sizeIndex = sizeToIndexWithHashPinned(_size);
+    size_t size = indexToSizeWithHash(sizeIndex);
+    auto &stack = _stacks[threadIndex][sizeIndex];
+    auto &nReserved = _bufferStatuses[threadIndex][sizeIndex].NReservedChunk();
+
+    while (stack.Size() < count)
+      if (!PullBuffer(sizeIndex, threadIndex)) break;
+    if (stack.Size() < count) {
+      size_t n = count - stack.Size();
+      size_t unitSize = Chunk::UnitSize(size);
+      size_t bytes;
+      if (__builtin_mul_overflow(unitSize, n, &bytes) ||
+          bytes > SIZE_MAX - PAGE_SIZE)
+        return false;
+      size_t mmapSize = ALIGN(bytes, PAGE_SIZE);
+      const bool populateFlag = true;
+      if (!AcquireHeapBytes(mmapSize, threadIndex)) return false;
+      void *ptr = directMmapWrapper(mmapSize, populateFlag);
+      if (ptr == nullptr) {
+        ReleaseHeapBytes(mmapSize, threadIndex);
+        return false;
+      }
+      if (CarveChunks(ptr, n, size, sizeIndex, threadIndex,
+                      (uintptr_t)ptr + mmapSize) < n)
+        return false;
+    }
+    nReserved = std::max(nReserved, (int64_t)count);
+    UpdateReservedLength(sizeIndex, threadIndex);
+    return true;
+  }
+  void ReleaseReserve(size_t _size, int threadIndex) {
+    // NOTE: the class was pinned by Reserve
+    if (_size > MaxChunkSize) return;
+    int sizeIndex = sizeToIndexWithHash(_size);
+    size_t size = indexToSizeWithHash(sizeIndex);
+    _bufferStatuses[threadIndex][sizeIndex].NReservedChunk() = 0;
+    UpdateReservedLength(sizeIndex, threadIndex);
+    // NOTE: migrate surplus over the target at once
+    for (size_t i = MigratableLength(sizeIndex, threadIndex); i > 0; i--) {
+      int64_t cachedBytes =
+          (int64_t)_stacks[threadIndex][sizeIndex].Size() * size;
+      auto &bs = _bufferStatuses[threadIndex][sizeIndex];
+      if (cachedBytes <= std::max(bs.TargetBytes(), _classCacheMinBytes))
+        break;
+      PushBuffer(sizeIndex, threadIndex);
+    }
+  }
+
+  // NOTE: write learned hash classes and the peak # of used chunks of each
+  // NOTE: class
+  // NOTE: peaks of the threads are summed (they may not overlap), and the sum
+  // NOTE: is bounded by # of carved chunks (a thread which only allocates for
+  // NOTE: others never sees its chunks freed)
+  bool ProfileSave(const char *path) {
+    ProfileWriter writer(path);
+    if (!writer.IsOpen()) return false;
+
+    writer.Printf("# mcmalloc profile v1\n");
+    for (int i = 1; i < sizeHashClassN(); i++)
+      writer.Printf("hash %zu\n",
+                    indexToSizeWithHash(N_SIZE_INDEX_ELEMENT_2_POW + i));
+    for (int i = 0; i < (int)N_SIZE_INDEX_ELEMENT; i++) {
+      int sizeIndex = i;
+      int64_t nPeakChunk = 0, nCarvedChunk = 0;
+      for (int j = 0; j < (int)N; j++) {
+        auto &bs = _bufferStatuses[j][sizeIndex];
+        nPeakChunk += std::max(bs.PeakUsedChunk(), (int64_t)0);
+        nCarvedChunk += bs.NCarvedChunkTotal();
+      }
+      nPeakChunk = std::min(nPeakChunk, nCarvedChunk);
+      if (nPeakChunk <= 0) continue;
+      writer.Printf("class %d %zu %lld\n", sizeIndex,
+                    indexToSizeWithHash(sizeIndex), (long long)nPeakChunk);
+    }
+    return true;
+  }
+  // NOTE: restore learned hash classes and pre-carve the pools
+  // NOTE: full containers go to the global stack, the rest to the local stack
+  bool ProfileLoad(const char *path, bool populateFlag, size_t maxBytes,
+                   int threadIndex) {
+    ProfileReader reader(path);
+    if (!reader.IsOpen()) return false;
+
+    char key[16];
+    size_t vals[3];
+    int n;
+    int nHash = 0;
+    size_t totalBytes = 0;
+    while ((n = reader.Next(key, vals, 3)) >= 0) {
+      if (strcmp(key, "hash") == 0 && n == 1) {
+        if (sizeHashRegister(vals[0]) != 0) nHash++;
+        continue;
+      }
+      if (strcmp(key, "class") != 0 || n != 3) continue;
+      // NOTE: learned classes must be restored in the same order
+      int sizeIndex = vals[0];
+      size_t size = vals[1];
+      size_t nChunk = vals[2];
+      if (sizeIndex < 0 || sizeIndex >= (int)N_SIZE_INDEX_ELEMENT) continue;
+      if (indexToSizeWithHash(sizeIndex) != size) continue;
+
+      size_t unitSize = Chunk::UnitSize(size);
+      if (totalBytes >= maxBytes) break;
+      nChunk = std::min(nChunk, (maxBytes - totalBytes) / unitSize);
+      if (nChunk == 0) continue;
+      totalBytes += PrewarmChunks(nChunk, size, sizeIndex, threadIndex,
+                                  populateFlag);
+    }
+    myprintf("# mcmalloc profile loaded: %s (hash=%d, prewarm=%d[KB])\n",
+             path, nHash, (int)(totalBytes >> 10));
+    return true;
+  }
+  size_t PrewarmChunks(size_t nChunk, size_t size, int sizeIndex,
+                       int threadIndex, bool populateFlag) {
+    size_t unitSize = Chunk::UnitSize(size);
+    size_t mmapSize = ALIGN(unitSize * nChunk, PAGE_SIZE);
+    if (!AcquireHeapBytes(mmapSize, threadIndex)) return 0;
+    void *ptr = directMmapWrapper(mmapSize, populateFlag);
+    if (ptr == nullptr) {
+      ReleaseHeapBytes(mmapSize, threadIndex);
+      return 0;
+    }
+    auto &ct = _stacks[threadIndex][sizeIndex].Container();
+    uintptr_t mapEnd = (uintptr_t)ptr + mmapSize;
+    size_t nRest = nChunk;
+    while (nRest > 0) {
+      size_t n = std::min(nRest, ContainerN(sizeIndex));
+      if (CarveChunks(ptr, n, size, sizeIndex, threadIndex, mapEnd) < n)
+        break;
+      ptr = (void *)((uintptr_t)ptr + unitSize * n);
+      nRest -= n;
+      // NOTE: keep the top container on the local stack
+      if (ct.Length() >= 2) PushBuffer(sizeIndex, threadIndex);
+    }
+    return mmapSize;
+  }
+
   bool chunkPush(ChunkArrayContainer *ptr, int threadIndex, int sizeIndex) {
     // NOTE: LOCK_PARTITIONS_NUM==1 version
     // SCOPED_LOCK(_chunkStackMtx[sizeIndex]);
@@ -346,7 +1715,7 @@ class MCMalloc {
 
     int index =
         sizeIndex * LOCK_PARTITIONS_NUM + threadIndex % LOCK_PARTITIONS_NUM;
-    SCOPED_LOCK(_chunkStackMtx[index]);
+    SCOPED_LATENCY_LOCK(_chunkStackMtx[index], LatencyChunkStackLock);
     auto &ct = _cts[index];
     ct.PushMidBuffer(ptr);
     return true;
@@ -359,13 +1728,33 @@ class MCMalloc {
 
     for (int i = 0; i < LOCK_PARTITIONS_NUM; i++) {
       int index = sizeIndex * LOCK_PARTITIONS_NUM + i;
-      SCOPED_LOCK(_chunkStackMtx[index]);
+      SCOPED_LATENCY_LOCK(_chunkStackMtx[index], LatencyChunkStackLock);
       auto &ct = _cts[index];
       auto ptr = ct.PopMidBuffer();
       if (ptr != nullptr) return ptr;
     }
     return nullptr;
   }
+  // NOTE: push a list of full containers (linked by Pre) under one lock
+  void chunkPushList(ChunkArrayContainer *bufs, int threadIndex,
+                     int sizeIndex) {
+    int index =
+        sizeIndex * LOCK_PARTITIONS_NUM + threadIndex % LOCK_PARTITIONS_NUM;
+    SCOPED_LATENCY_LOCK(_chunkStackMtx[index], LatencyChunkStackLock);
+    _cts[index].PushMidBuffers(bufs);
+  }
+  // NOTE: pop at most n full containers into bufs (a list linked by Pre)
+  // NOTE: return # of popped containers
+  size_t chunkPopList(size_t n, ChunkArrayContainer *&bufs, int threadIndex,
+                      int sizeIndex) {
+    size_t k = 0;
+    for (int i = 0; i < LOCK_PARTITIONS_NUM && k < n; i++) {
+      int index = sizeIndex * LOCK_PARTITIONS_NUM + i;
+      SCOPED_LATENCY_LOCK(_chunkStackMtx[index], LatencyChunkStackLock);
+      k += _cts[index].PopMidBuffers(n - k, bufs);
+    }
+    return k;
+  }
 
  private:
   // global stack
@@ -382,5 +1771,45 @@ class MCMalloc {
   CallStat _callStat[N];
   BufferStatus _bufferStatuses[N][N_SIZE_INDEX_ELEMENT];
   Status _statuses[N];
+
+  // NOTE: byte budget of the local stacks of each thread
+  int64_t _threadCacheMaxBytes;
+  // NOTE: lower limit of the adaptive target of each class
+  int64_t _classCacheMinBytes;
+  // NOTE: # of victim threads tried by a stealing step (0: no stealing)
+  int64_t _stealVictimMaxN;
+  // NOTE: InitThread
+  pthread_mutex_t _threadSlotMtx;
+  bool _threadSlotInitFlags[N];
+  // NOTE: MCMALLOC_TRANSFER_BYTES (fixed at startup), ContainerN() and
+  // NOTE: TransferLength()
+  int64_t _transferBytes;
+  size_t _containerNs[N_SIZE_INDEX_ELEMENT];
+  size_t _transferLengths[N_SIZE_INDEX_ELEMENT];
+  // NOTE: MCMALLOC_REFILL_MAX_BYTES (cap of RefillN())
+  int64_t _refillMaxBytes;
+  // NOTE: MCMALLOC_HEAP_LIMIT (0: no limit)
+  int64_t _heapLimitBytes;
+  int64_t _heapCreditUnitBytes;
+  // NOTE: mapped bytes of chunks + credits of threads
+  std::atomic<int64_t> _heapGrantedBytes;
+  // NOTE: # of failures of PushChunksSlow
+  std::atomic<int64_t> _pushFailN;
+  // NOTE: free chunks which cannot be pushed to the stacks (out of memory)
+  TaggedFreeList _overflowChunks[N_SIZE_INDEX_ELEMENT];
+  // NOTE: work area of ReleaseFreeChunks when mmap fails
+  static const size_t EmergencyChunkN = 32 * 1024;
+  pthread_mutex_t _emergencyMtx;
+  Chunk *_emergencyChunks[EmergencyChunkN];
+  // NOTE: MCMALLOC_PERCPU_CLASS_BYTES
+  int64_t _perCpuClassBytes;
+  PerCpuCache _perCpuCache;
+  // NOTE: MCMALLOC_ASYNC_REFILL
+  bool _asyncRefillFlag;
+  int64_t _asyncRefillBytes;
+  // NOTE: incremented by requests (futex)
+  std::atomic<uint32_t> _refillSeq;
+  std::atomic<bool> _refillRequests[N][N_SIZE_INDEX_ELEMENT];
+  std::atomic<uintptr_t> _inboxes[N][N_SIZE_INDEX_ELEMENT];
 };
 }  // namespace mc
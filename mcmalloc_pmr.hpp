@@ -0,0 +1,68 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+// NOTE: std::pmr::memory_resource on top of the arena API (C++17)
+// NOTE: this header can be included by applications (link with -lmcmalloc)
+// e.g.
+//   mc::ArenaResource resource;
+//   std::pmr::vector<int> v(&resource);
+//   ...
+//   resource.Release();  // release all memory of the arena at once
+
+#if __cplusplus >= 201703L && __has_include(<memory_resource>)
+
+#include <memory_resource>
+#include <new>
+
+#include "mcmalloc_api.hpp"
+
+namespace mc {
+class ArenaResource : public std::pmr::memory_resource {
+ public:
+  explicit ArenaResource(size_t blockSize = 0)
+      : _arena(mc_arena_create(blockSize)) {
+    if (_arena == nullptr) throw std::bad_alloc();
+  }
+  ArenaResource(const ArenaResource &) = delete;
+  ArenaResource &operator=(const ArenaResource &) = delete;
+  ~ArenaResource() override { mc_arena_destroy(_arena); }
+
+  // NOTE: all memory allocated from this resource becomes invalid
+  void Release() { mc_arena_reset(_arena); }
+  mc_arena_t *Arena() { return _arena; }
+
+ protected:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    void *ptr = mc_arena_memalign(_arena, alignment, bytes);
+    if (ptr == nullptr) throw std::bad_alloc();
+    return ptr;
+  }
+  // NOTE: memory is released by Release() or the destructor
+  void do_deallocate(void *, size_t, size_t) override {}
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override {
+    return this == &other;
+  }
+
+ private:
+  mc_arena_t *_arena;
+};
+}  // namespace mc
+
+#endif
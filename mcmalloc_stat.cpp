@@ -0,0 +1,236 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// NOTE: reader of the live statistics (not linked with libmcmalloc.so)
+// NOTE: the process must run with MCMALLOC_STAT_SHM=1
+// e.g.
+// $ ./mcmalloc-stat <pid>              : print a snapshot
+// $ ./mcmalloc-stat -t <pid> 1000      : stream with per-thread totals
+// $ ./mcmalloc-stat -c <pid>           : per (thread, class) rows
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#define STAT_SHM_READER
+#include "stat_shm.hpp"
+
+namespace {
+void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-t] [-c] <pid> [interval_ms]\n", name);
+  fprintf(stderr, "  -t: per-thread totals\n");
+  fprintf(stderr, "  -c: per (thread, class) rows\n");
+}
+
+class Segment {
+ public:
+  Segment() : _head(nullptr), _size(0) {}
+  ~Segment() {
+    if (_head != nullptr) munmap((void *)_head, _size);
+  }
+  bool Open(int pid) {
+    char path[64];
+    mc::statShmPath(path, pid);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "cannot open %s: %s (is MCMALLOC_STAT_SHM=1 set?)\n",
+              path, strerror(errno));
+      return false;
+    }
+    struct stat st;
+    void *p = (void *)-1;
+    if (fstat(fd, &st) == 0 &&
+        (size_t)st.st_size >= sizeof(mc::StatShmHeader))
+      p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == (void *)-1) {
+      fprintf(stderr, "cannot map %s\n", path);
+      return false;
+    }
+    _head = (const char *)p;
+    _size = st.st_size;
+    const mc::StatShmHeader *header = Header();
+    if (header->magic != mc::StatShmHeader::Magic ||
+        header->version != mc::StatShmHeader::Version ||
+        mc::statShmBytes(header->threadN, header->classN) > _size) {
+      fprintf(stderr, "%s is not a statistics segment of this version\n",
+              path);
+      return false;
+    }
+    return true;
+  }
+  const mc::StatShmHeader *Header() {
+    return (const mc::StatShmHeader *)_head;
+  }
+  // NOTE: copy a consistent snapshot (sequence lock)
+  bool Read(std::vector<char> &buf) {
+    const mc::StatShmHeader *header = Header();
+    size_t size = mc::statShmBytes(header->threadN, header->classN);
+    buf.resize(size);
+    for (int i = 0; i < 1000; i++) {
+      uint64_t seq = header->seq.load(std::memory_order_acquire);
+      if (seq % 2 == 0 && seq > 0) {
+        memcpy(buf.data(), _head, size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header->seq.load(std::memory_order_relaxed) == seq) return true;
+      }
+      struct timespec ts = {0, 1000000};
+      nanosleep(&ts, nullptr);
+    }
+    return false;
+  }
+
+ private:
+  const char *_head;
+  size_t _size;
+};
+
+void printSnapshot(const std::vector<char> &buf, bool threadFlag,
+                   bool threadClassFlag) {
+  const mc::StatShmHeader *header = (const mc::StatShmHeader *)buf.data();
+  uint32_t threadN = header->threadN;
+  uint32_t classN = header->classN;
+  const mc::StatShmClass *classes =
+      (const mc::StatShmClass *)(buf.data() + mc::statShmClassOffset());
+  const mc::StatShmThreadClass *threadClasses =
+      (const mc::StatShmThreadClass *)(buf.data() +
+                                       mc::statShmThreadClassOffset(classN));
+
+  int64_t inUse = 0, cached = 0, global = 0, perCpu = 0;
+  for (uint32_t i = 0; i < classN; i++)
+    global += classes[i].globalBytes, perCpu += classes[i].perCpuBytes;
+  for (uint32_t k = 0; k < threadN * classN; k++) {
+    inUse += threadClasses[k].inUseBytes;
+    cached += threadClasses[k].cachedBytes;
+  }
+
+  time_t sec = header->timeNs / 1000000000;
+  struct tm tm;
+  char timeBuf[32];
+  strftime(timeBuf, sizeof(timeBuf), "%H:%M:%S", localtime_r(&sec, &tm));
+  printf("# pid=%d time=%s publish=%llu\n", header->pid, timeBuf,
+         (unsigned long long)header->publishN);
+  printf("mmap: n=%lld mapped=%lld[KB] unmapped=%lld[KB] current=%lld[KB]\n",
+         (long long)header->mmapN, (long long)header->mmapBytes >> 10,
+         (long long)header->munmapBytes >> 10,
+         (long long)(header->mmapBytes - header->munmapBytes) >> 10);
+  printf("total: in-use=%lld[KB] cached=%lld[KB] global=%lld[KB] "
+         "per-cpu=%lld[KB]\n",
+         (long long)inUse >> 10, (long long)cached >> 10,
+         (long long)global >> 10, (long long)perCpu >> 10);
+
+  printf("%5s %10s %14s %14s %14s %14s\n", "class", "size", "in-use[KB]",
+         "cached[KB]", "global[KB]", "per-cpu[KB]");
+  for (uint32_t i = 0; i < classN; i++) {
+    int64_t classInUse = 0, classCached = 0;
+    for (uint32_t j = 0; j < threadN; j++) {
+      classInUse += threadClasses[j * classN + i].inUseBytes;
+      classCached += threadClasses[j * classN + i].cachedBytes;
+    }
+    if (classInUse == 0 && classCached == 0 && classes[i].globalBytes == 0 &&
+        classes[i].perCpuBytes == 0)
+      continue;
+    printf("%5u %10lld %14lld %14lld %14lld %14lld\n", i,
+           (long long)classes[i].size, (long long)classInUse >> 10,
+           (long long)classCached >> 10,
+           (long long)classes[i].globalBytes >> 10,
+           (long long)classes[i].perCpuBytes >> 10);
+  }
+
+  if (threadFlag) {
+    printf("%6s %14s %14s\n", "thread", "in-use[KB]", "cached[KB]");
+    for (uint32_t j = 0; j < threadN; j++) {
+      int64_t threadInUse = 0, threadCached = 0;
+      for (uint32_t i = 0; i < classN; i++) {
+        threadInUse += threadClasses[j * classN + i].inUseBytes;
+        threadCached += threadClasses[j * classN + i].cachedBytes;
+      }
+      if (threadInUse == 0 && threadCached == 0) continue;
+      printf("%6u %14lld %14lld\n", j, (long long)threadInUse >> 10,
+             (long long)threadCached >> 10);
+    }
+  }
+  if (threadClassFlag) {
+    printf("%6s %5s %10s %14s %14s\n", "thread", "class", "size",
+           "in-use[B]", "cached[B]");
+    for (uint32_t j = 0; j < threadN; j++) {
+      for (uint32_t i = 0; i < classN; i++) {
+        const mc::StatShmThreadClass &tc = threadClasses[j * classN + i];
+        if (tc.inUseBytes == 0 && tc.cachedBytes == 0) continue;
+        printf("%6u %5u %10lld %14lld %14lld\n", j, i,
+               (long long)classes[i].size, (long long)tc.inUseBytes,
+               (long long)tc.cachedBytes);
+      }
+    }
+  }
+  fflush(stdout);
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  bool threadFlag = false;
+  bool threadClassFlag = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "tch")) != -1) {
+    if (opt == 't')
+      threadFlag = true;
+    else if (opt == 'c')
+      threadClassFlag = true;
+    else
+      return usage(argv[0]), 1;
+  }
+  if (optind >= argc) return usage(argv[0]), 1;
+  int pid = atoi(argv[optind]);
+  long intervalMs = optind + 1 < argc ? atol(argv[optind + 1]) : 0;
+
+  // NOTE: segments of killed processes are left in /dev/shm
+  mc::statShmRemoveStale(pid);
+  Segment segment;
+  if (!segment.Open(pid)) return 1;
+  uint64_t startTime = segment.Header()->startTime;
+  if (mc::isDeadProcess(pid, startTime))
+    fprintf(stderr, "# process %d does not exist (stale segment)\n", pid);
+
+  std::vector<char> buf;
+  while (true) {
+    if (!segment.Read(buf)) {
+      fprintf(stderr, "no consistent snapshot (is the publisher running?)\n");
+      return 1;
+    }
+    printSnapshot(buf, threadFlag, threadClassFlag);
+    if (intervalMs <= 0) break;
+    struct timespec ts = {(time_t)(intervalMs / 1000),
+                          (long)(intervalMs % 1000) * 1000000};
+    nanosleep(&ts, nullptr);
+    if (mc::isDeadProcess(pid, startTime)) break;
+    printf("\n");
+  }
+  // NOTE: the last snapshot of a dead process has been printed
+  if (mc::isDeadProcess(pid, startTime)) {
+    char path[64];
+    mc::statShmPath(path, pid);
+    if (unlink(path) == 0) fprintf(stderr, "# removed %s\n", path);
+  }
+  return 0;
+}
@@ -17,6 +17,10 @@
 
 #include "memory_chunk_size.hpp"
 
+#include <cstring>
+
+#include "latency_stat.hpp"
+
 // TODO create class
 const size_t sizeCntTh = 10;
 const size_t sizeHashSamplingRate = 8;
@@ -30,13 +34,10 @@ size_t sizeIndexMapSize[sizeHashMaxSize] = {};  // fill zero
 std::hash<std::string> sizeHashFunc;
 size_t sizeMapCount2[sizeDataMaxSize] = {};    // fill zero
 size_t sizeMapIndices2[sizeDataMaxSize] = {};  // fill zero
+uint8_t smallSizeIndexCache[smallSizeMax / 8 + 1] = {};  // fill zero
+void (*sizeHashRegisterHook)(int sizeIndex) = nullptr;
 
 bool isPower2(size_t n) { return !(n & (n - 1)); }
-int roundupLog2(size_t x) {
-  int64_t res;
-  __asm__("bsrq %1, %0" : "=r"(res) : "r"(x - (x > 1)));
-  return res + 1;
-}
 
 #ifdef TWO_SIZE_FLAG
 size_t indexToSize(int index) { return 1UL << index; }
@@ -64,23 +65,65 @@ size_t indexToSizeWithHash(int index) {
   return size;
 }
 
-size_t sizeIndexToN(size_t sizeIndex) {
-  thread_local static size_t sizeIndexToNumberMap[N_SIZE_INDEX_ELEMENT] = {};
-  auto& n = sizeIndexToNumberMap[sizeIndex];
-  n <<= 1;
-  const size_t MAX_SIZE = 1 * (1 << 20);
-  while ((n * indexToSize(sizeIndex)) > MAX_SIZE) n >>= 1;
-  const size_t MIN_NUM = 1;
-  n = std::max(n, MIN_NUM);
-  if (indexToSize(sizeIndex) <= (1 << 18) && n < 32) n = 32;
-  return n;
-}
-
 int sizeToIndexWithHash(size_t size, bool addFlag) {
   int ret = sizeToIndexWithHashImple(size, addFlag);
   if (ret == 0) ret = sizeToIndex(size);
   return ret;
 }
+__attribute__((noinline, cold)) int sizeToIndexWithHashSlow(size_t size) {
+  int ret = sizeToIndexWithHash(size);
+  if (size <= smallSizeMax) smallSizeIndexCache[(size + 7) >> 3] = ret;
+  return ret;
+}
+// NOTE: requires: sizeHashMtx is locked
+static int sizeHashRegisterImple(size_t size) {
+  int sizeHashIndex = sizeHashIndexPos;
+  sizeIndexMapSize[sizeHashIndex] = size;
+  if (sizeHashRegisterHook != nullptr)
+    sizeHashRegisterHook(N_SIZE_INDEX_ELEMENT_2_POW + sizeHashIndex);
+  memset(smallSizeIndexCache, 0, sizeof(smallSizeIndexCache));
+
+  size_t nearSize = indexToSize(sizeToIndex(size) - 1);
+  for (int i = 0; i < sizeHashIndexPos; i++)
+    if (sizeIndexMapSize[i] < size)
+      nearSize = std::max(nearSize, sizeIndexMapSize[i]);
+
+  for (size_t index = nearSize + 1; index <= size; index++)
+    sizeMapIndices2[index] = sizeHashIndexPos;
+
+  sizeHashIndexPos++;
+  myprintf("size = %d, sizeHashIndex = %d (%d~%d)\n", (int)size,
+           (int)sizeHashIndex, (int)nearSize, (int)size);
+  return sizeHashIndex;
+}
+
+int sizeHashRegister(size_t size) {
+  if (size <= 8 || isPower2(size) || size % sizeHashSamplingRate != 0)
+    return 0;
+  if (size >= sizeDataMaxSize) return 0;
+
+  SCOPED_LATENCY_LOCK(sizeHashMtx, mc::LatencySizeHashLock);
+  // NOTE: already covered by a learned class
+  int coveredIndex = sizeMapIndices2[size];
+  if (coveredIndex != 0) {
+    if (sizeIndexMapSize[coveredIndex] < size) return 0;
+    return N_SIZE_INDEX_ELEMENT_2_POW + coveredIndex;
+  }
+  if (sizeHashIndexPos >= sizeHashMaxSize) return 0;
+
+  int sizeHashIndex = sizeHashRegisterImple(size);
+  // NOTE: skip the learning phase of this exact size
+  sizeMapCount2[size] = sizeCntTh;
+  return N_SIZE_INDEX_ELEMENT_2_POW + sizeHashIndex;
+}
+int sizeToIndexWithHashPinned(size_t size) {
+  if (size > 8 && size < sizeDataMaxSize)
+    sizeHashRegister((size + sizeHashSamplingRate - 1) /
+                     sizeHashSamplingRate * sizeHashSamplingRate);
+  return sizeToIndexWithHash(size);
+}
+int sizeHashClassN() { return sizeHashIndexPos; }
+
 int sizeToIndexWithHashImple(size_t size, bool addFlag) {
   if (size <= 8 || isPower2(size)) return 0;
 
@@ -108,24 +151,10 @@ int sizeToIndexWithHashImple(size_t size, bool addFlag) {
     }
     int tmppos = sizeHashIndexPos;
     {
-      SCOPED_LOCK(sizeHashMtx);
+      SCOPED_LATENCY_LOCK(sizeHashMtx, mc::LatencySizeHashLock);
       if (sizeIndexMapSize[tmppos] == 0) {
         myprintf("origin size = %d, size = %d\n", (int)originSize, (int)size);
-        sizeHashIndex = sizeHashIndexPos;
-        sizeIndexMapSize[sizeHashIndex] = size;
-
-        size_t nearSize = indexToSize(sizeToIndex(size) - 1);
-        for (int i = 0; i < sizeHashIndexPos; i++)
-          if (sizeIndexMapSize[i] < size)
-            nearSize = std::max(nearSize, sizeIndexMapSize[i]);
-
-        for (size_t index = nearSize + 1; index <= size; index++)
-          sizeMapIndices2[index] = sizeHashIndexPos;
-
-        sizeHashIndexPos++;
-        myprintf("origin size = %d, size = %d, sizeHashIndex = %d (%d~%d)\n",
-                 (int)originSize, (int)size, (int)sizeHashIndex, (int)nearSize,
-                 (int)size);
+        sizeHashIndex = sizeHashRegisterImple(size);
       } else {
         myprintf("origin size = %d, size = %d, sizeHashIndex = %d (false)\n",
                  (int)originSize, (int)size, (int)sizeHashIndex);
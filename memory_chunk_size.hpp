@@ -17,17 +17,46 @@
 
 #pragma once
 #include <cstddef>
+#include <cstdint>
 
 #include "debug.hpp"
 #include "misc.hpp"
 
 bool isPower2(size_t n);
-int roundupLog2(size_t x) __attribute__((__const__));
+// NOTE: inline (it is used by the statistics of every call)
+inline int roundupLog2(size_t x) {
+  int64_t res;
+  __asm__("bsrq %1, %0" : "=r"(res) : "r"(x - (x > 1)));
+  return res + 1;
+}
 
 size_t indexToSize(int index) __attribute__((__const__));
 size_t indexToSizeWithHash(int index);
 int sizeToIndex(size_t x) __attribute__((__const__));
-size_t sizeIndexToN(size_t sizeIndex) __attribute__((__const__));
 
 int sizeToIndexWithHash(size_t size, bool addFlag = false);
 int sizeToIndexWithHashImple(size_t size, bool addFlag = false);
+// NOTE: register a learned class explicitly (e.g. restored from a profile)
+int sizeHashRegister(size_t size);
+// NOTE: the class of size, learned at once if the size is not covered yet
+// NOTE: (e.g. reserved chunks must be in the class which malloc(3) uses)
+int sizeToIndexWithHashPinned(size_t size);
+int sizeHashClassN();
+// NOTE: called with sizeHashMtx locked when a class is learned, before the
+// NOTE: index is published (the allocator sizes the containers of the class)
+extern void (*sizeHashRegisterHook)(int sizeIndex);
+
+// NOTE: cache of sizeToIndexWithHash() for small sizes (per 8 bytes)
+// NOTE: 0: not cached yet (all entries are cleared when a class is learned)
+// NOTE: a stale entry is still a class large enough for the size
+const size_t smallSizeMax = 4096;
+extern uint8_t smallSizeIndexCache[smallSizeMax / 8 + 1]
+    __attribute__((visibility("hidden")));
+int sizeToIndexWithHashSlow(size_t size);
+inline int sizeToIndexWithHashFast(size_t size) {
+  if (LIKELY(size <= smallSizeMax)) {
+    int index = smallSizeIndexCache[(size + 7) >> 3];
+    if (LIKELY(index != 0)) return index;
+  }
+  return sizeToIndexWithHashSlow(size);
+}
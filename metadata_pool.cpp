@@ -0,0 +1,119 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "metadata_pool.hpp"
+
+#include "envar.hpp"
+#include "rss_stat.hpp"
+
+namespace mc {
+MetadataPool metadataPool;
+
+namespace {
+// NOTE: the first page of a free block
+struct FreeBlock {
+  FreeBlock *next;
+  // NOTE: the pages except the first one are already released
+  bool trimmedFlag;
+};
+
+inline void spinLock(std::atomic<int> &lock) {
+  while (lock.exchange(1, std::memory_order_acquire) != 0)
+    __builtin_ia32_pause();
+}
+inline void spinUnlock(std::atomic<int> &lock) {
+  lock.store(0, std::memory_order_release);
+}
+}  // namespace
+
+void *MetadataPool::Alloc() {
+  // NOTE: the first page of a free block is never unmapped
+  void *ptr = _freeList.Pop();
+  if (ptr == nullptr) return AllocFromRegion();
+  _nFreeBlock--;
+  return ptr;
+}
+
+void MetadataPool::Free(void *ptr) {
+  if (ptr == nullptr) return;
+  FreeBlock *block = (FreeBlock *)ptr;
+  block->trimmedFlag = false;
+  // NOTE: count first, so that the counter does not underflow in Alloc()
+  _nFreeBlock++;
+  _freeList.Push(block);
+}
+
+size_t MetadataPool::Trim() {
+  if (_hugepageMode == 2) return 0;
+  // NOTE: detach the whole list, so that no other thread touches the blocks
+  FreeBlock *first = (FreeBlock *)_freeList.PopAll();
+  if (first == nullptr) return 0;
+
+  size_t releasedSize = 0;
+  FreeBlock *last = first;
+  for (FreeBlock *block = first; block != nullptr; block = block->next) {
+    last = block;
+    if (block->trimmedFlag) continue;
+    int ret = madvise((void *)((uintptr_t)block + PAGE_SIZE),
+                      BlockSize - PAGE_SIZE, MADV_DONTNEED);
+    if (ret == -1) continue;
+    block->trimmedFlag = true;
+    releasedSize += BlockSize - PAGE_SIZE;
+  }
+  _freeList.PushList(first, last);
+  return releasedSize;
+}
+
+void *MetadataPool::AllocFromRegion() {
+  spinLock(_regionLock);
+  if (_regionPtr + BlockSize > _regionEnd) {
+    if (_hugepageMode == 0)
+      _hugepageMode = envar::GetBool("MCMALLOC_METADATA_HUGEPAGE", false) ? 2 : 1;
+    const int devZero = -1;
+    size_t mmapSize = _hugepageMode == 2 ? RegionSize * 2 : RegionSize;
+    void *p = mmap(nullptr, mmapSize, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, devZero, 0);
+    if (p == (void *)-1) {
+      spinUnlock(_regionLock);
+      errno = ENOMEM;
+      return nullptr;
+    }
+    uintptr_t begin = (uintptr_t)p;
+    if (_hugepageMode == 2) {
+      // NOTE: align to the region size and unmap the rest
+      begin = ALIGN(begin, RegionSize);
+      if (begin != (uintptr_t)p) munmap(p, begin - (uintptr_t)p);
+      uintptr_t end = (uintptr_t)p + mmapSize;
+      if (end != begin + RegionSize)
+        munmap((void *)(begin + RegionSize), end - (begin + RegionSize));
+#ifdef MADV_HUGEPAGE
+      madvise((void *)begin, RegionSize, MADV_HUGEPAGE);
+#endif
+    }
+    // NOTE: the rest of the old region is lost (less than BlockSize)
+    _regionPtr = begin;
+    _regionEnd = begin + RegionSize;
+    spanRegistry.Add((void *)begin, RegionSize, SpanMetadata, -1);
+  }
+  void *ptr = (void *)_regionPtr;
+  _regionPtr += BlockSize;
+  spinUnlock(_regionLock);
+  _nMappedBlock++;
+  return ptr;
+}
+}  // namespace mc
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "batch_mmap.hpp"
+#include "tagged_free_list.hpp"
+
+namespace mc {
+// NOTE: fixed size blocks for metadata (ChunkArrayContainer)
+// NOTE: blocks are carved from dedicated regions and recycled through a
+// NOTE: lock-free free list (they are never unmapped)
+class MetadataPool {
+ public:
+  static const size_t BlockSize = PAGE_SIZE * 2;
+  // NOTE: 2MB (a multiple of the hugepage size)
+  static const size_t RegionSize = 2 * 1024 * 1024;
+
+  // NOTE: return nullptr on failure (errno = ENOMEM)
+  void *Alloc();
+  void Free(void *ptr);
+  // NOTE: release physical pages of free blocks except the first page
+  // NOTE: (which holds the link of the free list)
+  // NOTE: return # of released bytes (nothing is released on hugepages)
+  size_t Trim();
+
+  size_t NMappedBlock() { return _nMappedBlock; }
+  size_t NFreeBlock() { return _nFreeBlock; }
+
+ private:
+  void *AllocFromRegion();
+
+  TaggedFreeList _freeList;
+  std::atomic<size_t> _nFreeBlock;
+  std::atomic<size_t> _nMappedBlock;
+  // NOTE: bump pointer of the current region (protected by _regionLock)
+  std::atomic<int> _regionLock;
+  uintptr_t _regionPtr;
+  uintptr_t _regionEnd;
+  // NOTE: 0: not yet read, 1: off, 2: on (MCMALLOC_METADATA_HUGEPAGE)
+  int _hugepageMode;
+};
+
+// NOTE: zero-initialized (it is used before constructors of static objects)
+extern MetadataPool metadataPool;
+}  // namespace mc
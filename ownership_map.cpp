@@ -0,0 +1,108 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ownership_map.hpp"
+
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <cerrno>
+
+namespace mc {
+OwnershipMap ownershipMap;
+
+std::atomic<uint64_t> *OwnershipMap::Leaf(size_t rootIndex, bool createFlag) {
+  std::atomic<uint64_t> *leaf =
+      _leaves[rootIndex].load(std::memory_order_acquire);
+  if (leaf != nullptr || !createFlag) return leaf;
+  // NOTE: the loser of a race unmaps its leaf
+  size_t leafBytes = sizeof(uint64_t) * LeafWordN;
+  void *p = mmap(nullptr, leafBytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) return nullptr;
+  std::atomic<uint64_t> *newLeaf = (std::atomic<uint64_t> *)p;
+  if (_leaves[rootIndex].compare_exchange_strong(leaf, newLeaf,
+                                                 std::memory_order_acq_rel))
+    return newLeaf;
+  munmap(p, leafBytes);
+  return leaf;
+}
+
+bool OwnershipMap::Update(void *addr, size_t length, bool setFlag) {
+  uintptr_t page = (uintptr_t)addr >> PageShift;
+  uintptr_t endPage =
+      ((uintptr_t)addr + length + ((uintptr_t)1 << PageShift) - 1) >>
+      PageShift;
+  const size_t leafPageN = LeafWordN * 64;
+  while (page < endPage) {
+    size_t rootIndex = page / leafPageN;
+    if (rootIndex >= RootN) return false;
+    std::atomic<uint64_t> *leaf = Leaf(rootIndex, setFlag);
+    uintptr_t leafEnd = (rootIndex + 1) * leafPageN;
+    if (leafEnd > endPage) leafEnd = endPage;
+    if (leaf == nullptr) {
+      if (setFlag) return false;
+      page = leafEnd;
+      continue;
+    }
+    // NOTE: word by word (other threads update the other bits)
+    while (page < leafEnd) {
+      size_t i = page % leafPageN;
+      size_t n = 64 - i % 64;
+      if (n > leafEnd - page) n = leafEnd - page;
+      uint64_t mask = (n == 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1))
+                      << (i % 64);
+      if (setFlag)
+        leaf[i / 64].fetch_or(mask, std::memory_order_relaxed);
+      else
+        leaf[i / 64].fetch_and(~mask, std::memory_order_relaxed);
+      page += n;
+    }
+  }
+  return true;
+}
+
+namespace {
+typedef void (*FreeFunc)(void *);
+typedef void *(*ReallocFunc)(void *, size_t);
+std::atomic<FreeFunc> nextFree;
+std::atomic<ReallocFunc> nextRealloc;
+// NOTE: dlsym(3) may call malloc(3)/free(3) (they are not foreign)
+template <typename F>
+F nextFunc(std::atomic<F> &func, const char *name) {
+  F f = func.load(std::memory_order_acquire);
+  if (f == nullptr) {
+    f = (F)dlsym(RTLD_NEXT, name);
+    func.store(f, std::memory_order_release);
+  }
+  return f;
+}
+}  // namespace
+
+void foreignFree(void *ptr) {
+  FreeFunc f = nextFunc(nextFree, "free");
+  if (f != nullptr) f(ptr);
+}
+
+void *foreignRealloc(void *ptr, size_t size) {
+  ReallocFunc f = nextFunc(nextRealloc, "realloc");
+  if (f == nullptr) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  return f(ptr, size);
+}
+}  // namespace mc
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "debug.hpp"
+
+// NOTE: ownership test of pointers passed to free(3)/realloc(3)
+// NOTE: pages mapped by the wrappers of batch_mmap.hpp are marked in a
+// NOTE: two-level bitmap (a root of 1GB leaves, a bit per page), and cleared
+// NOTE: by munmapWrapper
+// NOTE: pointers on unmarked pages (the dynamic loader, libc allocators
+// NOTE: called through dlsym(3), allocations before the preload) are
+// NOTE: forwarded to the next free(3)/realloc(3) (RTLD_NEXT)
+
+namespace mc {
+// NOTE: no user-provided constructor (zero-initialized static storage)
+class OwnershipMap {
+ public:
+  // NOTE: 47 bits of user space (x86-64, AArch64 with 48-bit VA)
+  static const int AddressBits = 47;
+  static const int PageShift = 12;
+  // NOTE: a leaf covers 1GB (a 32KB bitmap)
+  static const int LeafShift = 30;
+  static const size_t LeafWordN =
+      ((size_t)1 << (LeafShift - PageShift)) / 64;
+  static const size_t RootN = (size_t)1 << (AddressBits - LeafShift);
+
+  bool Contains(const void *ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    size_t rootIndex = addr >> LeafShift;
+    if (UNLIKELY(rootIndex >= RootN)) return false;
+    const std::atomic<uint64_t> *leaf =
+        _leaves[rootIndex].load(std::memory_order_acquire);
+    if (UNLIKELY(leaf == nullptr)) return false;
+    size_t page = (addr >> PageShift) & (LeafWordN * 64 - 1);
+    return (leaf[page / 64].load(std::memory_order_relaxed) >> (page % 64)) &
+           1;
+  }
+  // NOTE: requires: addr is page-aligned
+  // NOTE: return false if a leaf cannot be allocated
+  bool Set(void *addr, size_t length) { return Update(addr, length, true); }
+  void Clear(void *addr, size_t length) { Update(addr, length, false); }
+
+ private:
+  bool Update(void *addr, size_t length, bool setFlag);
+  std::atomic<uint64_t> *Leaf(size_t rootIndex, bool createFlag);
+
+  std::atomic<std::atomic<uint64_t> *> _leaves[RootN];
+};
+
+// NOTE: zero-initialized (it is used before constructors of static objects)
+extern OwnershipMap ownershipMap;
+
+// NOTE: free(3)/realloc(3) of the next library (a foreign free is ignored
+// NOTE: and a foreign realloc fails with ENOMEM if they are not found)
+void foreignFree(void *ptr);
+void *foreignRealloc(void *ptr, size_t size);
+}  // namespace mc
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "percpu_cache.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdlib>
+
+#include "batch_mmap.hpp"
+#include "rss_stat.hpp"
+
+namespace mc {
+namespace {
+// NOTE: # of possible CPUs ("0-63", "0,2-5", ...)
+// NOTE: sysconf(_SC_NPROCESSORS_CONF) is not used because it may call malloc
+size_t possibleCpuN() {
+  int fd = open("/sys/devices/system/cpu/possible", O_RDONLY);
+  if (fd < 0) return 0;
+  char buf[256];
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) return 0;
+  buf[n] = '\0';
+  long maxCpu = -1;
+  for (char *p = buf; *p != '\0' && *p != '\n';) {
+    char *end;
+    long cpu = strtol(p, &end, 10);
+    if (end == p) return 0;
+    if (cpu > maxCpu) maxCpu = cpu;
+    p = *end == '-' || *end == ',' ? end + 1 : end;
+  }
+  return maxCpu + 1;
+}
+}  // namespace
+
+bool PerCpuCache::Init() {
+  _enabledFlag = false;
+#ifdef PERCPU_CACHE_SUPPORTED
+  // NOTE: glibc.pthread.rseq=0 or old kernels
+  if (__rseq_size == 0 || (int32_t)CurrentRseq()->cpu_id < 0) return false;
+  _nCpu = possibleCpuN();
+  if (_nCpu == 0) return false;
+  _cpuStride = ALIGN(N_SIZE_INDEX_ELEMENT * SlabWordN * sizeof(uintptr_t),
+                     PAGE_SIZE);
+  // NOTE: slabs of unused CPUs are never touched
+  void *ptr = mmap(nullptr, _cpuStride * _nCpu, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED) return false;
+  _slabs = (uintptr_t)ptr;
+  spanRegistry.Add(ptr, _cpuStride * _nCpu, SpanMetadata, -1);
+  _enabledFlag = true;
+#endif
+  return _enabledFlag;
+}
+}  // namespace mc
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "debug.hpp"
+
+// NOTE: per-CPU cache (MCMALLOC_PERCPU=1)
+// NOTE: push/pop are restartable sequences (rseq) on the slab of the current
+// NOTE: CPU, so that they are lock-free without atomic instructions
+// NOTE: the rseq area registered by glibc (>= 2.35) is used
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PERCPU_CACHE_SUPPORTED
+#endif
+#endif
+
+namespace mc {
+class PerCpuCache {
+ public:
+  // NOTE: a slab is [count, slot_0, ..., slot_(SlabWordN - 2)]
+  static const size_t SlabWordN = 128;
+  static const size_t MaxCapacity = SlabWordN - 1;
+
+  // NOTE: return false if rseq is not available (per-thread stacks are used)
+  bool Init();
+  bool IsEnabled() { return _enabledFlag; }
+  size_t NCpu() { return _nCpu; }
+
+#ifdef PERCPU_CACHE_SUPPORTED
+  // NOTE: return nullptr if the slab is empty or rseq is not registered
+  // NOTE: for the calling thread
+  void *Pop(int sizeIndex) {
+    struct rseq *rs = CurrentRseq();
+    if (UNLIKELY((int32_t)rs->cpu_id < 0)) return nullptr;
+    uintptr_t classBase = _slabs + sizeIndex * SlabWordN * sizeof(uintptr_t);
+    void *ptr;
+    // NOTE: 1:start 2:post commit 3:rseq_cs 4:abort
+    // NOTE: the commit is the store of the count
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "0:\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %c[csOffset](%[rs])\n\t"
+        "1:\n\t"
+        "movl %c[cpuOffset](%[rs]), %%eax\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "addq %[base], %%rax\n\t"
+        "xorl %k[ptr], %k[ptr]\n\t"
+        "movq (%%rax), %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz 2f\n\t"
+        "movq (%%rax, %%rcx, 8), %[ptr]\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, (%%rax)\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long 0x53053053\n\t"
+        "4:\n\t"
+        "jmp 0b\n\t"
+        ".popsection\n\t"
+        : [ptr] "=&r"(ptr)
+        : [rs] "r"(rs), [base] "r"(classBase), [stride] "r"(_cpuStride),
+          [csOffset] "i"(offsetof(struct rseq, rseq_cs)),
+          [cpuOffset] "i"(offsetof(struct rseq, cpu_id))
+        : "rax", "rcx", "memory", "cc");
+    return ptr;
+  }
+  // NOTE: return false if the slab has capacity or more pointers
+  bool Push(int sizeIndex, void *ptr, size_t capacity) {
+    struct rseq *rs = CurrentRseq();
+    if (UNLIKELY((int32_t)rs->cpu_id < 0)) return false;
+    uintptr_t classBase = _slabs + sizeIndex * SlabWordN * sizeof(uintptr_t);
+    uint64_t ret;
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "0:\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %c[csOffset](%[rs])\n\t"
+        "1:\n\t"
+        "movl %c[cpuOffset](%[rs]), %%eax\n\t"
+        "imulq %[stride], %%rax\n\t"
+        "addq %[base], %%rax\n\t"
+        "xorl %k[ret], %k[ret]\n\t"
+        "movq (%%rax), %%rcx\n\t"
+        "cmpq %[capacity], %%rcx\n\t"
+        "jae 2f\n\t"
+        "movq %[ptr], 8(%%rax, %%rcx, 8)\n\t"
+        "incq %%rcx\n\t"
+        "movl $1, %k[ret]\n\t"
+        "movq %%rcx, (%%rax)\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long 0x53053053\n\t"
+        "4:\n\t"
+        "jmp 0b\n\t"
+        ".popsection\n\t"
+        : [ret] "=&r"(ret)
+        : [rs] "r"(rs), [base] "r"(classBase), [stride] "r"(_cpuStride),
+          [ptr] "r"(ptr), [capacity] "r"(capacity),
+          [csOffset] "i"(offsetof(struct rseq, rseq_cs)),
+          [cpuOffset] "i"(offsetof(struct rseq, cpu_id))
+        : "rax", "rcx", "memory", "cc");
+    return ret != 0;
+  }
+#else
+  void *Pop(int sizeIndex) { return nullptr; }
+  bool Push(int sizeIndex, void *ptr, size_t capacity) { return false; }
+#endif
+  // NOTE: # of pointers of the slab of the cpu (for statistics, racy)
+  size_t Count(size_t cpu, int sizeIndex) {
+    return *(volatile uintptr_t *)(_slabs + cpu * _cpuStride +
+                                   sizeIndex * SlabWordN * sizeof(uintptr_t));
+  }
+  // NOTE: the i-th pointer of the slab of the cpu (for statistics, racy)
+  void *At(size_t cpu, int sizeIndex, size_t i) {
+    return *(void *volatile *)(_slabs + cpu * _cpuStride +
+                               (sizeIndex * SlabWordN + 1 + i) *
+                                   sizeof(uintptr_t));
+  }
+  // NOTE: pop at most n pointers from the slab of the current CPU
+  size_t PopN(int sizeIndex, void **ptrs, size_t n) {
+    size_t k = 0;
+    while (k < n && (ptrs[k] = Pop(sizeIndex)) != nullptr) k++;
+    return k;
+  }
+
+ private:
+#ifdef PERCPU_CACHE_SUPPORTED
+  static struct rseq *CurrentRseq() {
+    return (struct rseq *)((uintptr_t)__builtin_thread_pointer() +
+                           __rseq_offset);
+  }
+#endif
+
+  bool _enabledFlag;
+  size_t _nCpu;
+  // NOTE: slabs of all classes of a CPU (aligned to PAGE_SIZE)
+  size_t _cpuStride;
+  uintptr_t _slabs;
+};
+}  // namespace mc
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "prefault.hpp"
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <cerrno>
+
+#include "batch_mmap.hpp"
+#include "envar.hpp"
+#include "futex.hpp"
+
+namespace mc {
+Prefaulter prefaulter;
+
+void Prefaulter::Init() {
+  _lockFlag = envar::GetBool("MCMALLOC_MLOCK", false);
+  // NOTE: the realtime mode implies pre-faulting
+  _enabledFlag = envar::GetBool("MCMALLOC_PREFAULT", false) || _lockFlag;
+  _batchBytes = ALIGN(
+      envar::GetLongLong("MCMALLOC_PREFAULT_BYTES", 8LL << 20), PAGE_SIZE);
+  if (_batchBytes == 0) _enabledFlag = false;
+  if (!_lockFlag) return;
+  // NOTE: MCL_ONFAULT: reserved but untouched pages (e.g. the rest of a
+  // NOTE: batch) are not locked, pre-faulted batches are
+  int flags = MCL_CURRENT | MCL_FUTURE;
+#ifdef MCL_ONFAULT
+  flags |= MCL_ONFAULT;
+#endif
+  if (mlockall(flags) == -1) _lockFlag = false;
+}
+
+bool Prefaulter::Start() {
+  pthread_t th;
+  if (pthread_create(&th, nullptr, ThreadFunc, this) != 0) return false;
+  pthread_detach(th);
+  return true;
+}
+
+void *Prefaulter::Take(int slot, size_t length, size_t *batchLength) {
+  if (slot < 0 || slot >= MaxSlotN || length > _batchBytes) return nullptr;
+  void *p = _slots[slot].exchange(nullptr, std::memory_order_acquire);
+  _wantedFlags[slot].store(true, std::memory_order_relaxed);
+  futexWake(_seq);
+  if (p != nullptr) *batchLength = _batchBytes;
+  return p;
+}
+
+void *Prefaulter::ThreadFunc(void *arg) {
+  ((Prefaulter *)arg)->Loop();
+  return nullptr;
+}
+
+void Prefaulter::Loop() {
+  while (true) {
+    uint32_t seq = _seq.load(std::memory_order_acquire);
+    for (int i = 0; i < MaxSlotN; i++) {
+      if (!_wantedFlags[i].load(std::memory_order_relaxed)) continue;
+      if (_slots[i].load(std::memory_order_relaxed) != nullptr) continue;
+      void *p = MapBatch();
+      // NOTE: out of memory: retry on the next request
+      if (p == nullptr) break;
+      _slots[i].store(p, std::memory_order_release);
+    }
+    // NOTE: the timeout is a safety net for lost wake-ups
+    futexWait(_seq, seq, 1000);
+  }
+}
+
+void *Prefaulter::MapBatch() {
+#ifdef MADV_POPULATE_WRITE
+  if (_populateWriteMode != 2) {
+    void *p = directMmapWrapper(_batchBytes, false);
+    if (p == nullptr) return nullptr;
+    if (madvise(p, _batchBytes, MADV_POPULATE_WRITE) == 0) {
+      _populateWriteMode = 1;
+      return p;
+    }
+    int err = errno;
+    munmapWrapper(p, _batchBytes);
+    // NOTE: EINVAL: the kernel is older than 5.14
+    if (err != EINVAL) return nullptr;
+    _populateWriteMode = 2;
+  }
+#endif
+  // NOTE: MAP_POPULATE does not report a failure of faulting
+  return directMmapWrapper(_batchBytes, true);
+}
+}  // namespace mc
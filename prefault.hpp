@@ -0,0 +1,68 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// NOTE: background pre-faulting (MCMALLOC_PREFAULT=1)
+// NOTE: a helper thread maps the next batch of each thread ahead of time and
+// NOTE: faults it in (MADV_POPULATE_WRITE or MAP_POPULATE), so that the
+// NOTE: batch pool (batchMmap) is refilled without page faults
+// NOTE: a batch is handed over through a per-thread slot (atomic exchange)
+
+namespace mc {
+class Prefaulter {
+ public:
+  // NOTE: >= # of thread indices
+  static const int MaxSlotN = 256;
+
+  void Init();
+  bool Start();
+  bool IsEnabled() { return _enabledFlag; }
+  // NOTE: realtime mode (MCMALLOC_MLOCK=1): mlockall(2) on fault
+  bool LockFlag() { return _lockFlag; }
+
+  // NOTE: take the pre-faulted batch of the slot and request the next one
+  // NOTE: return nullptr if it is not ready or too small for length
+  void *Take(int slot, size_t length, size_t *batchLength);
+  // NOTE: the pre-faulted batch of the slot (for statistics, racy)
+  void *Peek(int slot) { return _slots[slot].load(std::memory_order_relaxed); }
+  size_t BatchBytes() { return _batchBytes; }
+
+ private:
+  static void *ThreadFunc(void *arg);
+  void Loop();
+  void *MapBatch();
+
+  bool _enabledFlag;
+  bool _lockFlag;
+  // NOTE: 0: not yet checked, 1: available, 2: not available
+  int _populateWriteMode;
+  size_t _batchBytes;
+  // NOTE: incremented by Take (futex)
+  std::atomic<uint32_t> _seq;
+  std::atomic<bool> _wantedFlags[MaxSlotN];
+  std::atomic<void *> _slots[MaxSlotN];
+};
+
+// NOTE: zero-initialized (it is used before constructors of static objects)
+extern Prefaulter prefaulter;
+}  // namespace mc
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "pressure_watch.hpp"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include "debug.hpp"
+#include "envar.hpp"
+
+namespace mc {
+PressureWatcher pressureWatcher;
+
+namespace {
+const int maxTrimLevel = 2;
+
+// NOTE: read a small file into buf (NUL terminated)
+// NOTE: return false if the file does not exist
+bool readFile(const char *path, char *buf, size_t size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  ssize_t n = read(fd, buf, size - 1);
+  close(fd);
+  if (n < 0) return false;
+  buf[n] = '\0';
+  return true;
+}
+bool readCgroupFile(const char *dir, const char *name, char *buf,
+                    size_t size) {
+  if (dir[0] == '\0') return false;
+  char path[640];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  return readFile(path, buf, size);
+}
+// NOTE: "max" or bytes (0: no limit)
+int64_t readCgroupLimit(const char *dir, const char *name) {
+  char buf[64];
+  if (!readCgroupFile(dir, name, buf, sizeof(buf))) return 0;
+  if (strncmp(buf, "max", 3) == 0) return 0;
+  return strtoll(buf, nullptr, 10);
+}
+// NOTE: value of "<key> <value>" line or "<key>=<value>" field
+const char *findField(const char *buf, const char *key) {
+  size_t len = strlen(key);
+  for (const char *p = buf; (p = strstr(p, key)) != nullptr; p += len) {
+    bool headFlag = p == buf || p[-1] == ' ' || p[-1] == '\n';
+    if (headFlag && (p[len] == ' ' || p[len] == '=')) return p + len + 1;
+  }
+  return nullptr;
+}
+// NOTE: "high <n>" and "max <n>" count throttling and reclaim at the limit
+int64_t readCgroupEventN(const char *dir) {
+  char buf[1024];
+  if (!readCgroupFile(dir, "memory.events", buf, sizeof(buf))) return 0;
+  int64_t eventN = 0;
+  const char *p;
+  if ((p = findField(buf, "high")) != nullptr)
+    eventN += strtoll(p, nullptr, 10);
+  if ((p = findField(buf, "max")) != nullptr)
+    eventN += strtoll(p, nullptr, 10);
+  return eventN;
+}
+}  // namespace
+
+void PressureWatcher::Init() {
+  _cgroupDir[0] = '\0';
+  _limitBytes = 0;
+
+  // NOTE: cgroup v2 entry: "0::/path"
+  char buf[1024];
+  if (readFile("/proc/self/cgroup", buf, sizeof(buf))) {
+    const char *p = strstr(buf, "0::");
+    if (p != nullptr) {
+      p += 3;
+      size_t len = strcspn(p, "\n");
+      snprintf(_cgroupDir, sizeof(_cgroupDir), "/sys/fs/cgroup%.*s", (int)len,
+               p);
+    }
+  }
+  int64_t maxBytes = readCgroupLimit(_cgroupDir, "memory.max");
+  int64_t highBytes = readCgroupLimit(_cgroupDir, "memory.high");
+  if (maxBytes > 0 && highBytes > 0)
+    _limitBytes = std::min(maxBytes, highBytes);
+  else
+    _limitBytes = std::max(maxBytes, highBytes);
+  _preEventN = readCgroupEventN(_cgroupDir);
+
+  _someAvg10 = envar::GetLongLong("MCMALLOC_PRESSURE_SOME_AVG10", 10);
+  _usageRatio =
+      envar::GetLongLong("MCMALLOC_PRESSURE_USAGE_PERCENT", 90) / 100.0;
+  _intervalMs = envar::GetLongLong("MCMALLOC_PRESSURE_INTERVAL_MS", 1000);
+}
+
+bool PressureWatcher::Start() {
+  pthread_t th;
+  if (pthread_create(&th, nullptr, ThreadFunc, this) != 0) return false;
+  pthread_detach(th);
+  return true;
+}
+
+void *PressureWatcher::ThreadFunc(void *arg) {
+  ((PressureWatcher *)arg)->Loop();
+  return nullptr;
+}
+
+void PressureWatcher::Loop() {
+  // NOTE: -1: no pressure
+  int level = -1;
+  while (true) {
+    struct timespec ts = {(time_t)(_intervalMs / 1000),
+                          (long)(_intervalMs % 1000) * 1000000};
+    nanosleep(&ts, nullptr);
+    if (!Poll()) {
+      level = -1;
+      continue;
+    }
+    // NOTE: escalate the level while the pressure continues
+    level = std::min(level + 1, maxTrimLevel);
+    trimMemory(level);
+  }
+}
+
+bool PressureWatcher::Poll() {
+  char buf[1024];
+  bool pressureFlag = false;
+
+  // NOTE: "some avg10=0.00 avg60=0.00 avg300=0.00 total=0"
+  if (readCgroupFile(_cgroupDir, "memory.pressure", buf, sizeof(buf)) ||
+      readFile("/proc/pressure/memory", buf, sizeof(buf))) {
+    const char *p = findField(buf, "avg10");
+    if (p != nullptr && strtod(p, nullptr) >= _someAvg10) pressureFlag = true;
+  }
+  int64_t eventN = readCgroupEventN(_cgroupDir);
+  if (eventN > _preEventN) pressureFlag = true;
+  _preEventN = eventN;
+  if (_limitBytes > 0 &&
+      readCgroupFile(_cgroupDir, "memory.current", buf, sizeof(buf))) {
+    int64_t currentBytes = strtoll(buf, nullptr, 10);
+    if (currentBytes >= _limitBytes * _usageRatio) pressureFlag = true;
+  }
+  return pressureFlag;
+}
+}  // namespace mc
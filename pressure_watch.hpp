@@ -0,0 +1,60 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// NOTE: memory pressure watcher (MCMALLOC_PRESSURE_WATCH=1)
+// NOTE: a background thread polls PSI (/proc/pressure/memory or the cgroup
+// NOTE: memory.pressure) and the cgroup v2 memory.events/memory.current,
+// NOTE: and trims the allocator progressively while the pressure continues
+// NOTE: malloc(3) must not be used in this file except for thread creation
+
+namespace mc {
+// NOTE: defined in mcmalloc.cpp
+// NOTE: return # of bytes released to the OS
+size_t trimMemory(int level);
+
+class PressureWatcher {
+ public:
+  // NOTE: the cgroup directory and limits are resolved here
+  void Init();
+  bool Start();
+
+  // NOTE: min(memory.max, memory.high) of the cgroup (0: no limit)
+  int64_t LimitBytes() { return _limitBytes; }
+
+ private:
+  static void *ThreadFunc(void *arg);
+  void Loop();
+  // NOTE: return true if the memory is under pressure
+  bool Poll();
+
+  char _cgroupDir[512];
+  int64_t _limitBytes;
+  int64_t _preEventN;
+  // NOTE: thresholds
+  double _someAvg10;
+  double _usageRatio;
+  int64_t _intervalMs;
+};
+
+extern PressureWatcher pressureWatcher;
+}  // namespace mc
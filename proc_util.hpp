@@ -0,0 +1,61 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// NOTE: liveness of other processes (header only: shared with
+// NOTE: mcmalloc_stat.cpp)
+
+namespace mc {
+// NOTE: field 22 of /proc/<pid>/stat (0: unknown)
+inline uint64_t procStartTime(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  char buf[1024];
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) return 0;
+  buf[n] = '\0';
+  // NOTE: the comm field (2) can contain spaces and parentheses
+  char *p = strrchr(buf, ')');
+  if (p == nullptr) return 0;
+  // NOTE: skip fields 3 ... 21
+  for (int i = 3; i <= 22 && p != nullptr; i++) p = strchr(p + 1, ' ');
+  if (p == nullptr) return 0;
+  return strtoull(p + 1, nullptr, 10);
+}
+
+// NOTE: startTime: procStartTime() recorded by the process (0: unknown)
+inline bool isDeadProcess(pid_t pid, uint64_t startTime) {
+  if (kill(pid, 0) == -1 && errno == ESRCH) return true;
+  // NOTE: the pid was reused by another process
+  uint64_t t = procStartTime(pid);
+  return t != 0 && startTime != 0 && t != startTime;
+}
+}  // namespace mc
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// NOTE: size-class profile file (MCMALLOC_PROFILE=path)
+// NOTE: format (one record per line, '#' is comment)
+//   hash  <size>                        : learned hash class (in order)
+//   class <sizeIndex> <size> <nPeakChunk> : peak # of used chunks of a class
+// NOTE: malloc(3) must not be used in this file (called at init and term)
+
+namespace mc {
+class ProfileWriter {
+ public:
+  explicit ProfileWriter(const char *path) {
+    _fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  }
+  ~ProfileWriter() {
+    if (_fd >= 0) close(_fd);
+  }
+  bool IsOpen() { return _fd >= 0; }
+  void Printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+    if (_fd < 0) return;
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n <= 0) return;
+    n = std::min(n, (int)sizeof(buf) - 1);
+    if (write(_fd, buf, n) != n) close(_fd), _fd = -1;
+  }
+
+ private:
+  int _fd;
+};
+
+class ProfileReader {
+ public:
+  explicit ProfileReader(const char *path) : _head(nullptr), _size(0) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != (void *)-1) _head = (const char *)p, _size = st.st_size;
+    }
+    close(fd);
+    _pos = _head;
+  }
+  ~ProfileReader() {
+    if (_head != nullptr) munmap((void *)_head, _size);
+  }
+  bool IsOpen() { return _head != nullptr; }
+
+  // NOTE: read next record: "<key> <v0> <v1> ..."
+  // NOTE: return # of values (-1: EOF)
+  int Next(char (&key)[16], size_t *vals, int maxN) {
+    const char *end = _head + _size;
+    while (_pos < end) {
+      const char *eol = (const char *)memchr(_pos, '\n', end - _pos);
+      if (eol == nullptr) eol = end;
+      const char *p = _pos;
+      _pos = eol + 1;
+      if (p == eol || *p == '#') continue;
+
+      int keyLen = 0;
+      while (p < eol && *p != ' ' && keyLen < (int)sizeof(key) - 1)
+        key[keyLen++] = *p++;
+      key[keyLen] = '\0';
+      int n = 0;
+      while (p < eol && n < maxN) {
+        while (p < eol && *p == ' ') p++;
+        if (p == eol) break;
+        char *q;
+        vals[n++] = strtoull(p, &q, 10);
+        if (q == p) break;
+        p = q;
+      }
+      return n;
+    }
+    return -1;
+  }
+
+ private:
+  const char *_head;
+  const char *_pos;
+  size_t _size;
+};
+}  // namespace mc
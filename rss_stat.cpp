@@ -0,0 +1,295 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "rss_stat.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+
+#include "batch_mmap.hpp"
+#include "misc.hpp"
+
+namespace mc {
+SpanRegistry spanRegistry;
+
+namespace {
+// NOTE: scratch memory of a scan (not counted by mmapStat)
+void *scratchMap(size_t bytes) {
+  void *p = mmap(nullptr, ALIGN(bytes, PAGE_SIZE), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return p == MAP_FAILED ? nullptr : p;
+}
+void scratchUnmap(void *p, size_t bytes) {
+  if (p != nullptr) munmap(p, ALIGN(bytes, PAGE_SIZE));
+}
+
+// NOTE: residency of n pages from the page-aligned addr
+// NOTE: on ENOMEM (a part is not mapped) pages are checked one by one
+void pageResidency(uintptr_t addr, size_t n, uint8_t *vec) {
+  if (mincore((void *)addr, n * PAGE_SIZE, (unsigned char *)vec) == 0) return;
+  for (size_t i = 0; i < n; i++) {
+    if (mincore((void *)(addr + i * PAGE_SIZE), PAGE_SIZE,
+                (unsigned char *)&vec[i]) != 0)
+      vec[i] = 0;
+  }
+}
+
+struct SpanCopy {
+  uintptr_t addr;
+  size_t length;
+  uint64_t stamp;
+  int32_t sizeIndex;
+  int32_t threadIndex;
+};
+struct SpanEvent {
+  uintptr_t pos;
+  // NOTE: index of the span (the highest bit: the end of the span)
+  size_t index;
+};
+const size_t SpanEventEndBit = (size_t)1 << 63;
+}  // namespace
+
+Span *SpanRegistry::Storage() {
+  Span *spans = _spans.load(std::memory_order_acquire);
+  if (LIKELY(spans != nullptr)) return spans;
+  // NOTE: the loser of a race unmaps its storage
+  Span *newSpans = (Span *)scratchMap(sizeof(Span) * MaxSpanN);
+  if (newSpans == nullptr) return nullptr;
+  if (_spans.compare_exchange_strong(spans, newSpans,
+                                     std::memory_order_acq_rel))
+    return newSpans;
+  scratchUnmap(newSpans, sizeof(Span) * MaxSpanN);
+  return spans;
+}
+
+void SpanRegistry::Add(void *addr, size_t length, int sizeIndex,
+                       int threadIndex) {
+  if (addr == nullptr || length == 0) return;
+  Span *spans = Storage();
+  if (spans == nullptr) return;
+  uint64_t stamp = _stamp.fetch_add(1, std::memory_order_relaxed) + 1;
+  bool ownerFlag = threadIndex >= 0 && threadIndex < MaxThreadN;
+  if (ownerFlag && _lastIndices[threadIndex] != 0) {
+    Span &last = spans[_lastIndices[threadIndex] - 1];
+    size_t lastLength = last.length.load(std::memory_order_relaxed);
+    if (last.sizeIndex == sizeIndex &&
+        last.addr.load(std::memory_order_relaxed) + lastLength ==
+            (uintptr_t)addr) {
+      last.length.store(lastLength + length, std::memory_order_relaxed);
+      last.stamp.store(stamp, std::memory_order_release);
+      return;
+    }
+  }
+  size_t i = _n.fetch_add(1, std::memory_order_relaxed);
+  if (i >= MaxSpanN) {
+    // NOTE: keep _n > MaxSpanN (OverflowFlag)
+    _n.store(MaxSpanN + 1, std::memory_order_relaxed);
+    return;
+  }
+  Span &span = spans[i];
+  span.length.store(length, std::memory_order_relaxed);
+  span.stamp.store(stamp, std::memory_order_relaxed);
+  span.sizeIndex = sizeIndex;
+  span.threadIndex = threadIndex;
+  span.addr.store((uintptr_t)addr, std::memory_order_release);
+  if (ownerFlag) _lastIndices[threadIndex] = i + 1;
+}
+
+ResidencyMap::~ResidencyMap() {
+  scratchUnmap(_segments, _segmentBytes);
+  scratchUnmap(_pages, _pageBytes);
+}
+
+// NOTE: 1.copy published spans 2.sweep their boundaries in address order
+// NOTE: with a heap of covering spans (the newest one owns the range)
+// NOTE: 3.read the residency of the pages of the segments
+bool ResidencyMap::Build() {
+  size_t n = spanRegistry.N();
+  size_t workBytes =
+      (sizeof(SpanCopy) + sizeof(SpanEvent) * 2 + sizeof(size_t) + 1) * n + 1;
+  uint8_t *work = (uint8_t *)scratchMap(workBytes);
+  _segmentBytes = sizeof(Segment) * 2 * n + 1;
+  _segments = (Segment *)scratchMap(_segmentBytes);
+  if (work == nullptr || _segments == nullptr) {
+    scratchUnmap(work, workBytes);
+    errno = ENOMEM;
+    return false;
+  }
+  SpanCopy *spans = (SpanCopy *)work;
+  SpanEvent *events = (SpanEvent *)(spans + n);
+  size_t *heap = (size_t *)(events + 2 * n);
+  uint8_t *endedFlags = (uint8_t *)(heap + n);
+
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    Span &span = spanRegistry.At(i);
+    uintptr_t addr = span.addr.load(std::memory_order_acquire);
+    if (addr == 0) continue;
+    SpanCopy &copy = spans[m];
+    copy.stamp = span.stamp.load(std::memory_order_acquire);
+    copy.length = span.length.load(std::memory_order_relaxed);
+    copy.addr = addr;
+    copy.sizeIndex = span.sizeIndex;
+    copy.threadIndex = span.threadIndex;
+    events[2 * m] = {addr, m};
+    events[2 * m + 1] = {addr + copy.length, m | SpanEventEndBit};
+    m++;
+  }
+  std::sort(
+      events, events + 2 * m,
+      [](const SpanEvent &a, const SpanEvent &b) { return a.pos < b.pos; });
+  auto olderFlag = [spans](size_t a, size_t b) {
+    return spans[a].stamp < spans[b].stamp;
+  };
+
+  size_t heapN = 0;
+  for (size_t k = 0; k < 2 * m;) {
+    uintptr_t pos = events[k].pos;
+    for (; k < 2 * m && events[k].pos == pos; k++) {
+      size_t index = events[k].index & ~SpanEventEndBit;
+      if (events[k].index & SpanEventEndBit) {
+        endedFlags[index] = 1;
+        continue;
+      }
+      heap[heapN++] = index;
+      std::push_heap(heap, heap + heapN, olderFlag);
+    }
+    while (heapN > 0 && endedFlags[heap[0]]) {
+      std::pop_heap(heap, heap + heapN, olderFlag);
+      heapN--;
+    }
+    if (heapN == 0 || k == 2 * m) continue;
+    const SpanCopy &owner = spans[heap[0]];
+    if (owner.sizeIndex == SpanHole) continue;
+    uintptr_t next = events[k].pos;
+    if (_segmentN > 0) {
+      Segment &last = _segments[_segmentN - 1];
+      if (last.addr + last.length == pos &&
+          last.sizeIndex == owner.sizeIndex &&
+          last.threadIndex == owner.threadIndex) {
+        last.length += next - pos;
+        continue;
+      }
+    }
+    _segments[_segmentN++] = {
+        pos, next - pos, owner.sizeIndex, owner.threadIndex, 0, 0, 0, 0};
+  }
+  scratchUnmap(work, workBytes);
+
+  size_t pageN = 0;
+  for (size_t i = 0; i < _segmentN; i++) {
+    Segment &segment = _segments[i];
+    segment.pageOffset = pageN;
+    pageN += (ALIGN(segment.addr + segment.length, PAGE_SIZE) -
+              segment.addr / PAGE_SIZE * PAGE_SIZE) /
+             PAGE_SIZE;
+  }
+  _pageBytes = pageN + 1;
+  _pages = (uint8_t *)scratchMap(_pageBytes);
+  if (_pages == nullptr) {
+    errno = ENOMEM;
+    return false;
+  }
+  for (size_t i = 0; i < _segmentN; i++) {
+    Segment &segment = _segments[i];
+    uintptr_t begin = segment.addr / PAGE_SIZE * PAGE_SIZE;
+    uintptr_t end = ALIGN(segment.addr + segment.length, PAGE_SIZE);
+    pageResidency(begin, (end - begin) / PAGE_SIZE,
+                  _pages + segment.pageOffset);
+    segment.residentBytes =
+        ResidentBytes(segment, segment.addr, segment.addr + segment.length);
+  }
+  return true;
+}
+
+size_t ResidencyMap::ResidentBytes(const Segment &segment, uintptr_t addr,
+                                   uintptr_t end) {
+  uintptr_t b = std::max(addr, segment.addr);
+  uintptr_t e = std::min(end, segment.addr + segment.length);
+  uintptr_t firstPage = segment.addr / PAGE_SIZE;
+  size_t bytes = 0;
+  for (uintptr_t p = b / PAGE_SIZE * PAGE_SIZE; p < e; p += PAGE_SIZE) {
+    if ((_pages[segment.pageOffset + p / PAGE_SIZE - firstPage] & 1) == 0)
+      continue;
+    bytes += std::min(e, p + PAGE_SIZE) - std::max(b, p);
+  }
+  return bytes;
+}
+
+size_t ResidencyMap::AddFree(uintptr_t addr, size_t length) {
+  uintptr_t end = addr + length;
+  // NOTE: the first segment which ends after addr
+  size_t lo = 0, hi = _segmentN;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (_segments[mid].addr + _segments[mid].length <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  size_t bytes = 0;
+  for (size_t i = lo; i < _segmentN && _segments[i].addr < end; i++) {
+    Segment &segment = _segments[i];
+    size_t resident = ResidentBytes(segment, addr, end);
+    segment.freeBytes += std::min(end, segment.addr + segment.length) -
+                         std::max(addr, segment.addr);
+    segment.freeResidentBytes += resident;
+    bytes += resident;
+  }
+  return bytes;
+}
+
+void ResidencyMap::SortByOwner() {
+  std::sort(_segments, _segments + _segmentN,
+            [](const Segment &a, const Segment &b) {
+              return a.sizeIndex != b.sizeIndex ? a.sizeIndex < b.sizeIndex
+                                                : a.threadIndex < b.threadIndex;
+            });
+}
+
+size_t residentBytes(uintptr_t addr, size_t length) {
+  uintptr_t begin = addr / PAGE_SIZE * PAGE_SIZE;
+  uintptr_t end = ALIGN(addr + length, PAGE_SIZE);
+  uint8_t vec[1024];
+  size_t bytes = 0;
+  for (uintptr_t p = begin; p < end; p += sizeof(vec) * PAGE_SIZE) {
+    size_t n = std::min(sizeof(vec), (size_t)(end - p) / PAGE_SIZE);
+    pageResidency(p, n, vec);
+    for (size_t i = 0; i < n; i++)
+      if (vec[i] & 1) bytes += PAGE_SIZE;
+  }
+  return bytes;
+}
+
+size_t processResidentBytes() {
+  int fd = open("/proc/self/statm", O_RDONLY);
+  if (fd < 0) return 0;
+  char buf[128];
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) return 0;
+  buf[n] = '\0';
+  // NOTE: "size resident shared ..." (in pages)
+  char *p;
+  strtoull(buf, &p, 10);
+  return strtoull(p, nullptr, 10) * PAGE_SIZE;
+}
+}  // namespace mc
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// NOTE: resident memory attribution (mc_rss_report)
+// NOTE: the allocator records its mappings as spans: chunks carved for a size
+// NOTE: class by a thread, metadata regions and unmapped ranges (holes)
+// NOTE: a scan resolves overlapping spans (the newest one wins, because
+// NOTE: unmapped addresses can be mapped again), reads resident pages with
+// NOTE: mincore(2) and attributes resident bytes to the free chunks found in
+// NOTE: the stacks (the rest of the carved spans is live)
+// NOTE: malloc(3) must not be used in this file
+
+namespace mc {
+// NOTE: kinds of spans (>= 0: a size class of carved chunks)
+const int SpanMetadata = -1;
+const int SpanHole = -2;
+
+struct Span {
+  // NOTE: 0 until the span is published
+  std::atomic<uintptr_t> addr;
+  std::atomic<size_t> length;
+  // NOTE: order of registration (updated when the span is extended)
+  std::atomic<uint64_t> stamp;
+  int32_t sizeIndex;
+  int32_t threadIndex;
+};
+
+// NOTE: no user-provided constructor (zero-initialized static storage)
+class SpanRegistry {
+ public:
+  // NOTE: 32MB of address space (mapped on the first use)
+  static const size_t MaxSpanN = (size_t)1 << 20;
+  // NOTE: >= # of thread indices
+  static const int MaxThreadN = 256;
+
+  // NOTE: a span adjacent to the last span of the same thread and class is
+  // NOTE: merged into it
+  // NOTE: spans are dropped if the registry is full (see OverflowFlag)
+  void Add(void *addr, size_t length, int sizeIndex, int threadIndex);
+  size_t N() {
+    size_t n = _n.load(std::memory_order_acquire);
+    return n < MaxSpanN ? n : MaxSpanN;
+  }
+  Span &At(size_t i) { return _spans.load(std::memory_order_acquire)[i]; }
+  bool OverflowFlag() { return _n.load(std::memory_order_relaxed) > MaxSpanN; }
+
+ private:
+  Span *Storage();
+
+  std::atomic<Span *> _spans;
+  std::atomic<size_t> _n;
+  std::atomic<uint64_t> _stamp;
+  // NOTE: index + 1 of the last span of each thread (0: none)
+  size_t _lastIndices[MaxThreadN];
+};
+
+extern SpanRegistry spanRegistry;
+
+// NOTE: snapshot of disjoint spans with their resident pages
+// NOTE: buffers are mapped with mmap(2) and released by the destructor
+class ResidencyMap {
+ public:
+  struct Segment {
+    uintptr_t addr;
+    size_t length;
+    int32_t sizeIndex;
+    int32_t threadIndex;
+    // NOTE: index of the first page in the residency vector
+    size_t pageOffset;
+    size_t residentBytes;
+    // NOTE: free chunks in the segment (AddFree)
+    size_t freeBytes;
+    size_t freeResidentBytes;
+  };
+
+  ResidencyMap()
+      : _segments(nullptr),
+        _segmentN(0),
+        _segmentBytes(0),
+        _pages(nullptr),
+        _pageBytes(0) {}
+  ~ResidencyMap();
+  // NOTE: return false on failure (errno = ENOMEM)
+  bool Build();
+
+  size_t SegmentN() { return _segmentN; }
+  const Segment &At(size_t i) { return _segments[i]; }
+  // NOTE: count [addr, addr + length) as free in the segments
+  // NOTE: return its resident bytes
+  size_t AddFree(uintptr_t addr, size_t length);
+  // NOTE: sort segments by (sizeIndex, threadIndex) after AddFree
+  void SortByOwner();
+
+ private:
+  size_t ResidentBytes(const Segment &segment, uintptr_t addr, uintptr_t end);
+
+  Segment *_segments;
+  size_t _segmentN;
+  size_t _segmentBytes;
+  uint8_t *_pages;
+  size_t _pageBytes;
+};
+
+// NOTE: resident bytes of a mapped range (unmapped pages are not counted)
+size_t residentBytes(uintptr_t addr, size_t length);
+// NOTE: resident set size of the process (/proc/self/statm)
+size_t processResidentBytes();
+}  // namespace mc
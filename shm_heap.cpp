@@ -0,0 +1,443 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "shm_heap.hpp"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "batch_mmap.hpp"
+#include "mcmalloc_api.hpp"
+#include "proc_util.hpp"
+
+namespace mc {
+namespace {
+const uint32_t shmHeapVersion = 1;
+// NOTE: how long an opener waits for the creator to initialize the heap
+const int shmOpenTimeoutMs = 1000;
+
+// NOTE: incremented in forked children (a child claims its own slot)
+std::atomic<uint64_t> shmForkGeneration(0);
+pthread_once_t shmForkOnce = PTHREAD_ONCE_INIT;
+
+void shmAtforkChild() {
+  shmForkGeneration.fetch_add(1, std::memory_order_relaxed);
+}
+void shmRegisterAtfork() {
+  pthread_atfork(nullptr, nullptr, shmAtforkChild);
+}
+
+void shmMutexInit(pthread_mutex_t *mtx) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(mtx, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+// NOTE: the previous owner died with the lock: the lists are consistent
+// NOTE: (one store commits each operation), so the lock is taken over
+void shmMutexLock(pthread_mutex_t *mtx) {
+  int ret = pthread_mutex_lock(mtx);
+  if (ret == EOWNERDEAD) {
+    pthread_mutex_consistent(mtx);
+    return;
+  }
+  eassert(ret == 0, "pthread_mutex_lock result is %d", ret);
+}
+
+void shmMutexUnlock(pthread_mutex_t *mtx) { pthread_mutex_unlock(mtx); }
+
+void shmSleepMs(int ms) {
+  struct timespec ts = {0, ms * 1000 * 1000};
+  nanosleep(&ts, nullptr);
+}
+
+int shmClassIndex(size_t size) {
+  size_t unitSize = size + sizeof(ShmChunk);
+  int i = ShmClassMin;
+  while (((size_t)1 << i) < unitSize) i++;
+  return i;
+}
+}  // namespace
+
+ShmHeap *ShmHeap::Open(const char *name, size_t size) {
+  if (name == nullptr) {
+    if (size == 0) {
+      errno = EINVAL;
+      return nullptr;
+    }
+    int fd = memfd_create("mcmalloc-shm", MFD_CLOEXEC);
+    if (fd < 0) return nullptr;
+    return Attach(fd, true, size);
+  }
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd >= 0) {
+    if (size == 0) {
+      close(fd);
+      shm_unlink(name);
+      errno = EINVAL;
+      return nullptr;
+    }
+    ShmHeap *heap = Attach(fd, true, size);
+    if (heap == nullptr) shm_unlink(name);
+    return heap;
+  }
+  if (errno != EEXIST) return nullptr;
+  // NOTE: size is ignored (the creator decided it)
+  fd = shm_open(name, O_RDWR | O_CLOEXEC, 0600);
+  if (fd < 0) return nullptr;
+  return Attach(fd, false, 0);
+}
+
+ShmHeap *ShmHeap::OpenFd(int fd) {
+  int newFd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (newFd < 0) return nullptr;
+  return Attach(newFd, false, 0);
+}
+
+// NOTE: fd is closed on failure
+ShmHeap *ShmHeap::Attach(int fd, bool createFlag, size_t size) {
+  pthread_once(&shmForkOnce, shmRegisterAtfork);
+  uint64_t begin = ALIGN(sizeof(ShmHeapHeader), PAGE_SIZE);
+  int err = 0;
+  if (createFlag) {
+    size = ALIGN(size, PAGE_SIZE);
+    if (size < begin + PAGE_SIZE)
+      err = EINVAL;
+    else if (ftruncate(fd, size) != 0)
+      err = errno;
+  } else {
+    // NOTE: the creator may not have set the size yet
+    struct stat st;
+    for (int ms = 0; err == 0; ms++) {
+      if (fstat(fd, &st) != 0) {
+        err = errno;
+      } else if (st.st_size != 0) {
+        size = st.st_size;
+        break;
+      } else if (ms == shmOpenTimeoutMs) {
+        err = ETIMEDOUT;
+      } else {
+        shmSleepMs(1);
+      }
+    }
+    if (err == 0 && size < begin + PAGE_SIZE) err = EINVAL;
+  }
+  ShmHeapHeader *header = nullptr;
+  if (err == 0) {
+    header = (ShmHeapHeader *)fileMmapWrapper(size, fd, 0, false);
+    if (header == nullptr) err = ENOMEM;
+  }
+  if (err == 0 && createFlag) {
+    header->state.store(ShmHeapHeader::StateInitializing);
+    header->version = shmHeapVersion;
+    header->magic = ShmHeapHeader::Magic;
+    header->size = size;
+    header->begin = begin;
+    shmMutexInit(&header->mtx);
+    header->top = begin;
+    for (int i = 0; i < ShmHeapHeader::SlotN; i++)
+      shmMutexInit(&header->slots[i].mtx);
+    header->state.store(ShmHeapHeader::StateReady,
+                        std::memory_order_release);
+  } else if (err == 0) {
+    for (int ms = 0;
+         header->state.load(std::memory_order_acquire) !=
+         ShmHeapHeader::StateReady;
+         ms++) {
+      if (ms == shmOpenTimeoutMs) {
+        err = ETIMEDOUT;
+        break;
+      }
+      shmSleepMs(1);
+    }
+    if (err == 0 && (header->magic != ShmHeapHeader::Magic ||
+                     header->version != shmHeapVersion ||
+                     header->size != size))
+      err = EINVAL;
+  }
+  ShmHeap *heap = nullptr;
+  if (err == 0) {
+    heap = (ShmHeap *)batchMmapWrapper(ALIGN(sizeof(ShmHeap), PAGE_SIZE));
+    if (heap == nullptr) err = ENOMEM;
+  }
+  if (err != 0) {
+    if (header != nullptr) munmapWrapper((void *)header, size);
+    close(fd);
+    errno = err;
+    return nullptr;
+  }
+  heap->_header = header;
+  heap->_size = size;
+  heap->_fd = fd;
+  heap->_slotIndex = -1;
+  heap->_forkGeneration = shmForkGeneration.load(std::memory_order_relaxed);
+  pthread_mutex_init(&heap->_claimMtx, nullptr);
+  heap->Recover();
+  heap->ClaimSlot();
+  return heap;
+}
+
+void ShmHeap::Close() {
+  if (_slotIndex != -1 &&
+      _forkGeneration == shmForkGeneration.load(std::memory_order_relaxed))
+    ReleaseSlot();
+  munmapWrapper((void *)_header, _size);
+  close(_fd);
+  munmapWrapper((void *)this, ALIGN(sizeof(ShmHeap), PAGE_SIZE));
+}
+
+void ShmHeap::ClaimSlot() {
+  _slotIndex = -1;
+  pid_t pid = getpid();
+  uint64_t startTime = procStartTime(pid);
+  for (int i = 0; i < ShmHeapHeader::SlotN; i++) {
+    ShmSlot &slot = _header->slots[i];
+    int32_t expected = 0;
+    // NOTE: -1 while the start time is written (a dying claimer leaves the
+    // NOTE: empty slot unusable)
+    if (!slot.pid.compare_exchange_strong(expected, -1)) continue;
+    slot.startTime = startTime;
+    slot.pid.store(pid, std::memory_order_release);
+    _slotIndex = i;
+    return;
+  }
+  // NOTE: no free slots: the global lists are used directly
+}
+
+void ShmHeap::ReleaseSlot() {
+  ShmSlot &slot = _header->slots[_slotIndex];
+  shmMutexLock(&slot.mtx);
+  shmMutexLock(&_header->mtx);
+  DrainSlot(slot);
+  shmMutexUnlock(&_header->mtx);
+  slot.pid.store(0, std::memory_order_release);
+  shmMutexUnlock(&slot.mtx);
+  _slotIndex = -1;
+}
+
+ShmSlot *ShmHeap::Slot() {
+  if (UNLIKELY(_forkGeneration !=
+               shmForkGeneration.load(std::memory_order_relaxed))) {
+    // NOTE: the slot of the parent is left to it
+    pthread_mutex_lock(&_claimMtx);
+    uint64_t generation = shmForkGeneration.load(std::memory_order_relaxed);
+    if (_forkGeneration != generation) {
+      ClaimSlot();
+      _forkGeneration = generation;
+    }
+    pthread_mutex_unlock(&_claimMtx);
+  }
+  if (_slotIndex == -1) return nullptr;
+  return &_header->slots[_slotIndex];
+}
+
+uint64_t ShmHeap::PopList(uint64_t *list) {
+  uint64_t offset = *list;
+  if (offset != 0) *list = ChunkAt(offset)->next;
+  return offset;
+}
+
+void ShmHeap::PushList(uint64_t *list, uint64_t offset) {
+  ChunkAt(offset)->next = *list;
+  *list = offset;
+}
+
+uint64_t ShmHeap::PopGlobal(int classIndex) {
+  uint64_t offset = PopList(&_header->lists[classIndex]);
+  if (offset != 0) return offset;
+  uint64_t unitSize = (uint64_t)1 << classIndex;
+  if (_header->top + unitSize > _header->size) return 0;
+  offset = _header->top;
+  ShmChunk *chunk = ChunkAt(offset);
+  chunk->signature = ShmChunk::FreeSignature;
+  chunk->classIndex = classIndex;
+  chunk->next = 0;
+  // NOTE: committed (a crash before this store leaves top unchanged)
+  _header->top = offset + unitSize;
+  return offset;
+}
+
+size_t ShmHeap::DrainSlot(ShmSlot &slot) {
+  size_t bytes = 0;
+  for (int i = 0; i < ShmClassN; i++) {
+    uint64_t offset;
+    while ((offset = PopList(&slot.lists[i])) != 0) {
+      PushList(&_header->lists[i], offset);
+      bytes += (size_t)1 << i;
+    }
+    slot.ns[i] = 0;
+  }
+  return bytes;
+}
+
+uint64_t ShmHeap::AllocChunk(int classIndex) {
+  ShmSlot *slot = Slot();
+  size_t cacheN = SlotCacheN(classIndex);
+  if (slot == nullptr || cacheN == 0) {
+    shmMutexLock(&_header->mtx);
+    uint64_t offset = PopGlobal(classIndex);
+    shmMutexUnlock(&_header->mtx);
+    return offset;
+  }
+  shmMutexLock(&slot->mtx);
+  uint64_t offset = PopList(&slot->lists[classIndex]);
+  if (offset == 0) {
+    // NOTE: refill half of the cache from the global list (or the top)
+    shmMutexLock(&_header->mtx);
+    size_t n = cacheN / 2 > 0 ? cacheN / 2 : 1;
+    for (size_t i = 0; i < n; i++) {
+      uint64_t o = PopGlobal(classIndex);
+      if (o == 0) break;
+      PushList(&slot->lists[classIndex], o);
+      slot->ns[classIndex]++;
+    }
+    shmMutexUnlock(&_header->mtx);
+    offset = PopList(&slot->lists[classIndex]);
+  }
+  if (offset != 0) slot->ns[classIndex]--;
+  shmMutexUnlock(&slot->mtx);
+  return offset;
+}
+
+void *ShmHeap::Alloc(size_t size) {
+  if (UNLIKELY(size >= _size)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  int classIndex = shmClassIndex(size);
+  if (UNLIKELY(classIndex >= ShmClassN)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  uint64_t offset = AllocChunk(classIndex);
+  // NOTE: chunks may be held by dead processes
+  if (UNLIKELY(offset == 0) && Recover() > 0) offset = AllocChunk(classIndex);
+  if (UNLIKELY(offset == 0)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  ShmChunk *chunk = ChunkAt(offset);
+  eassert(chunk->signature == ShmChunk::FreeSignature &&
+              (int)chunk->classIndex == classIndex,
+          "shm heap is broken: offset=%lu", (unsigned long)offset);
+  chunk->signature = ShmChunk::UsedSignature;
+  return (void *)((uintptr_t)chunk + sizeof(ShmChunk));
+}
+
+void ShmHeap::Free(void *ptr) {
+  if (ptr == nullptr) return;
+  uint64_t offset = Offset(ptr) - sizeof(ShmChunk);
+  eassert(offset >= _header->begin && offset < _size,
+          "invalid pointer for the shm heap: %p", ptr);
+  ShmChunk *chunk = ChunkAt(offset);
+  eassert(chunk->signature == ShmChunk::UsedSignature,
+          "double free or invalid pointer for the shm heap: %p", ptr);
+  chunk->signature = ShmChunk::FreeSignature;
+  int classIndex = chunk->classIndex;
+
+  ShmSlot *slot = Slot();
+  size_t cacheN = SlotCacheN(classIndex);
+  if (slot == nullptr || cacheN == 0) {
+    shmMutexLock(&_header->mtx);
+    PushList(&_header->lists[classIndex], offset);
+    shmMutexUnlock(&_header->mtx);
+    return;
+  }
+  shmMutexLock(&slot->mtx);
+  PushList(&slot->lists[classIndex], offset);
+  slot->ns[classIndex]++;
+  if (slot->ns[classIndex] > cacheN) {
+    // NOTE: flush half of the cache to the global list
+    shmMutexLock(&_header->mtx);
+    while (slot->ns[classIndex] > cacheN / 2) {
+      uint64_t o = PopList(&slot->lists[classIndex]);
+      if (o == 0) break;
+      PushList(&_header->lists[classIndex], o);
+      slot->ns[classIndex]--;
+    }
+    shmMutexUnlock(&_header->mtx);
+  }
+  shmMutexUnlock(&slot->mtx);
+}
+
+size_t ShmHeap::Recover() {
+  size_t bytes = 0;
+  for (int i = 0; i < ShmHeapHeader::SlotN; i++) {
+    ShmSlot &slot = _header->slots[i];
+    int32_t pid = slot.pid.load(std::memory_order_acquire);
+    if (pid <= 0 || !isDeadProcess(pid, slot.startTime)) continue;
+    shmMutexLock(&slot.mtx);
+    // NOTE: another process may have recovered it
+    if (slot.pid.load(std::memory_order_acquire) == pid) {
+      shmMutexLock(&_header->mtx);
+      bytes += DrainSlot(slot);
+      shmMutexUnlock(&_header->mtx);
+      slot.pid.store(0, std::memory_order_release);
+    }
+    shmMutexUnlock(&slot.mtx);
+  }
+  return bytes;
+}
+}  // namespace mc
+
+mc_shm_heap_t *mc_shm_heap_open(const char *name, size_t size) {
+  return (mc_shm_heap_t *)mc::ShmHeap::Open(name, size);
+}
+
+mc_shm_heap_t *mc_shm_heap_open_fd(int fd) {
+  return (mc_shm_heap_t *)mc::ShmHeap::OpenFd(fd);
+}
+
+int mc_shm_heap_fd(mc_shm_heap_t *heap) {
+  if (heap == nullptr) return -1;
+  return ((mc::ShmHeap *)heap)->Fd();
+}
+
+void mc_shm_heap_close(mc_shm_heap_t *heap) {
+  if (heap == nullptr) return;
+  ((mc::ShmHeap *)heap)->Close();
+}
+
+void *mc_shm_malloc(mc_shm_heap_t *heap, size_t size) {
+  return ((mc::ShmHeap *)heap)->Alloc(size);
+}
+
+void mc_shm_free(mc_shm_heap_t *heap, void *ptr) {
+  ((mc::ShmHeap *)heap)->Free(ptr);
+}
+
+uint64_t mc_shm_offset(mc_shm_heap_t *heap, const void *ptr) {
+  return ((mc::ShmHeap *)heap)->Offset(ptr);
+}
+
+void *mc_shm_ptr(mc_shm_heap_t *heap, uint64_t offset) {
+  return ((mc::ShmHeap *)heap)->Ptr(offset);
+}
+
+size_t mc_shm_heap_recover(mc_shm_heap_t *heap) {
+  return ((mc::ShmHeap *)heap)->Recover();
+}
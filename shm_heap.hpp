@@ -0,0 +1,153 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "debug.hpp"
+#include "misc.hpp"
+
+// NOTE: heap shared by several processes (mc_shm_heap_*)
+// NOTE: a MAP_SHARED mapping of a shm_open(3) object or a memfd:
+// NOTE: [ShmHeapHeader][chunks ...] (top: the unused tail)
+// NOTE: - a chunk is a 16B header + body, its unit size is a power of 2, and
+// NOTE:   the free lists of each class are linked by offsets (the mapping
+// NOTE:   address differs between processes)
+// NOTE: - the global free lists are guarded by a robust process-shared mutex
+// NOTE: - a process caches free chunks in its slot (a robust mutex per slot)
+// NOTE: - every list operation moves one chunk and commits it with one store
+// NOTE:   (pop, then push), so a process which dies in the middle leaks at
+// NOTE:   most one chunk, and the next locker continues (EOWNERDEAD)
+// NOTE: - the slots of dead processes are returned to the global lists by
+// NOTE:   Recover() (on open, when the heap runs out, or by the API)
+
+namespace mc {
+class ShmChunk {
+ public:
+  static const uint32_t UsedSignature = 0x6d637368;  // "mcsh"
+  static const uint32_t FreeSignature = 0x6d637366;  // "mcsf"
+
+  uint32_t signature;
+  uint32_t classIndex;
+  // NOTE: the offset of the next free chunk (0: none)
+  uint64_t next;
+};
+static_assert(sizeof(ShmChunk) == 16, "ShmChunk size is not correct");
+
+// NOTE: unit size of class i: 1 << i (the smallest unit has a 16B body)
+const int ShmClassMin = 5;
+const int ShmClassN = 48;
+
+// NOTE: free chunks cached by a process
+struct ShmSlot {
+  // NOTE: 0: free, -1: being claimed, otherwise the owner
+  std::atomic<int32_t> pid;
+  int32_t padding;
+  // NOTE: start time of the owner (/proc/<pid>/stat) to detect reused pids
+  uint64_t startTime;
+  pthread_mutex_t mtx;
+  uint64_t lists[ShmClassN];
+  uint32_t ns[ShmClassN];
+};
+
+struct ShmHeapHeader {
+  static const uint64_t Magic = 0x6d636d616c6c6f63ULL;  // "mcmalloc"
+  static const int SlotN = 64;
+  enum { StateEmpty = 0, StateInitializing = 1, StateReady = 2 };
+
+  std::atomic<uint32_t> state;
+  uint32_t version;
+  uint64_t magic;
+  uint64_t size;
+  // NOTE: the offset of the first chunk
+  uint64_t begin;
+  pthread_mutex_t mtx;
+  // NOTE: guarded by mtx
+  uint64_t top;
+  uint64_t lists[ShmClassN];
+  ShmSlot slots[SlotN];
+};
+
+// NOTE: process-local handle of a mapped heap
+class ShmHeap {
+ public:
+  // NOTE: bytes of chunks cached per class in the slot of the process
+  // NOTE: (larger chunks go to the global lists directly)
+  static const size_t SlotCacheBytes = 256 * 1024;
+
+  // NOTE: name: shm_open(3) name (created with size bytes if it does not
+  // NOTE: exist), nullptr: a new memfd of size bytes
+  // NOTE: return nullptr with errno on failure
+  static ShmHeap *Open(const char *name, size_t size);
+  // NOTE: attach to the heap of fd (e.g. a memfd passed by another process)
+  static ShmHeap *OpenFd(int fd);
+  // NOTE: the cached chunks are returned to the global lists
+  void Close();
+  int Fd() { return _fd; }
+
+  void *Alloc(size_t size);
+  void Free(void *ptr);
+  uint64_t Offset(const void *ptr) {
+    if (ptr == nullptr) return 0;
+    return (uintptr_t)ptr - (uintptr_t)_header;
+  }
+  void *Ptr(uint64_t offset) {
+    if (offset == 0 || offset >= _size) return nullptr;
+    return (void *)((uintptr_t)_header + offset);
+  }
+  // NOTE: return the slots of dead processes to the global lists
+  // NOTE: return # of recovered bytes
+  size_t Recover();
+
+ private:
+  static ShmHeap *Attach(int fd, bool createFlag, size_t size);
+  // NOTE: _slotIndex == -1 if all slots are used
+  void ClaimSlot();
+  void ReleaseSlot();
+  // NOTE: nullptr: no slot (the global lists are used directly)
+  ShmSlot *Slot();
+  ShmChunk *ChunkAt(uint64_t offset) {
+    return (ShmChunk *)((uintptr_t)_header + offset);
+  }
+  // NOTE: requires: the lock of the list
+  uint64_t PopList(uint64_t *list);
+  void PushList(uint64_t *list, uint64_t offset);
+  // NOTE: requires: _header->mtx is locked
+  uint64_t PopGlobal(int classIndex);
+  // NOTE: requires: _header->mtx is locked
+  // NOTE: move the chunks of a slot to the global lists
+  size_t DrainSlot(ShmSlot &slot);
+  uint64_t AllocChunk(int classIndex);
+  size_t SlotCacheN(int classIndex) {
+    return SlotCacheBytes >> classIndex;
+  }
+
+  ShmHeapHeader *_header;
+  size_t _size;
+  int _fd;
+  int _slotIndex;
+  // NOTE: shmForkGeneration when the slot was claimed (a child process
+  // NOTE: claims its own slot)
+  uint64_t _forkGeneration;
+  pthread_mutex_t _claimMtx;
+};
+}  // namespace mc
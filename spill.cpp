@@ -0,0 +1,230 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "spill.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "batch_mmap.hpp"
+#include "envar.hpp"
+#include "mcmalloc_api.hpp"
+#include "prefault.hpp"
+
+// NOTE: Linux 5.4 (madvise fails with EINVAL on older kernels)
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+namespace mc {
+SpillTier spillTier;
+
+namespace {
+pthread_once_t spillForkOnce = PTHREAD_ONCE_INIT;
+}  // namespace
+
+void SpillTier::Init() {
+  _thresholdBytes = envar::GetLongLong("MCMALLOC_SPILL_THRESHOLD", 0);
+  if (_thresholdBytes < 0) _thresholdBytes = 0;
+  // NOTE: /tmp is often tmpfs (memory), so /var/tmp is the default
+  const char *dir = envar::Get<const char *>("MCMALLOC_SPILL_DIR", "");
+  if (dir[0] == '\0') dir = envar::Get<const char *>("TMPDIR", "/var/tmp");
+  if (strlen(dir) + 32 > sizeof(_dir)) dir = "/var/tmp";
+  strcpy(_dir, dir);
+}
+
+int SpillTier::OpenScratchFile() {
+#ifdef O_TMPFILE
+  int fd = open(_dir, O_TMPFILE | O_RDWR | O_EXCL | O_CLOEXEC, 0600);
+  if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR)) return fd;
+#endif
+  // NOTE: the file system does not support O_TMPFILE
+  char path[sizeof(_dir) + 32];
+  snprintf(path, sizeof(path), "%s/mcmalloc-spill.XXXXXX", _dir);
+  int fd2 = mkostemp(path, O_CLOEXEC);
+  if (fd2 >= 0) unlink(path);
+  return fd2;
+}
+
+void *SpillTier::Map(size_t length) {
+  if (length == 0 || length > ((size_t)1 << 62)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  length = ALIGN(length, PAGE_SIZE);
+  pthread_once(&spillForkOnce, RegisterAtfork);
+  int fd = OpenScratchFile();
+  if (fd < 0) return nullptr;
+  if (!Reserve(fd, length)) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return nullptr;
+  }
+  void *p = fileMmapWrapper(length, fd, 0, true);
+  // NOTE: the mapping keeps the file
+  close(fd);
+  if (p == nullptr) return nullptr;
+  {
+    SCOPED_LOCK(_mappingMtx);
+    if (!AddMapping(p, length)) {
+      munmapWrapper(p, length);
+      errno = ENOMEM;
+      return nullptr;
+    }
+  }
+  // NOTE: the realtime mode (mlockall) would pin the pages in memory
+  if (prefaulter.LockFlag()) munlock(p, length);
+  _mappedBytes.fetch_add(length, std::memory_order_relaxed);
+  return p;
+}
+
+void SpillTier::Unmap(void *ptr, size_t length) {
+  length = ALIGN(length, PAGE_SIZE);
+  {
+    SCOPED_LOCK(_mappingMtx);
+    RemoveMapping(ptr);
+  }
+  int ret = munmapWrapper(ptr, length);
+  eassert(ret != -1, "munmap result is -1: errno=%d", errno);
+  _mappedBytes.fetch_sub(length, std::memory_order_relaxed);
+}
+
+bool SpillTier::Reserve(int fd, size_t length) {
+  // NOTE: blocks are reserved, so that a full disk fails here instead of
+  // NOTE: raising SIGBUS on a later write (sparse if not supported)
+  int ret = fallocate(fd, 0, 0, length);
+  if (ret != 0 && (errno == EOPNOTSUPP || errno == ENOSYS))
+    ret = ftruncate(fd, length);
+  return ret == 0;
+}
+
+bool SpillTier::AddMapping(void *ptr, size_t length) {
+  if (_mappingN == _mappingCapacity) {
+    size_t capacity =
+        std::max(_mappingCapacity * 2, (size_t)PAGE_SIZE / sizeof(Mapping));
+    void *p = mmap(nullptr, capacity * sizeof(Mapping),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return false;
+    if (_mappings != nullptr) {
+      memcpy(p, _mappings, _mappingN * sizeof(Mapping));
+      munmap(_mappings, _mappingCapacity * sizeof(Mapping));
+    }
+    _mappings = (Mapping *)p;
+    _mappingCapacity = capacity;
+  }
+  _mappings[_mappingN++] = {ptr, length};
+  return true;
+}
+
+void SpillTier::RemoveMapping(void *ptr) {
+  for (size_t i = 0; i < _mappingN; i++) {
+    if (_mappings[i].ptr != ptr) continue;
+    _mappings[i] = _mappings[--_mappingN];
+    return;
+  }
+  eassert(false, "spilled mapping is not found: ptr=%p", ptr);
+}
+
+bool SpillTier::CopyMapping(const Mapping &mapping) {
+  // NOTE: a scratch file of the child keeps the pages out of memory
+  int fd = OpenScratchFile();
+  if (fd >= 0) {
+    bool okFlag = Reserve(fd, mapping.length);
+    for (size_t done = 0; okFlag && done < mapping.length;) {
+      ssize_t n =
+          write(fd, (char *)mapping.ptr + done, mapping.length - done);
+      if (n < 0 && errno == EINTR) continue;
+      okFlag = n > 0;
+      if (okFlag) done += n;
+    }
+    void *p = MAP_FAILED;
+    if (okFlag)
+      p = mmap(mapping.ptr, mapping.length, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED, fd, 0);
+    close(fd);
+    if (p == mapping.ptr) return true;
+  }
+  // NOTE: no space for a scratch file: an anonymous copy
+  void *p = mmap(nullptr, mapping.length, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return false;
+  memcpy(p, mapping.ptr, mapping.length);
+  void *q = mremap(p, mapping.length, mapping.length,
+                   MREMAP_MAYMOVE | MREMAP_FIXED, mapping.ptr);
+  if (q == mapping.ptr) return true;
+  munmap(p, mapping.length);
+  return false;
+}
+
+void SpillTier::RegisterAtfork() {
+  pthread_atfork(AtforkPrepare, AtforkParent, AtforkChild);
+}
+// NOTE: no mapping is added or removed during fork(2)
+void SpillTier::AtforkPrepare() { pthread_mutex_lock(&spillTier._mappingMtx); }
+void SpillTier::AtforkParent() {
+  pthread_mutex_unlock(&spillTier._mappingMtx);
+}
+void SpillTier::AtforkChild() {
+  for (size_t i = 0; i < spillTier._mappingN; i++) {
+    bool ret = spillTier.CopyMapping(spillTier._mappings[i]);
+    eassert(ret, "spilled mapping is not copied: errno=%d", errno);
+  }
+  pthread_mutex_unlock(&spillTier._mappingMtx);
+}
+
+int SpillTier::Advise(void *ptr, size_t length, int phase) {
+  uintptr_t begin = (uintptr_t)ptr / PAGE_SIZE * PAGE_SIZE;
+  size_t pageLength = ALIGN((uintptr_t)ptr + length, PAGE_SIZE) - begin;
+  int advice;
+  switch (phase) {
+    case MC_SPILL_NORMAL:
+      advice = MADV_NORMAL;
+      break;
+    case MC_SPILL_SEQUENTIAL:
+      advice = MADV_SEQUENTIAL;
+      break;
+    case MC_SPILL_RANDOM:
+      advice = MADV_RANDOM;
+      break;
+    case MC_SPILL_WILLNEED:
+      advice = MADV_WILLNEED;
+      break;
+    case MC_SPILL_COLD:
+      advice = MADV_COLD;
+      break;
+    case MC_SPILL_PAGEOUT:
+      // NOTE: reclaim by madvise does not write back dirty file pages
+      if (msync((void *)begin, pageLength, MS_SYNC) != 0) return errno;
+      advice = MADV_PAGEOUT;
+      break;
+    default:
+      return EINVAL;
+  }
+  if (madvise((void *)begin, pageLength, advice) != 0) return errno;
+  return 0;
+}
+}  // namespace mc
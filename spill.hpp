@@ -0,0 +1,95 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "debug.hpp"
+#include "misc.hpp"
+
+// NOTE: file-backed spill tier (MCMALLOC_SPILL_THRESHOLD, mc_spill_malloc)
+// NOTE: a spilled chunk is a MAP_SHARED mapping of its own scratch file
+// NOTE: (unlinked, in MCMALLOC_SPILL_DIR), so its pages are written back
+// NOTE: and evicted by the page cache instead of being swapped out
+// NOTE: [Chunk (sizeIndex: SpillSizeIndex)][body ...] (page aligned)
+// NOTE: spilled chunks never enter the stacks: free(3) unmaps them and the
+// NOTE: file is released with the mapping
+// NOTE: a forked child copies the live mappings into scratch files of its
+// NOTE: own (MAP_SHARED pages are not copied on write by fork(2))
+
+namespace mc {
+class SpillTier {
+ public:
+  // NOTE: sizeIndex of spilled chunks (out of the range of the classes)
+  static const int SpillSizeIndex = N_SIZE_INDEX_ELEMENT;
+
+  void Init();
+  // NOTE: classes of this size or larger are spilled (0: only tagged
+  // NOTE: allocations)
+  // NOTE: fixed at start-up: chunks of a spilled class must not be cached in
+  // NOTE: the stacks
+  int64_t ThresholdBytes() { return _thresholdBytes; }
+  // NOTE: map length bytes (page aligned) of a new scratch file
+  // NOTE: return nullptr with errno on failure
+  void *Map(size_t length);
+  void Unmap(void *ptr, size_t length);
+  // NOTE: madvise(2) of the pages of [ptr, ptr + length) for an access
+  // NOTE: phase (MC_SPILL_*)
+  // NOTE: return 0 on success, otherwise errno
+  int Advise(void *ptr, size_t length, int phase);
+  int64_t MappedBytes() {
+    return _mappedBytes.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Mapping {
+    void *ptr;
+    size_t length;
+  };
+
+  int OpenScratchFile();
+  // NOTE: reserve the blocks of length bytes (return false with errno)
+  bool Reserve(int fd, size_t length);
+  // NOTE: the list of the live mappings (for fork(2))
+  // NOTE: requires: _mappingMtx is held
+  bool AddMapping(void *ptr, size_t length);
+  void RemoveMapping(void *ptr);
+  // NOTE: replace a mapping with a private copy in a forked child
+  bool CopyMapping(const Mapping &mapping);
+  static void RegisterAtfork();
+  static void AtforkPrepare();
+  static void AtforkParent();
+  static void AtforkChild();
+
+  int64_t _thresholdBytes;
+  char _dir[1024];
+  std::atomic<int64_t> _mappedBytes;
+  // NOTE: zero-initialized (PTHREAD_MUTEX_INITIALIZER)
+  pthread_mutex_t _mappingMtx;
+  // NOTE: mmap(2)ed array (malloc(3) must not be used)
+  Mapping *_mappings;
+  size_t _mappingN;
+  size_t _mappingCapacity;
+};
+
+// NOTE: zero-initialized (it is used before constructors of static objects)
+extern SpillTier spillTier;
+}  // namespace mc
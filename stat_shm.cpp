@@ -0,0 +1,70 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "stat_shm.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "envar.hpp"
+
+namespace mc {
+StatShm statShm;
+
+bool StatShm::Init(uint32_t threadN, uint32_t classN) {
+  _enabledFlag = false;
+  _intervalMs = envar::GetLongLong("MCMALLOC_STAT_INTERVAL_MS", 250);
+  if (_intervalMs <= 0) return false;
+  statShmRemoveStale(getpid());
+  statShmPath(_path, getpid());
+  _classN = classN;
+  _size = statShmBytes(threadN, classN);
+  // NOTE: readable only by the owner (the segment reveals the heap layout)
+  int fd = open(_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) return false;
+  void *p = (void *)-1;
+  if (ftruncate(fd, _size) == 0)
+    p = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == (void *)-1) {
+    unlink(_path);
+    return false;
+  }
+  _head = p;
+  StatShmHeader *header = Header();
+  header->version = StatShmHeader::Version;
+  header->threadN = threadN;
+  header->classN = classN;
+  header->pid = getpid();
+  header->startTime = procStartTime(getpid());
+  header->intervalMs = _intervalMs;
+  // NOTE: readers check the magic last
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = StatShmHeader::Magic;
+  _enabledFlag = true;
+  return true;
+}
+
+void StatShm::Term() {
+  // NOTE: a forked child must not unlink the segment of the parent
+  if (!_enabledFlag || Header()->pid != getpid()) return;
+  _enabledFlag = false;
+  // NOTE: the mapping is kept (the publisher may still be running)
+  unlink(_path);
+}
+}  // namespace mc
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "proc_util.hpp"
+
+// NOTE: live statistics export (MCMALLOC_STAT_SHM=1)
+// NOTE: a publisher thread copies the counters into /dev/shm/mcmalloc.<pid>
+// NOTE: under a sequence lock, and mcmalloc-stat reads the segment without
+// NOTE: disturbing the process
+// NOTE: the layout is shared with mcmalloc_stat.cpp (header only part)
+// NOTE: Term() unlinks the segment only at a normal exit, so segments of
+// NOTE: killed processes are removed by the next Init() and mcmalloc-stat
+// NOTE: layout: StatShmHeader | StatShmClass[classN] |
+// NOTE:         StatShmThreadClass[threadN][classN]
+
+namespace mc {
+struct StatShmHeader {
+  // NOTE: "MCSTAT\0\0"
+  static const uint64_t Magic = 0x0000544154534d43ULL;
+  static const uint32_t Version = 2;
+
+  uint64_t magic;
+  uint32_t version;
+  uint32_t threadN;
+  uint32_t classN;
+  int32_t pid;
+  int64_t intervalMs;
+  // NOTE: procStartTime() of pid (a reused pid is not taken for the writer)
+  uint64_t startTime;
+  // NOTE: odd while the publisher writes
+  std::atomic<uint64_t> seq;
+  uint64_t publishN;
+  // NOTE: CLOCK_REALTIME of the last publication
+  uint64_t timeNs;
+  // NOTE: chunk memory mapped by batchMmap/directMmapWrapper
+  int64_t mmapN;
+  int64_t mmapBytes;
+  int64_t munmapBytes;
+};
+struct StatShmClass {
+  int64_t size;
+  // NOTE: free chunks of the global stack
+  int64_t globalBytes;
+  // NOTE: free chunks of the per-CPU slabs (MCMALLOC_PERCPU)
+  int64_t perCpuBytes;
+};
+struct StatShmThreadClass {
+  // NOTE: allocated by the thread and not yet freed by the thread (it can be
+  // NOTE: negative because of frees from other threads)
+  int64_t inUseBytes;
+  // NOTE: free chunks of the local stack
+  int64_t cachedBytes;
+};
+
+inline size_t statShmClassOffset() {
+  return (sizeof(StatShmHeader) + 63) / 64 * 64;
+}
+inline size_t statShmThreadClassOffset(uint32_t classN) {
+  return statShmClassOffset() + sizeof(StatShmClass) * classN;
+}
+inline size_t statShmBytes(uint32_t threadN, uint32_t classN) {
+  return statShmThreadClassOffset(classN) +
+         sizeof(StatShmThreadClass) * threadN * classN;
+}
+inline void statShmPath(char (&path)[64], int pid) {
+  snprintf(path, sizeof(path), "/dev/shm/mcmalloc.%d", pid);
+}
+// NOTE: unlink the segments of dead processes except keepPid
+// NOTE: (getdents64(2) instead of opendir(3), which uses malloc(3))
+// NOTE: return # of removed segments
+inline int statShmRemoveStale(int keepPid) {
+  int dirFd = open("/dev/shm", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirFd < 0) return 0;
+  // NOTE: linux_dirent64
+  struct Dirent {
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[1];
+  };
+  const char prefix[] = "mcmalloc.";
+  int n = 0;
+  alignas(8) char buf[4096];
+  long length;
+  while ((length = syscall(SYS_getdents64, dirFd, buf, sizeof(buf))) > 0) {
+    for (long offset = 0; offset < length;) {
+      const Dirent *d = (const Dirent *)(buf + offset);
+      offset += d->reclen;
+      if (strncmp(d->name, prefix, sizeof(prefix) - 1) != 0) continue;
+      char *end;
+      long pid = strtol(d->name + sizeof(prefix) - 1, &end, 10);
+      if (*end != '\0' || pid <= 0 || pid == keepPid) continue;
+      char path[64];
+      statShmPath(path, (int)pid);
+      // NOTE: startTime is 0 (unknown) until the writer sets the magic
+      uint64_t startTime = 0;
+      int fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (fd >= 0) {
+        alignas(StatShmHeader) char headerBuf[sizeof(StatShmHeader)];
+        const StatShmHeader *header = (const StatShmHeader *)headerBuf;
+        if (pread(fd, headerBuf, sizeof(headerBuf), 0) ==
+                (ssize_t)sizeof(headerBuf) &&
+            header->magic == StatShmHeader::Magic &&
+            header->version == StatShmHeader::Version)
+          startTime = header->startTime;
+        close(fd);
+      }
+      if (isDeadProcess((pid_t)pid, startTime) && unlink(path) == 0) n++;
+    }
+  }
+  close(dirFd);
+  return n;
+}
+
+#ifndef STAT_SHM_READER
+// NOTE: the writer (libmcmalloc.so)
+// NOTE: malloc(3) must not be used except for thread creation
+class StatShm {
+ public:
+  // NOTE: create the segment of the process (return false on failure)
+  bool Init(uint32_t threadN, uint32_t classN);
+  // NOTE: unlink the segment (at exit)
+  void Term();
+  bool IsEnabled() { return _enabledFlag; }
+  int64_t IntervalMs() { return _intervalMs; }
+
+  StatShmHeader *Header() { return (StatShmHeader *)_head; }
+  StatShmClass *Classes() {
+    return (StatShmClass *)((uintptr_t)_head + statShmClassOffset());
+  }
+  StatShmThreadClass *ThreadClasses(int threadIndex) {
+    return (StatShmThreadClass *)((uintptr_t)_head +
+                                  statShmThreadClassOffset(_classN)) +
+           (size_t)threadIndex * _classN;
+  }
+  void BeginWrite() {
+    auto &seq = Header()->seq;
+    seq.store(seq.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  void EndWrite() {
+    auto &seq = Header()->seq;
+    seq.store(seq.load(std::memory_order_relaxed) + 1,
+              std::memory_order_release);
+  }
+
+ private:
+  bool _enabledFlag;
+  void *_head;
+  size_t _size;
+  uint32_t _classN;
+  int64_t _intervalMs;
+  char _path[64];
+};
+
+extern StatShm statShm;
+#endif
+}  // namespace mc
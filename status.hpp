@@ -16,37 +16,106 @@
  */
 
 #pragma once
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 
+#include "debug.hpp"
+
 namespace mc {
+// NOTE: no user-provided constructor (see BufferStatus)
 class Status {
  public:
-  Status()
-      : _currentAppUsedMemoyUsage(0),
-        _currentUsedMemoryUsage(0),
-        _currentBufferMemoryUsage(0) {}
+  Status() = default;
 
   int64_t &CurrentAppUsedMemoryUsage() { return _currentAppUsedMemoyUsage; }
   int64_t &CurrentUsedMemoryUsage() { return _currentUsedMemoryUsage; }
+  // NOTE: bytes of chunks cached in the local stacks of the thread
   int64_t &CurrentBufferMemoryUsage() { return _currentBufferMemoryUsage; }
+  // NOTE: bytes of containers stolen by other threads which are not yet
+  // subtracted from CurrentBufferMemoryUsage
+  std::atomic<int64_t> &StolenBufferMemoryUsage() {
+    return _stolenBufferMemoryUsage;
+  }
+  // NOTE: bytes which the thread can map without checking the heap limit
+  int64_t &HeapCreditBytes() { return _heapCreditBytes; }
+  // NOTE: free(3) returns chunks to the global stacks (thread.tcache.enabled)
+  bool &CacheDisabledFlag() { return _cacheDisabledFlag; }
+  // NOTE: # of refills from mmap of the thread (the clock of refill sizing)
+  int64_t &RefillClock() { return _refillClock; }
 
  private:
   int64_t
       _currentAppUsedMemoyUsage;  // raw memory usage which is not rounded up
   int64_t _currentUsedMemoryUsage;
   int64_t _currentBufferMemoryUsage;
+  std::atomic<int64_t> _stolenBufferMemoryUsage;
+  int64_t _heapCreditBytes;
+  int64_t _refillClock;
+  bool _cacheDisabledFlag;
 };
 
+// NOTE: no user-provided constructor
+// NOTE: this is updated by malloc(3) before the constructor of the global
+// allocator runs, so it relies on zero-initialization of static storage
 class BufferStatus {
  public:
-  BufferStatus() : _nBufferChunk(0), _nUsedChunk(0) {}
+  // NOTE: # of free(3) calls of a window of the high-water mark
+  static const int64_t WindowOpN = 1024;
+
+  BufferStatus() = default;
 
   int64_t &NBufferChunk() { return _nBufferChunk; }
+  // NOTE: # of chunks allocated by this thread and not yet freed by this
+  // thread (it can be negative because of frees from other threads)
   int64_t &NUsedChunk() { return _nUsedChunk; }
+  // NOTE: cumulative # of chunks carved by this thread (chunks unmapped by
+  // NOTE: malloc_trim are not subtracted)
+  int64_t &NCarvedChunkTotal() { return _nCarvedChunkTotal; }
+  // NOTE: # of chunks which are not migrated to the global stack (mc_reserve)
+  int64_t &NReservedChunk() { return _nReservedChunk; }
+  // NOTE: adaptive limit of cached bytes of this class
+  int64_t &TargetBytes() { return _targetBytes; }
+  // NOTE: # of chunks of the last refill from mmap (0: never refilled)
+  int64_t &RefillN() { return _refillN; }
+  // NOTE: Status::RefillClock() at the last refill
+  int64_t &LastRefillClock() { return _lastRefillClock; }
+
+  // NOTE: high-water mark of NUsedChunk over the last two windows
+  int64_t HighWaterMark() {
+    return std::max(_windowMaxUsedChunk, _preWindowMaxUsedChunk);
+  }
+  // NOTE: peak of NUsedChunk since the start (the pool which a profile
+  // NOTE: pre-carves)
+  int64_t PeakUsedChunk() {
+    return std::max(std::max(_peakUsedChunk, HighWaterMark()), _nUsedChunk);
+  }
+  // NOTE: called by free(3) of n chunks
+  // NOTE: return true when the window is rotated
+  bool OnFree(int64_t n = 1) {
+    _windowMaxUsedChunk = std::max(_windowMaxUsedChunk, _nUsedChunk);
+    _nUsedChunk -= n;
+    _nWindowOp += n;
+    if (LIKELY(_nWindowOp < WindowOpN)) return false;
+    _peakUsedChunk = std::max(_peakUsedChunk, _windowMaxUsedChunk);
+    _preWindowMaxUsedChunk = _windowMaxUsedChunk;
+    _windowMaxUsedChunk = std::max(_nUsedChunk, (int64_t)0);
+    _nWindowOp = 0;
+    return true;
+  }
 
  private:
   int64_t _nBufferChunk;
   int64_t _nUsedChunk;
+  int64_t _nCarvedChunkTotal;
+  int64_t _nReservedChunk;
+  int64_t _targetBytes;
+  int64_t _refillN;
+  int64_t _lastRefillClock;
+  int64_t _nWindowOp;
+  int64_t _windowMaxUsedChunk;
+  int64_t _preWindowMaxUsedChunk;
+  int64_t _peakUsedChunk;
 };
 
 class CallStat {
@@ -59,13 +128,13 @@ class CallStat {
     }
   }
 
-  void CallMalloc(size_t size) {
+  void CallMalloc(size_t size, int64_t n = 1) {
     if (!CALL_STATISTIC_FLAG) return;
-    _nMalloc[roundupLog2(size)]++;
+    _nMalloc[roundupLog2(size)] += n;
   }
-  void CallFree(size_t size) {
+  void CallFree(size_t size, int64_t n = 1) {
     if (!CALL_STATISTIC_FLAG) return;
-    _nFree[roundupLog2(size)]++;
+    _nFree[roundupLog2(size)] += n;
   }
   int64_t &NMallocAt(int i) { return _nMalloc[i]; }
   int64_t &NFreeAt(int i) { return _nFree[i]; }
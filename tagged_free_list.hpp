@@ -0,0 +1,75 @@
+/*
+ * Copyright 2017 Yamana Laboratory, Waseda University
+ * Supported by JST CREST Grant Number JPMJCR1503, Japan.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace mc {
+// NOTE: lock-free LIFO list linked through the first word of each node
+// NOTE: requires: nodes are never unmapped while they are in the list
+// NOTE: (a racing Pop() may read the link of a node which another thread has
+// NOTE: popped, but the ABA tag makes its CAS fail)
+// NOTE: no user-provided constructor (zero-initialized)
+class TaggedFreeList {
+ public:
+  static void *&Next(void *node) { return *(void **)node; }
+
+  bool IsEmpty() {
+    return ToPtr(_head.load(std::memory_order_relaxed)) == nullptr;
+  }
+  void Push(void *node) { PushList(node, node); }
+  // NOTE: requires: first -> ... -> last are linked by Next()
+  void PushList(void *first, void *last) {
+    uint64_t head = _head.load(std::memory_order_relaxed);
+    do {
+      Next(last) = ToPtr(head);
+    } while (!_head.compare_exchange_weak(head, Tagged(head, first),
+                                          std::memory_order_release));
+  }
+  void *Pop() {
+    uint64_t head = _head.load(std::memory_order_acquire);
+    while (ToPtr(head) != nullptr) {
+      void *next = Next(ToPtr(head));
+      if (_head.compare_exchange_weak(head, Tagged(head, next),
+                                      std::memory_order_acquire))
+        return ToPtr(head);
+    }
+    return nullptr;
+  }
+  // NOTE: detach the whole list (linked by Next())
+  void *PopAll() {
+    uint64_t head = _head.load(std::memory_order_acquire);
+    while (!_head.compare_exchange_weak(head, Tagged(head, nullptr),
+                                        std::memory_order_acquire)) {
+    }
+    return ToPtr(head);
+  }
+
+ private:
+  // NOTE: upper 16 bits: ABA tag, lower 48 bits: address
+  static const uint64_t AddrMask = ((uint64_t)1 << 48) - 1;
+  static void *ToPtr(uint64_t v) { return (void *)(v & AddrMask); }
+  static uint64_t Tagged(uint64_t head, void *ptr) {
+    return ((head | AddrMask) + 1) | ((uint64_t)ptr & AddrMask);
+  }
+
+  std::atomic<uint64_t> _head;
+};
+}  // namespace mc